@@ -58,6 +58,39 @@ int mozquic_new_connection(mozquic_connection_t **outConnection,
   if (inConfig->ignorePKI) {
     q->SetIgnorePKI();
   }
+  if (inConfig->builtinPacketProtection) {
+    q->SetBuiltinPacketProtection();
+  }
+  if (inConfig->enable0RTT) {
+    q->SetEnable0RTT();
+  }
+  q->SetHandshakeWorkers(inConfig->handshakeWorkers);
+  if (inConfig->releaseHandshakeState) {
+    q->SetReleaseHandshakeState();
+  }
+  if (inConfig->statelessRetry) {
+    q->SetStatelessRetry();
+  }
+  q->SetStatelessRetryRate(inConfig->statelessRetryRate);
+  if (inConfig->idleTimeout) {
+    q->SetIdleTimeout(inConfig->idleTimeout);
+  }
+  if (inConfig->intakeBudget) {
+    q->SetIntakeBudget(inConfig->intakeBudget);
+  }
+  if (inConfig->flushBudget) {
+    q->SetFlushBudget(inConfig->flushBudget);
+  }
+  q->SetIOTimeBudget(inConfig->ioTimeBudget);
+  if (inConfig->memoryBudget) {
+    q->SetMemoryBudget(inConfig->memoryBudget);
+  }
+  if (inConfig->streamSendBuffer) {
+    q->SetStreamSendBuffer(inConfig->streamSendBuffer);
+  }
+  if (inConfig->connectionSendBuffer) {
+    q->SetConnectionSendBuffer(inConfig->connectionSendBuffer);
+  }
   return MOZQUIC_OK;
 }
 
@@ -130,6 +163,54 @@ int mozquic_recv(mozquic_stream_t *stream, void *data, uint32_t avail,
   return rv;
 }
 
+int mozquic_recv_unordered(mozquic_stream_t *stream, void *data, uint32_t avail,
+                           uint64_t *offset, uint32_t *amount, int *fin)
+{
+  mozquic::MozQuicStreamPair *self(reinterpret_cast<mozquic::MozQuicStreamPair *>(stream));
+  bool f;
+  uint32_t a;
+  uint64_t o;
+  int rv = self->ReadUnordered((unsigned char *)data, avail, o, a, f);
+  *offset = o;
+  *fin = f;
+  *amount = a;
+  if (f && self->Done()) {
+    self->mMozQuic->DeleteStream(self->mStreamID);
+  }
+  return rv;
+}
+
+int mozquic_stream_set_priority(mozquic_stream_t *stream, uint8_t urgency,
+                                uint16_t weight, int incremental)
+{
+  if (!stream) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  mozquic::MozQuicStreamPair *self(reinterpret_cast<mozquic::MozQuicStreamPair *>(stream));
+  return self->mMozQuic->SetPriority(self, urgency, weight, incremental);
+}
+
+int mozquic_stream_set_unordered(mozquic_stream_t *stream)
+{
+  mozquic::MozQuicStreamPair *self(reinterpret_cast<mozquic::MozQuicStreamPair *>(stream));
+  return self->SetUnordered();
+}
+
+int mozquic_stream_set_read_lowat(mozquic_stream_t *stream, uint32_t bytes)
+{
+  mozquic::MozQuicStreamPair *self(reinterpret_cast<mozquic::MozQuicStreamPair *>(stream));
+  return self->SetReadLowat(bytes);
+}
+
+int mozquic_stream_set_cork(mozquic_stream_t *stream, int corked)
+{
+  if (!stream) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  mozquic::MozQuicStreamPair *self(reinterpret_cast<mozquic::MozQuicStreamPair *>(stream));
+  return self->mMozQuic->SetCork(self, corked);
+}
+
 int mozquic_set_event_callback(mozquic_connection_t *conn, int (*fx)(mozquic_connection_t *, uint32_t event, void * param))
 {
   mozquic::MozQuic *self(reinterpret_cast<mozquic::MozQuic *>(conn));
@@ -197,6 +278,41 @@ int mozquic_check_peer(mozquic_connection_t *conn, uint32_t deadlineMs)
   return self->CheckPeer(deadlineMs);
 }
 
+int mozquic_schedule_io(mozquic_connection_t *conn, uint32_t delayMs)
+{
+  mozquic::MozQuic *self(reinterpret_cast<mozquic::MozQuic *>(conn));
+  self->ScheduleIO(delayMs);
+  return MOZQUIC_OK;
+}
+
+int mozquic_get_stats(mozquic_connection_t *conn, struct mozquic_stats_t *stats)
+{
+  if (!conn || !stats) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  mozquic::MozQuic *self(reinterpret_cast<mozquic::MozQuic *>(conn));
+  self->GetStats(stats);
+  return MOZQUIC_OK;
+}
+
+int mozquic_export_session_ticket(const char *originName, int originPort,
+                                  unsigned char *data, uint32_t avail, uint32_t *written)
+{
+  if (!originName || !written) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  return mozquic::NSSHelper::ExportTicket(originName, originPort, data, avail, written);
+}
+
+int mozquic_import_session_ticket(const char *originName, int originPort,
+                                  const unsigned char *data, uint32_t len)
+{
+  if (!originName || !data || !len) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  return mozquic::NSSHelper::ImportTicket(originName, originPort, data, len);
+}
+
 #ifdef __cplusplus
 }
 #endif
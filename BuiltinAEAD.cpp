@@ -0,0 +1,957 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// in tree packet protection. AES-128/256-GCM on AES-NI and PCLMULQDQ and
+// ChaCha20-Poly1305 with an 8 way AVX2 ChaCha20. The code is compiled with
+// per function target attributes and only used after a cpuid check and a
+// self test against NSS, so the library still runs on anything NSS does.
+
+#include "MozQuic.h"
+#include "PacketProtection.h"
+#include "sslproto.h"
+#include "pk11pub.h"
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define MOZQUIC_BUILTIN_AEAD 1
+#include <immintrin.h>
+#define MOZQUIC_TARGET_AESNI __attribute__((target("aes,pclmul,ssse3")))
+#define MOZQUIC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace mozquic {
+
+#ifdef MOZQUIC_BUILTIN_AEAD
+
+static inline uint32_t
+Load32LE(const unsigned char *p)
+{
+  uint32_t rv;
+  memcpy(&rv, p, 4);
+  return rv;
+}
+
+static inline uint64_t
+Load64LE(const unsigned char *p)
+{
+  uint64_t rv;
+  memcpy(&rv, p, 8);
+  return rv;
+}
+
+// compare without an early exit so the timing does not leak the tag
+static bool
+TagMatch(const unsigned char *a, const unsigned char *b)
+{
+  unsigned char diff = 0;
+  for (int i = 0; i < 16; i++) {
+    diff |= a[i] ^ b[i];
+  }
+  return !diff;
+}
+
+////////////////////////////////////////////////////
+// AES-GCM
+
+// ghash works on byte reversed blocks so the carryless multiply lines up
+// with the bit reflected field representation (Gueron & Kounavis)
+MOZQUIC_TARGET_AESNI static inline __m128i
+ByteSwap128(__m128i x)
+{
+  return _mm_shuffle_epi8(x, _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                           7, 6, 5, 4, 3, 2, 1, 0));
+}
+
+// unreduced product, accumulated so a group of blocks only pays for one
+// reduction
+MOZQUIC_TARGET_AESNI static inline void
+ClMulAcc(__m128i a, __m128i b, __m128i &lo, __m128i &mid, __m128i &hi)
+{
+  lo = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00));
+  hi = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11));
+  mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(a, b, 0x10));
+  mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(a, b, 0x01));
+}
+
+MOZQUIC_TARGET_AESNI static inline __m128i
+GHashReduce(__m128i lo, __m128i mid, __m128i hi)
+{
+  __m128i t3 = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+  __m128i t6 = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+  // shift the 256 bit product left by one for the reflection
+  __m128i t7 = _mm_srli_epi32(t3, 31);
+  __m128i t8 = _mm_srli_epi32(t6, 31);
+  t3 = _mm_slli_epi32(t3, 1);
+  t6 = _mm_slli_epi32(t6, 1);
+  __m128i t9 = _mm_srli_si128(t7, 12);
+  t8 = _mm_slli_si128(t8, 4);
+  t7 = _mm_slli_si128(t7, 4);
+  t3 = _mm_or_si128(t3, t7);
+  t6 = _mm_or_si128(t6, t8);
+  t6 = _mm_or_si128(t6, t9);
+
+  // reduce modulo x^128 + x^7 + x^2 + x + 1
+  t7 = _mm_slli_epi32(t3, 31);
+  t8 = _mm_slli_epi32(t3, 30);
+  t9 = _mm_slli_epi32(t3, 25);
+  t7 = _mm_xor_si128(t7, t8);
+  t7 = _mm_xor_si128(t7, t9);
+  t8 = _mm_srli_si128(t7, 4);
+  t7 = _mm_slli_si128(t7, 12);
+  t3 = _mm_xor_si128(t3, t7);
+
+  __m128i t2 = _mm_srli_epi32(t3, 1);
+  __m128i t4 = _mm_srli_epi32(t3, 2);
+  __m128i t5 = _mm_srli_epi32(t3, 7);
+  t2 = _mm_xor_si128(t2, t4);
+  t2 = _mm_xor_si128(t2, t5);
+  t2 = _mm_xor_si128(t2, t8);
+  t3 = _mm_xor_si128(t3, t2);
+  return _mm_xor_si128(t6, t3);
+}
+
+MOZQUIC_TARGET_AESNI static inline __m128i
+GHashMul(__m128i a, __m128i b)
+{
+  __m128i lo = _mm_setzero_si128();
+  __m128i mid = _mm_setzero_si128();
+  __m128i hi = _mm_setzero_si128();
+  ClMulAcc(a, b, lo, mid, hi);
+  return GHashReduce(lo, mid, hi);
+}
+
+MOZQUIC_TARGET_AESNI static inline __m128i
+AESKeyStep(__m128i key, __m128i assist)
+{
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, assist);
+}
+
+class AESGCMPacketProtection final : public PacketProtection
+{
+public:
+  static const int kParallel = 8;
+
+  MOZQUIC_TARGET_AESNI
+  AESGCMPacketProtection(const unsigned char *key, unsigned int keyLen, const unsigned char *iv)
+  {
+    memcpy(mIV, iv, sizeof(mIV));
+    __m128i *rk = mRoundKeys;
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    if (keyLen == 16) {
+      mRounds = 10;
+#define MOZQUIC_AES128_STEP(i, rcon)                                        \
+      rk[i] = AESKeyStep(rk[i - 1],                                         \
+                         _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff))
+      MOZQUIC_AES128_STEP(1, 0x01);
+      MOZQUIC_AES128_STEP(2, 0x02);
+      MOZQUIC_AES128_STEP(3, 0x04);
+      MOZQUIC_AES128_STEP(4, 0x08);
+      MOZQUIC_AES128_STEP(5, 0x10);
+      MOZQUIC_AES128_STEP(6, 0x20);
+      MOZQUIC_AES128_STEP(7, 0x40);
+      MOZQUIC_AES128_STEP(8, 0x80);
+      MOZQUIC_AES128_STEP(9, 0x1b);
+      MOZQUIC_AES128_STEP(10, 0x36);
+#undef MOZQUIC_AES128_STEP
+    } else {
+      mRounds = 14;
+      rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+#define MOZQUIC_AES256_STEP(i, rcon)                                        \
+      rk[i] = AESKeyStep(rk[i - 2],                                         \
+                         _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i - 1], rcon), 0xff)); \
+      if (i < 14) {                                                         \
+        rk[i + 1] = AESKeyStep(rk[i - 1],                                   \
+                               _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i], 0), 0xaa)); \
+      }
+      MOZQUIC_AES256_STEP(2, 0x01);
+      MOZQUIC_AES256_STEP(4, 0x02);
+      MOZQUIC_AES256_STEP(6, 0x04);
+      MOZQUIC_AES256_STEP(8, 0x08);
+      MOZQUIC_AES256_STEP(10, 0x10);
+      MOZQUIC_AES256_STEP(12, 0x20);
+      MOZQUIC_AES256_STEP(14, 0x40);
+#undef MOZQUIC_AES256_STEP
+    }
+
+    // H^1 .. H^8 for the aggregated ghash
+    mH[0] = ByteSwap128(Encrypt(_mm_setzero_si128()));
+    for (int i = 1; i < kParallel; i++) {
+      mH[i] = GHashMul(mH[i - 1], mH[0]);
+    }
+  }
+
+  ~AESGCMPacketProtection()
+  {
+    memset((void *)mRoundKeys, 0, sizeof(mRoundKeys));
+    memset((void *)mH, 0, sizeof(mH));
+  }
+
+  const char *Name() override { return "builtin aes-gcm"; }
+
+  uint32_t Seal(AEADBlock *blocks, uint32_t count) override
+  {
+    uint32_t rv = MOZQUIC_OK;
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].written = 0;
+      blocks[i].rv = SealOne(blocks[i]);
+      if (blocks[i].rv != MOZQUIC_OK) {
+        rv = blocks[i].rv;
+      }
+    }
+    return rv;
+  }
+
+  uint32_t Open(AEADBlock *blocks, uint32_t count) override
+  {
+    uint32_t rv = MOZQUIC_OK;
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].written = 0;
+      blocks[i].rv = OpenOne(blocks[i]);
+      if (blocks[i].rv != MOZQUIC_OK) {
+        rv = blocks[i].rv;
+      }
+    }
+    return rv;
+  }
+
+private:
+  MOZQUIC_TARGET_AESNI __m128i
+  Encrypt(__m128i x)
+  {
+    x = _mm_xor_si128(x, mRoundKeys[0]);
+    for (int r = 1; r < mRounds; r++) {
+      x = _mm_aesenc_si128(x, mRoundKeys[r]);
+    }
+    return _mm_aesenclast_si128(x, mRoundKeys[mRounds]);
+  }
+
+  // the kParallel aes pipelines are independent so they overlap in the
+  // aesenc units
+  MOZQUIC_TARGET_AESNI void
+  EncryptParallel(__m128i *x)
+  {
+    for (int i = 0; i < kParallel; i++) {
+      x[i] = _mm_xor_si128(x[i], mRoundKeys[0]);
+    }
+    for (int r = 1; r < mRounds; r++) {
+      __m128i k = mRoundKeys[r];
+      for (int i = 0; i < kParallel; i++) {
+        x[i] = _mm_aesenc_si128(x[i], k);
+      }
+    }
+    __m128i k = mRoundKeys[mRounds];
+    for (int i = 0; i < kParallel; i++) {
+      x[i] = _mm_aesenclast_si128(x[i], k);
+    }
+  }
+
+  MOZQUIC_TARGET_AESNI __m128i
+  GHash(__m128i x, const unsigned char *data, uint32_t len)
+  {
+    while (len >= 16 * kParallel) {
+      __m128i lo = _mm_setzero_si128();
+      __m128i mid = _mm_setzero_si128();
+      __m128i hi = _mm_setzero_si128();
+      for (int i = 0; i < kParallel; i++) {
+        __m128i b = ByteSwap128(_mm_loadu_si128((const __m128i *)(data + 16 * i)));
+        if (!i) {
+          b = _mm_xor_si128(b, x);
+        }
+        ClMulAcc(b, mH[kParallel - 1 - i], lo, mid, hi);
+      }
+      x = GHashReduce(lo, mid, hi);
+      data += 16 * kParallel;
+      len -= 16 * kParallel;
+    }
+    while (len >= 16) {
+      __m128i b = ByteSwap128(_mm_loadu_si128((const __m128i *)data));
+      x = GHashMul(_mm_xor_si128(x, b), mH[0]);
+      data += 16;
+      len -= 16;
+    }
+    if (len) {
+      unsigned char pad[16];
+      memset(pad, 0, sizeof(pad));
+      memcpy(pad, data, len);
+      __m128i b = ByteSwap128(_mm_loadu_si128((const __m128i *)pad));
+      x = GHashMul(_mm_xor_si128(x, b), mH[0]);
+    }
+    return x;
+  }
+
+  MOZQUIC_TARGET_AESNI __m128i
+  CounterBlock(const uint32_t *n, uint32_t ctr)
+  {
+    return _mm_setr_epi32(n[0], n[1], n[2], __builtin_bswap32(ctr));
+  }
+
+  // ctr mode and ghash in one pass. The clmuls for the previous 8 blocks
+  // (sealing) or the current 8 (opening) are issued between the aes rounds
+  // so both units stay busy. in and out may be the same buffer
+  MOZQUIC_TARGET_AESNI void
+  Crypt(bool seal, const unsigned char *nonce, const unsigned char *aad, uint32_t aadLen,
+        const unsigned char *in, unsigned char *out, uint32_t len, unsigned char *tag)
+  {
+    uint32_t n[3] = { Load32LE(nonce), Load32LE(nonce + 4), Load32LE(nonce + 8) };
+    uint32_t ctr = 2; // 1 is used for the tag
+    uint32_t total = len;
+    __m128i x = GHash(_mm_setzero_si128(), aad, aadLen);
+    const unsigned char *sealed = nullptr; // previous chunk, not hashed yet
+
+    while (len >= 16 * kParallel) {
+      __m128i c[kParallel];
+      __m128i h[kParallel];
+      __m128i lo = _mm_setzero_si128();
+      __m128i mid = _mm_setzero_si128();
+      __m128i hi = _mm_setzero_si128();
+      const unsigned char *hashSrc = seal ? sealed : in;
+
+      for (int i = 0; i < kParallel; i++) {
+        c[i] = _mm_xor_si128(CounterBlock(n, ctr + i), mRoundKeys[0]);
+      }
+      ctr += kParallel;
+      if (hashSrc) {
+        for (int i = 0; i < kParallel; i++) {
+          h[i] = ByteSwap128(_mm_loadu_si128((const __m128i *)(hashSrc + 16 * i)));
+        }
+        h[0] = _mm_xor_si128(h[0], x);
+      }
+      for (int r = 1; r < mRounds; r++) {
+        __m128i k = mRoundKeys[r];
+        for (int i = 0; i < kParallel; i++) {
+          c[i] = _mm_aesenc_si128(c[i], k);
+        }
+        if (hashSrc && r <= kParallel) {
+          ClMulAcc(h[r - 1], mH[kParallel - r], lo, mid, hi);
+        }
+      }
+      __m128i k = mRoundKeys[mRounds];
+      for (int i = 0; i < kParallel; i++) {
+        c[i] = _mm_aesenclast_si128(c[i], k);
+      }
+      if (hashSrc) {
+        x = GHashReduce(lo, mid, hi);
+      }
+      for (int i = 0; i < kParallel; i++) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(in + 16 * i));
+        _mm_storeu_si128((__m128i *)(out + 16 * i), _mm_xor_si128(d, c[i]));
+      }
+      if (seal) {
+        sealed = out;
+      }
+      in += 16 * kParallel;
+      out += 16 * kParallel;
+      len -= 16 * kParallel;
+    }
+    if (sealed) {
+      x = GHash(x, sealed, 16 * kParallel);
+    }
+
+    // the tail, a block at a time
+    if (!seal) {
+      x = GHash(x, in, len);
+    }
+    const unsigned char *tailIn = in;
+    unsigned char *tailOut = out;
+    uint32_t tailLen = len;
+    while (tailLen) {
+      __m128i k = Encrypt(CounterBlock(n, ctr++));
+      if (tailLen >= 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)tailIn);
+        _mm_storeu_si128((__m128i *)tailOut, _mm_xor_si128(d, k));
+        tailIn += 16;
+        tailOut += 16;
+        tailLen -= 16;
+      } else {
+        unsigned char ks[16];
+        _mm_storeu_si128((__m128i *)ks, k);
+        for (uint32_t i = 0; i < tailLen; i++) {
+          tailOut[i] = tailIn[i] ^ ks[i];
+        }
+        tailLen = 0;
+      }
+    }
+    if (seal) {
+      x = GHash(x, out, len);
+    }
+
+    __m128i lengths = _mm_set_epi64x((uint64_t)aadLen * 8, (uint64_t)total * 8);
+    x = GHashMul(_mm_xor_si128(x, lengths), mH[0]);
+    _mm_storeu_si128((__m128i *)tag, _mm_xor_si128(ByteSwap128(x), Encrypt(CounterBlock(n, 1))));
+  }
+
+  uint32_t SealOne(AEADBlock &b)
+  {
+    if (b.outAvail < b.inLen + kTagLen) {
+      return MOZQUIC_ERR_GENERAL;
+    }
+    unsigned char nonce[kNonceLen];
+    MakeNonce(mIV, b.packetNumber, nonce);
+    Crypt(true, nonce, b.aeadData, b.aeadLen, b.in, b.out, b.inLen, b.out + b.inLen);
+    b.written = b.inLen + kTagLen;
+    return MOZQUIC_OK;
+  }
+
+  // the plaintext is written before the tag is known, it is wiped again if
+  // the tag does not match
+  uint32_t OpenOne(AEADBlock &b)
+  {
+    if ((b.inLen < kTagLen) || (b.outAvail < b.inLen - kTagLen)) {
+      return MOZQUIC_ERR_GENERAL;
+    }
+    uint32_t ctLen = b.inLen - kTagLen;
+    unsigned char nonce[kNonceLen];
+    unsigned char received[kTagLen];
+    unsigned char tag[kTagLen];
+    memcpy(received, b.in + ctLen, kTagLen);
+    MakeNonce(mIV, b.packetNumber, nonce);
+    Crypt(false, nonce, b.aeadData, b.aeadLen, b.in, b.out, ctLen, tag);
+    if (!TagMatch(tag, received)) {
+      memset(b.out, 0, ctLen);
+      return MOZQUIC_ERR_CRYPTO;
+    }
+    b.written = ctLen;
+    return MOZQUIC_OK;
+  }
+
+  __m128i       mRoundKeys[15];
+  __m128i       mH[kParallel];
+  int           mRounds;
+  unsigned char mIV[kNonceLen];
+};
+
+////////////////////////////////////////////////////
+// ChaCha20-Poly1305
+
+MOZQUIC_TARGET_AVX2 static inline __m256i
+Rotl32x8(__m256i x, int n)
+{
+  return _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - n));
+}
+
+#define MOZQUIC_CHACHA_QR(a, b, c, d)                                   \
+  x[a] = _mm256_add_epi32(x[a], x[b]);                                  \
+  x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot16);      \
+  x[c] = _mm256_add_epi32(x[c], x[d]);                                  \
+  x[b] = Rotl32x8(_mm256_xor_si256(x[b], x[c]), 12);                    \
+  x[a] = _mm256_add_epi32(x[a], x[b]);                                  \
+  x[d] = _mm256_shuffle_epi8(_mm256_xor_si256(x[d], x[a]), rot8);       \
+  x[c] = _mm256_add_epi32(x[c], x[d]);                                  \
+  x[b] = Rotl32x8(_mm256_xor_si256(x[b], x[c]), 7)
+
+// 8x8 transpose of 32 bit words. afterwards v[j] holds lane j of every input
+MOZQUIC_TARGET_AVX2 static inline void
+Transpose8x8(__m256i *v)
+{
+  __m256i t0 = _mm256_unpacklo_epi32(v[0], v[1]);
+  __m256i t1 = _mm256_unpackhi_epi32(v[0], v[1]);
+  __m256i t2 = _mm256_unpacklo_epi32(v[2], v[3]);
+  __m256i t3 = _mm256_unpackhi_epi32(v[2], v[3]);
+  __m256i t4 = _mm256_unpacklo_epi32(v[4], v[5]);
+  __m256i t5 = _mm256_unpackhi_epi32(v[4], v[5]);
+  __m256i t6 = _mm256_unpacklo_epi32(v[6], v[7]);
+  __m256i t7 = _mm256_unpackhi_epi32(v[6], v[7]);
+  __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+  __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+  __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+  __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+  __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+  __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+  __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+  __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+  v[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+  v[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+  v[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+  v[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+  v[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+  v[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+  v[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+  v[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+// 8 chacha20 blocks (512 bytes) starting at counter, one block per lane.
+// out = in ^ keystream, or just the keystream when in is nullptr. in and
+// out may be the same buffer
+MOZQUIC_TARGET_AVX2 static void
+ChaCha20x8(const uint32_t *key, const uint32_t *nonce, uint32_t counter,
+           const unsigned char *in, unsigned char *out)
+{
+  const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                         2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+  const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+  __m256i orig[16];
+  __m256i x[16];
+  orig[0] = _mm256_set1_epi32(0x61707865);
+  orig[1] = _mm256_set1_epi32(0x3320646e);
+  orig[2] = _mm256_set1_epi32(0x79622d32);
+  orig[3] = _mm256_set1_epi32(0x6b206574);
+  for (int i = 0; i < 8; i++) {
+    orig[4 + i] = _mm256_set1_epi32(key[i]);
+  }
+  orig[12] = _mm256_add_epi32(_mm256_set1_epi32(counter),
+                              _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+  for (int i = 0; i < 3; i++) {
+    orig[13 + i] = _mm256_set1_epi32(nonce[i]);
+  }
+  for (int i = 0; i < 16; i++) {
+    x[i] = orig[i];
+  }
+
+  for (int i = 0; i < 10; i++) {
+    MOZQUIC_CHACHA_QR(0, 4, 8, 12);
+    MOZQUIC_CHACHA_QR(1, 5, 9, 13);
+    MOZQUIC_CHACHA_QR(2, 6, 10, 14);
+    MOZQUIC_CHACHA_QR(3, 7, 11, 15);
+    MOZQUIC_CHACHA_QR(0, 5, 10, 15);
+    MOZQUIC_CHACHA_QR(1, 6, 11, 12);
+    MOZQUIC_CHACHA_QR(2, 7, 8, 13);
+    MOZQUIC_CHACHA_QR(3, 4, 9, 14);
+  }
+
+  for (int i = 0; i < 16; i++) {
+    x[i] = _mm256_add_epi32(x[i], orig[i]);
+  }
+  Transpose8x8(x);
+  Transpose8x8(x + 8);
+
+  for (int j = 0; j < 8; j++) {
+    __m256i k0 = x[j];
+    __m256i k1 = x[8 + j];
+    if (in) {
+      k0 = _mm256_xor_si256(k0, _mm256_loadu_si256((const __m256i *)(in + 64 * j)));
+      k1 = _mm256_xor_si256(k1, _mm256_loadu_si256((const __m256i *)(in + 64 * j + 32)));
+    }
+    _mm256_storeu_si256((__m256i *)(out + 64 * j), k0);
+    _mm256_storeu_si256((__m256i *)(out + 64 * j + 32), k1);
+  }
+}
+#undef MOZQUIC_CHACHA_QR
+
+// 44/44/42 bit limb poly1305. the aead input is always padded to whole
+// blocks so there is no partial final block to handle.
+class Poly1305
+{
+public:
+  explicit Poly1305(const unsigned char *key)
+    : mH0(0), mH1(0), mH2(0)
+  {
+    uint64_t t0 = Load64LE(key);
+    uint64_t t1 = Load64LE(key + 8);
+    mR0 = t0 & 0xffc0fffffffULL;
+    mR1 = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+    mR2 = (t1 >> 24) & 0x00ffffffc0fULL;
+    mPad0 = Load64LE(key + 16);
+    mPad1 = Load64LE(key + 24);
+  }
+
+  // len need not be a multiple of 16, the last block is zero padded
+  void Update(const unsigned char *m, uint32_t len)
+  {
+    while (len >= 16) {
+      Block(m);
+      m += 16;
+      len -= 16;
+    }
+    if (len) {
+      unsigned char pad[16];
+      memset(pad, 0, sizeof(pad));
+      memcpy(pad, m, len);
+      Block(pad);
+    }
+  }
+
+  void Finish(unsigned char *tag)
+  {
+    const uint64_t m44 = 0xfffffffffffULL;
+    const uint64_t m42 = 0x3ffffffffffULL;
+    uint64_t h0 = mH0, h1 = mH1, h2 = mH2, c;
+
+    c = h1 >> 44; h1 &= m44;
+    h2 += c;      c = h2 >> 42; h2 &= m42;
+    h0 += c * 5;  c = h0 >> 44; h0 &= m44;
+    h1 += c;      c = h1 >> 44; h1 &= m44;
+    h2 += c;      c = h2 >> 42; h2 &= m42;
+    h0 += c * 5;  c = h0 >> 44; h0 &= m44;
+    h1 += c;
+
+    // h - p, selected if it did not go negative
+    uint64_t g0 = h0 + 5; c = g0 >> 44; g0 &= m44;
+    uint64_t g1 = h1 + c; c = g1 >> 44; g1 &= m44;
+    uint64_t g2 = h2 + c - (1ULL << 42);
+    c = (g2 >> 63) - 1;
+    g0 &= c; g1 &= c; g2 &= c;
+    c = ~c;
+    h0 = (h0 & c) | g0;
+    h1 = (h1 & c) | g1;
+    h2 = (h2 & c) | g2;
+
+    h0 += mPad0 & m44;                                 c = h0 >> 44; h0 &= m44;
+    h1 += (((mPad0 >> 44) | (mPad1 << 20)) & m44) + c; c = h1 >> 44; h1 &= m44;
+    h2 += ((mPad1 >> 24) & m42) + c;                   h2 &= m42;
+
+    h0 = h0 | (h1 << 44);
+    h1 = (h1 >> 20) | (h2 << 24);
+    memcpy(tag, &h0, 8);
+    memcpy(tag + 8, &h1, 8);
+  }
+
+private:
+  void Block(const unsigned char *m)
+  {
+    typedef unsigned __int128 uint128_t;
+    const uint64_t m44 = 0xfffffffffffULL;
+    const uint64_t m42 = 0x3ffffffffffULL;
+    uint64_t s1 = mR1 * (5 << 2);
+    uint64_t s2 = mR2 * (5 << 2);
+    uint64_t t0 = Load64LE(m);
+    uint64_t t1 = Load64LE(m + 8);
+
+    mH0 += t0 & m44;
+    mH1 += ((t0 >> 44) | (t1 << 20)) & m44;
+    mH2 += ((t1 >> 24) & m42) | (1ULL << 40);
+
+    uint128_t d0 = (uint128_t)mH0 * mR0 + (uint128_t)mH1 * s2 + (uint128_t)mH2 * s1;
+    uint128_t d1 = (uint128_t)mH0 * mR1 + (uint128_t)mH1 * mR0 + (uint128_t)mH2 * s2;
+    uint128_t d2 = (uint128_t)mH0 * mR2 + (uint128_t)mH1 * mR1 + (uint128_t)mH2 * mR0;
+
+    uint64_t c = (uint64_t)(d0 >> 44); mH0 = (uint64_t)d0 & m44;
+    d1 += c; c = (uint64_t)(d1 >> 44); mH1 = (uint64_t)d1 & m44;
+    d2 += c; c = (uint64_t)(d2 >> 42); mH2 = (uint64_t)d2 & m42;
+    mH0 += c * 5; c = mH0 >> 44; mH0 &= m44;
+    mH1 += c;
+  }
+
+  uint64_t mR0, mR1, mR2;
+  uint64_t mH0, mH1, mH2;
+  uint64_t mPad0, mPad1;
+};
+
+class ChaChaPolyPacketProtection final : public PacketProtection
+{
+public:
+  ChaChaPolyPacketProtection(const unsigned char *key, const unsigned char *iv)
+  {
+    for (int i = 0; i < 8; i++) {
+      mKey[i] = Load32LE(key + 4 * i);
+    }
+    memcpy(mIV, iv, sizeof(mIV));
+  }
+
+  ~ChaChaPolyPacketProtection()
+  {
+    memset(mKey, 0, sizeof(mKey));
+  }
+
+  const char *Name() override { return "builtin chacha20-poly1305"; }
+
+  uint32_t Seal(AEADBlock *blocks, uint32_t count) override
+  {
+    uint32_t rv = MOZQUIC_OK;
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].written = 0;
+      blocks[i].rv = SealOne(blocks[i]);
+      if (blocks[i].rv != MOZQUIC_OK) {
+        rv = blocks[i].rv;
+      }
+    }
+    return rv;
+  }
+
+  uint32_t Open(AEADBlock *blocks, uint32_t count) override
+  {
+    uint32_t rv = MOZQUIC_OK;
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].written = 0;
+      blocks[i].rv = OpenOne(blocks[i]);
+      if (blocks[i].rv != MOZQUIC_OK) {
+        rv = blocks[i].rv;
+      }
+    }
+    return rv;
+  }
+
+private:
+  static const uint32_t kBatch = 512;
+
+  // the first keystream batch covers block 0 (the poly1305 key) and the
+  // first 448 bytes of the payload, which is most of a typical packet
+  void Crypt(const uint32_t *nonce, const unsigned char *in, unsigned char *out,
+             uint32_t len, unsigned char *polyKey)
+  {
+    unsigned char ks[kBatch];
+    ChaCha20x8(mKey, nonce, 0, nullptr, ks);
+    memcpy(polyKey, ks, 32);
+    uint32_t amt = (len < kBatch - 64) ? len : (kBatch - 64);
+    for (uint32_t i = 0; i < amt; i++) {
+      out[i] = in[i] ^ ks[64 + i];
+    }
+    uint32_t pos = amt;
+    uint32_t counter = 8;
+    while (len - pos >= kBatch) {
+      ChaCha20x8(mKey, nonce, counter, in + pos, out + pos);
+      pos += kBatch;
+      counter += 8;
+    }
+    if (pos < len) {
+      ChaCha20x8(mKey, nonce, counter, nullptr, ks);
+      for (uint32_t i = 0; pos + i < len; i++) {
+        out[pos + i] = in[pos + i] ^ ks[i];
+      }
+    }
+    memset(ks, 0, sizeof(ks));
+  }
+
+  void Tag(const unsigned char *polyKey, const unsigned char *aad, uint32_t aadLen,
+           const unsigned char *ct, uint32_t ctLen, unsigned char *tag)
+  {
+    Poly1305 poly(polyKey);
+    poly.Update(aad, aadLen);
+    poly.Update(ct, ctLen);
+    unsigned char lengths[16];
+    uint64_t tmp = aadLen;
+    memcpy(lengths, &tmp, 8);
+    tmp = ctLen;
+    memcpy(lengths + 8, &tmp, 8);
+    poly.Update(lengths, 16);
+    poly.Finish(tag);
+  }
+
+  void Nonce(uint64_t packetNumber, uint32_t *nonce)
+  {
+    unsigned char tmp[kNonceLen];
+    MakeNonce(mIV, packetNumber, tmp);
+    for (int i = 0; i < 3; i++) {
+      nonce[i] = Load32LE(tmp + 4 * i);
+    }
+  }
+
+  uint32_t SealOne(AEADBlock &b)
+  {
+    if (b.outAvail < b.inLen + kTagLen) {
+      return MOZQUIC_ERR_GENERAL;
+    }
+    uint32_t nonce[3];
+    unsigned char polyKey[32];
+    Nonce(b.packetNumber, nonce);
+    Crypt(nonce, b.in, b.out, b.inLen, polyKey);
+    Tag(polyKey, b.aeadData, b.aeadLen, b.out, b.inLen, b.out + b.inLen);
+    b.written = b.inLen + kTagLen;
+    return MOZQUIC_OK;
+  }
+
+  uint32_t OpenOne(AEADBlock &b)
+  {
+    if ((b.inLen < kTagLen) || (b.outAvail < b.inLen - kTagLen)) {
+      return MOZQUIC_ERR_GENERAL;
+    }
+    uint32_t ctLen = b.inLen - kTagLen;
+    uint32_t nonce[3];
+    unsigned char polyKey[32];
+    unsigned char tag[kTagLen];
+    Nonce(b.packetNumber, nonce);
+
+    // only the first keystream block is needed to check the tag
+    unsigned char ks[kBatch];
+    ChaCha20x8(mKey, nonce, 0, nullptr, ks);
+    memcpy(polyKey, ks, 32);
+    memset(ks, 0, sizeof(ks));
+    Tag(polyKey, b.aeadData, b.aeadLen, b.in, ctLen, tag);
+    if (!TagMatch(tag, b.in + ctLen)) {
+      return MOZQUIC_ERR_CRYPTO;
+    }
+    Crypt(nonce, b.in, b.out, ctLen, polyKey);
+    b.written = ctLen;
+    return MOZQUIC_OK;
+  }
+
+  uint32_t      mKey[8];
+  unsigned char mIV[kNonceLen];
+};
+
+////////////////////////////////////////////////////
+// cpu dispatch and self test
+
+static bool
+CPUSupports(uint16_t cipherSuite)
+{
+  __builtin_cpu_init();
+  if (cipherSuite == TLS_AES_128_GCM_SHA256 || cipherSuite == TLS_AES_256_GCM_SHA384) {
+    return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") &&
+      __builtin_cpu_supports("ssse3");
+  }
+  if (cipherSuite == TLS_CHACHA20_POLY1305_SHA256) {
+    return __builtin_cpu_supports("avx2");
+  }
+  return false;
+}
+
+static PacketProtection *
+MakeBuiltin(uint16_t cipherSuite, const unsigned char *key, unsigned int keyLen,
+            const unsigned char *iv)
+{
+  if (cipherSuite == TLS_AES_128_GCM_SHA256 && keyLen == 16) {
+    return new AESGCMPacketProtection(key, keyLen, iv);
+  }
+  if (cipherSuite == TLS_AES_256_GCM_SHA384 && keyLen == 32) {
+    return new AESGCMPacketProtection(key, keyLen, iv);
+  }
+  if (cipherSuite == TLS_CHACHA20_POLY1305_SHA256 && keyLen == 32) {
+    return new ChaChaPolyPacketProtection(key, iv);
+  }
+  return nullptr;
+}
+
+// seal a set of packets with both nss and the builtin code and require
+// identical output, then check the builtin open takes the nss output and
+// rejects a corrupted tag. The lengths straddle the simd block and batch
+// boundaries.
+static bool
+SelfTest(uint16_t cipherSuite)
+{
+  static const uint32_t kLengths[] = { 0, 1, 15, 16, 17, 63, 64, 65, 127, 128, 129,
+                                       447, 448, 449, 511, 512, 513, 1000, 1199, 1452 };
+  static const uint32_t kAADLengths[] = { 0, 9, 13, 17, 33 };
+  static const uint32_t kMaxLen = 1452;
+
+  unsigned int keyLen = (cipherSuite == TLS_AES_128_GCM_SHA256) ? 16 : 32;
+  CK_MECHANISM_TYPE mech = (cipherSuite == TLS_CHACHA20_POLY1305_SHA256) ?
+    CKM_NSS_CHACHA20_POLY1305 : CKM_AES_GCM;
+  unsigned char key[PacketProtection::kMaxKeyLen];
+  unsigned char iv[PacketProtection::kNonceLen];
+  for (unsigned int i = 0; i < sizeof(key); i++) {
+    key[i] = 0x80 + i * 7;
+  }
+  for (unsigned int i = 0; i < sizeof(iv); i++) {
+    iv[i] = 0x4f ^ (i * 29);
+  }
+
+  PK11SlotInfo *slot = PK11_GetInternalSlot();
+  if (!slot) {
+    return false;
+  }
+  SECItem keyItem = {siBuffer, key, keyLen};
+  PK11SymKey *nssKey = PK11_ImportSymKey(slot, mech, PK11_OriginUnwrap,
+                                         CKA_ENCRYPT, &keyItem, nullptr);
+  PK11_FreeSlot(slot);
+  std::unique_ptr<PacketProtection> nss(PacketProtection::CreateNSS(cipherSuite, nssKey, iv, true));
+  std::unique_ptr<PacketProtection> builtin(MakeBuiltin(cipherSuite, key, keyLen, iv));
+  if (!nss || !builtin) {
+    return false;
+  }
+
+  std::unique_ptr<unsigned char []> plain(new unsigned char[kMaxLen]);
+  std::unique_ptr<unsigned char []> expected(new unsigned char[kMaxLen + PacketProtection::kTagLen]);
+  std::unique_ptr<unsigned char []> got(new unsigned char[kMaxLen + PacketProtection::kTagLen]);
+  unsigned char aad[33];
+  for (uint32_t i = 0; i < kMaxLen; i++) {
+    plain[i] = i * 13 + (i >> 8);
+  }
+  for (uint32_t i = 0; i < sizeof(aad); i++) {
+    aad[i] = 0xc0 | i;
+  }
+
+  uint64_t packetNumber = 0x1234567;
+  for (uint32_t len : kLengths) {
+    for (uint32_t aadLen : kAADLengths) {
+      packetNumber += 0x10001;
+      AEADBlock a = { aad, aadLen, plain.get(), len, packetNumber,
+                      expected.get(), kMaxLen + PacketProtection::kTagLen, 0, 0 };
+      AEADBlock b = { aad, aadLen, plain.get(), len, packetNumber,
+                      got.get(), kMaxLen + PacketProtection::kTagLen, 0, 0 };
+      if ((nss->Seal(&a, 1) != MOZQUIC_OK) || (builtin->Seal(&b, 1) != MOZQUIC_OK) ||
+          (a.written != len + PacketProtection::kTagLen) || (b.written != a.written) ||
+          memcmp(expected.get(), got.get(), a.written)) {
+        fprintf(stderr, "builtin aead self test seal mismatch suite %X len %d aad %d\n",
+                cipherSuite, len, aadLen);
+        return false;
+      }
+
+      AEADBlock o = { aad, aadLen, expected.get(), len + PacketProtection::kTagLen, packetNumber,
+                      got.get(), kMaxLen + PacketProtection::kTagLen, 0, 0 };
+      if ((builtin->Open(&o, 1) != MOZQUIC_OK) || (o.written != len) ||
+          memcmp(plain.get(), got.get(), len)) {
+        fprintf(stderr, "builtin aead self test open mismatch suite %X len %d aad %d\n",
+                cipherSuite, len, aadLen);
+        return false;
+      }
+
+      expected[len + (len % PacketProtection::kTagLen)] ^= 0x01;
+      o.written = 0;
+      if (builtin->Open(&o, 1) == MOZQUIC_OK) {
+        fprintf(stderr, "builtin aead self test accepted a bad packet suite %X len %d\n",
+                cipherSuite, len);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static bool
+CheckBuiltin(uint16_t cipherSuite)
+{
+  if (!CPUSupports(cipherSuite)) {
+    fprintf(stderr, "builtin aead not supported by this cpu for suite %X\n", cipherSuite);
+    return false;
+  }
+  return SelfTest(cipherSuite);
+}
+
+bool
+PacketProtection::BuiltinAvailable(uint16_t cipherSuite)
+{
+  // each suite is checked once per process
+  if (cipherSuite == TLS_AES_128_GCM_SHA256) {
+    static const bool available = CheckBuiltin(TLS_AES_128_GCM_SHA256);
+    return available;
+  }
+  if (cipherSuite == TLS_AES_256_GCM_SHA384) {
+    static const bool available = CheckBuiltin(TLS_AES_256_GCM_SHA384);
+    return available;
+  }
+  if (cipherSuite == TLS_CHACHA20_POLY1305_SHA256) {
+    static const bool available = CheckBuiltin(TLS_CHACHA20_POLY1305_SHA256);
+    return available;
+  }
+  return false;
+}
+
+PacketProtection *
+PacketProtection::CreateBuiltin(uint16_t cipherSuite,
+                                const unsigned char *key, unsigned int keyLen,
+                                const unsigned char *iv)
+{
+  if (!BuiltinAvailable(cipherSuite)) {
+    return nullptr;
+  }
+  return MakeBuiltin(cipherSuite, key, keyLen, iv);
+}
+
+#else
+
+bool
+PacketProtection::BuiltinAvailable(uint16_t cipherSuite)
+{
+  return false;
+}
+
+PacketProtection *
+PacketProtection::CreateBuiltin(uint16_t cipherSuite,
+                                const unsigned char *key, unsigned int keyLen,
+                                const unsigned char *iv)
+{
+  return nullptr;
+}
+
+#endif
+
+} // namespace
@@ -0,0 +1,260 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <memory>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace mozquic {
+
+// Flat open addressing map from a 64 bit connection id to a small value,
+// used by the server for the per packet demux. Each slot has a one byte
+// control entry holding 7 bits of its hash (or empty/deleted), and the
+// control bytes are probed 16 at a time so a lookup normally touches one
+// group of control bytes and one slot.
+//
+// Connection ids arrive straight off the wire, so the hash is keyed with
+// a per table secret to keep a peer from choosing ids that all land in one
+// probe chain.
+template <typename V>
+class ConnectionIDTable
+{
+public:
+  ConnectionIDTable()
+    : mCapacity(0)
+    , mSize(0)
+    , mGrowthLeft(0)
+  {
+    // replaced by SetKey before use, this just keeps the hash defined
+    mKey[0] = 0x243f6a8885a308d3ULL;
+    mKey[1] = 0x13198a2e03707344ULL;
+  }
+
+  // changing the key rehashes whatever is already in the table
+  void SetKey(const unsigned char key[16])
+  {
+    memcpy(mKey, key, 16);
+    Rehash(mCapacity);
+  }
+
+  V *Find(uint64_t cid)
+  {
+    if (!mSize) {
+      return nullptr;
+    }
+    uint64_t hash = Hash(cid);
+    uint8_t h2 = H2(hash);
+    uint32_t groupMask = (mCapacity / kGroupSize) - 1;
+    uint32_t group = H1(hash) & groupMask;
+    for (uint32_t probe = 1; ; probe++) {
+      const uint8_t *ctrl = mControl.get() + group * kGroupSize;
+      uint32_t match = MatchByte(ctrl, h2);
+      while (match) {
+        uint32_t idx = group * kGroupSize + __builtin_ctz(match);
+        if (mSlots[idx].mCID == cid) {
+          return &mSlots[idx].mValue;
+        }
+        match &= match - 1;
+      }
+      if (MatchByte(ctrl, kEmpty)) {
+        return nullptr;
+      }
+      // triangular probing visits every group once when the count is a
+      // power of 2
+      group = (group + probe) & groupMask;
+    }
+  }
+
+  bool Contains(uint64_t cid) { return Find(cid) != nullptr; }
+
+  // returns false (and changes nothing) if cid is already present
+  bool Insert(uint64_t cid, const V &value)
+  {
+    if (Find(cid)) {
+      return false;
+    }
+    if (!mGrowthLeft) {
+      // only grow when the table is really filling up, otherwise just
+      // sweep out the tombstones
+      Rehash((mSize * 2 >= MaxLoad(mCapacity)) ? (mCapacity ? mCapacity * 2 : kGroupSize)
+                                                : mCapacity);
+    }
+    uint64_t hash = Hash(cid);
+    uint32_t idx = FindInsertSlot(hash);
+    if (mControl[idx] == kEmpty) {
+      mGrowthLeft--;
+    }
+    mControl[idx] = H2(hash);
+    mSlots[idx].mCID = cid;
+    mSlots[idx].mValue = value;
+    mSize++;
+    return true;
+  }
+
+  bool Erase(uint64_t cid)
+  {
+    V *value = Find(cid);
+    if (!value) {
+      return false;
+    }
+    EraseSlot(SlotIndex(value));
+    return true;
+  }
+
+  // fn(cid, value) returns true to remove the entry
+  template <typename F>
+  void EraseIf(F fn)
+  {
+    for (uint32_t i = 0; i < mCapacity; i++) {
+      if (IsFull(mControl[i]) && fn(mSlots[i].mCID, mSlots[i].mValue)) {
+        EraseSlot(i);
+      }
+    }
+  }
+
+  uint32_t Size() const { return mSize; }
+
+private:
+  static const uint32_t kGroupSize = 16;
+  static const uint8_t kEmpty = 0x80;
+  static const uint8_t kDeleted = 0xfe;
+
+  struct Slot
+  {
+    uint64_t mCID;
+    V        mValue;
+  };
+
+  static bool IsFull(uint8_t c) { return !(c & 0x80); }
+  static uint32_t H1(uint64_t hash) { return (uint32_t)(hash >> 7); }
+  static uint8_t H2(uint64_t hash) { return hash & 0x7f; }
+  static uint32_t MaxLoad(uint32_t capacity) { return capacity - capacity / 8; }
+
+  // bit i is set when ctrl[i] == b
+  static uint32_t MatchByte(const uint8_t *ctrl, uint8_t b)
+  {
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i *)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)b)));
+#else
+    uint32_t rv = 0;
+    for (uint32_t i = 0; i < kGroupSize; i++) {
+      rv |= (ctrl[i] == b) << i;
+    }
+    return rv;
+#endif
+  }
+
+  // bit i is set when ctrl[i] is empty or deleted
+  static uint32_t MatchFree(const uint8_t *ctrl)
+  {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+#else
+    uint32_t rv = 0;
+    for (uint32_t i = 0; i < kGroupSize; i++) {
+      rv |= !IsFull(ctrl[i]) << i;
+    }
+    return rv;
+#endif
+  }
+
+  uint32_t SlotIndex(V *value)
+  {
+    return (uint32_t)(((char *)value - (char *)mSlots.get()) / sizeof(Slot));
+  }
+
+  uint32_t FindInsertSlot(uint64_t hash)
+  {
+    uint32_t groupMask = (mCapacity / kGroupSize) - 1;
+    uint32_t group = H1(hash) & groupMask;
+    for (uint32_t probe = 1; ; probe++) {
+      uint32_t match = MatchFree(mControl.get() + group * kGroupSize);
+      if (match) {
+        return group * kGroupSize + __builtin_ctz(match);
+      }
+      group = (group + probe) & groupMask;
+    }
+  }
+
+  void EraseSlot(uint32_t idx)
+  {
+    // a group that still has an empty slot never had a probe chain pass
+    // through it, so the slot can go straight back to empty
+    uint32_t group = idx / kGroupSize;
+    if (MatchByte(mControl.get() + group * kGroupSize, kEmpty)) {
+      mControl[idx] = kEmpty;
+      mGrowthLeft++;
+    } else {
+      mControl[idx] = kDeleted;
+    }
+    mSize--;
+  }
+
+  void Rehash(uint32_t capacity)
+  {
+    std::unique_ptr<uint8_t []> oldControl(std::move(mControl));
+    std::unique_ptr<Slot []> oldSlots(std::move(mSlots));
+    uint32_t oldCapacity = mCapacity;
+
+    mCapacity = capacity;
+    mSize = 0;
+    mGrowthLeft = MaxLoad(capacity);
+    if (!capacity) {
+      return;
+    }
+    mControl.reset(new uint8_t[capacity]);
+    memset(mControl.get(), kEmpty, capacity);
+    mSlots.reset(new Slot[capacity]);
+
+    for (uint32_t i = 0; i < oldCapacity; i++) {
+      if (IsFull(oldControl[i])) {
+        uint64_t hash = Hash(oldSlots[i].mCID);
+        uint32_t idx = FindInsertSlot(hash);
+        mControl[idx] = H2(hash);
+        mSlots[idx] = oldSlots[i];
+        mSize++;
+        mGrowthLeft--;
+      }
+    }
+  }
+
+  static uint64_t FoldedMultiply(uint64_t a, uint64_t b)
+  {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    // the cross term carries are dropped, this only has to mix
+    uint64_t lo = a * b;
+    uint64_t hi = ((a >> 32) * (b >> 32)) +
+      ((((a & 0xffffffff) * (b >> 32)) + ((a >> 32) * (b & 0xffffffff))) >> 32);
+    return lo ^ hi;
+#endif
+  }
+
+  // two rounds of keyed folded multiply. without the key an attacker can't
+  // predict where a cid lands, and it is a fraction of the cost of siphash
+  // on the lookup path.
+  uint64_t Hash(uint64_t cid) const
+  {
+    uint64_t x = FoldedMultiply(cid ^ mKey[0], mKey[1] ^ 0x9e3779b97f4a7c15ULL);
+    return FoldedMultiply(x ^ mKey[1], 0xbf58476d1ce4e5b9ULL);
+  }
+
+  std::unique_ptr<uint8_t []> mControl;
+  std::unique_ptr<Slot []>    mSlots;
+  uint32_t                    mCapacity; // 0 or a power of 2 >= kGroupSize
+  uint32_t                    mSize;
+  uint32_t                    mGrowthLeft; // empty slots usable before a rehash
+  uint64_t                    mKey[2];
+};
+
+} // namespace
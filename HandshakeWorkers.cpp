@@ -0,0 +1,94 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "HandshakeWorkers.h"
+#include "NSSHelper.h"
+#include "assert.h"
+#include <algorithm>
+
+namespace mozquic {
+
+HandshakeWorkers::HandshakeWorkers(uint32_t threads)
+  : mShutdown(false)
+{
+  for (uint32_t i = 0; i < threads; i++) {
+    mThreads.emplace_back(&HandshakeWorkers::Run, this);
+  }
+}
+
+HandshakeWorkers::~HandshakeWorkers()
+{
+  {
+    std::lock_guard<std::mutex> guard(mLock);
+    mShutdown = true;
+  }
+  mWake.notify_all();
+  for (auto iter = mThreads.begin(); iter != mThreads.end(); ++iter) {
+    iter->join();
+  }
+  // helpers hold a reference to the pool so nothing can still be queued
+  assert(mQueue.empty());
+}
+
+void
+HandshakeWorkers::Submit(NSSHelper *helper)
+{
+  assert(helper->mBusy.load(std::memory_order_relaxed));
+  {
+    std::lock_guard<std::mutex> guard(mLock);
+    mQueue.push_back(helper);
+  }
+  mWake.notify_one();
+}
+
+void
+HandshakeWorkers::Cancel(NSSHelper *helper)
+{
+  std::unique_lock<std::mutex> guard(mLock);
+  auto iter = std::find(mQueue.begin(), mQueue.end(), helper);
+  if (iter != mQueue.end()) {
+    mQueue.erase(iter);
+    helper->mBusy.store(false, std::memory_order_release);
+  } else {
+    // a worker has it, a single handshake turn is not long
+    mDone.wait(guard, [helper]() { return !helper->mBusy.load(std::memory_order_acquire); });
+  }
+  // an earlier turn can still be waiting to be collected
+  mCompleted.erase(std::remove(mCompleted.begin(), mCompleted.end(), helper), mCompleted.end());
+}
+
+void
+HandshakeWorkers::TakeCompleted(std::vector<NSSHelper *> &out)
+{
+  out.clear();
+  std::lock_guard<std::mutex> guard(mLock);
+  out.swap(mCompleted);
+}
+
+void
+HandshakeWorkers::Run()
+{
+  std::unique_lock<std::mutex> guard(mLock);
+  while (true) {
+    mWake.wait(guard, [this]() { return mShutdown || !mQueue.empty(); });
+    if (mQueue.empty()) {
+      return;
+    }
+    NSSHelper *helper = mQueue.front();
+    mQueue.pop_front();
+
+    guard.unlock();
+    helper->WorkerTurn();
+    guard.lock();
+
+    // the io thread takes the helper back (lock free) as soon as this is
+    // visible, the lock is for Cancel() waiting on it and mCompleted
+    helper->mBusy.store(false, std::memory_order_release);
+    mCompleted.push_back(helper);
+    mDone.notify_all();
+  }
+}
+
+} // namespace
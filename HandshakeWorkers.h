@@ -0,0 +1,53 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mozquic {
+
+class NSSHelper;
+
+// Threads that run server tls handshakes (certificate signing, ecdhe) so
+// a burst of new connections does not hold up packet processing for the
+// established ones. The io thread submits a helper along with the stream
+// 0 input it has collected, and the helper belongs to a worker until it
+// is no longer Busy(). Finished turns are collected with TakeCompleted so
+// the io thread can give their connections a turn without polling them.
+// See NSSHelper::DriveHandshake.
+class HandshakeWorkers final
+{
+public:
+  explicit HandshakeWorkers(uint32_t threads);
+  ~HandshakeWorkers();
+
+  void Submit(NSSHelper *helper);
+  // removes helper if it is queued, waits for it if it is running. It is
+  // not reported by TakeCompleted afterwards
+  void Cancel(NSSHelper *helper);
+  // the helpers whose turn finished since the last call
+  void TakeCompleted(std::vector<NSSHelper *> &out);
+
+  uint32_t Threads() { return mThreads.size(); }
+
+private:
+  void Run();
+
+  std::mutex                mLock;
+  std::condition_variable   mWake; // work queued or shutting down
+  std::condition_variable   mDone; // a handshake turn finished
+  std::deque<NSSHelper *>   mQueue;
+  std::vector<NSSHelper *>  mCompleted;
+  bool                      mShutdown;
+  std::vector<std::thread>  mThreads;
+};
+
+} //namespace
@@ -3,11 +3,13 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+#include <algorithm>
 #include <array>
 #include "MozQuic.h"
 #include "MozQuicInternal.h"
 #include "MozQuicStream.h"
 #include "NSSHelper.h"
+#include "HandshakeWorkers.h"
 
 #include "assert.h"
 #include "netinet/ip.h"
@@ -19,6 +21,9 @@
 #include <fcntl.h>
 #include "prerror.h"
 #include "ufloat16.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace mozquic  {
 
@@ -34,6 +39,17 @@ static const uint32_t kMozQuicVersionGreaseC = 0xfa1a7a3a;
 static const uint32_t kMozQuicVersionGreaseS = 0xea0a6a2a;
 static const uint32_t kFNV64Size = 8;
 
+// pmtud needs DF set. PROBE ignores the kernel's cached path mtu so our
+// own probes decide what size works.
+static void
+SetDontFragment(int fd)
+{
+#ifdef IP_MTU_DISCOVER
+  int val = IP_PMTUDISC_PROBE;
+  setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+#endif
+}
+
 #define FRAME_FIN_BIT 0x20
 
 MozQuic::MozQuic(bool handleIO)
@@ -45,6 +61,9 @@ MozQuic::MozQuic(bool handleIO)
   , mIgnorePKI(false)
   , mTolerateBadALPN(false)
   , mAppHandlesSendRecv(false)
+  , mBuiltinPacketProtection(false)
+  , mEnable0RTT(false)
+  , mReleaseHandshakeState(false)
   , mIsLoopback(false)
   , mConnectionState(STATE_UNINITIALIZED)
   , mOriginPort(-1)
@@ -55,13 +74,96 @@ MozQuic::MozQuic(bool handleIO)
   , mNextRecvPacketNumber(0)
   , mClosure(this)
   , mConnEventCB(nullptr)
+  , mMemoryBudget(kDefaultMemoryBudget)
+  , mWindowsWithheld(false)
+  , mWindowsRetry(0)
+  , mMemoryRefused(0)
   , mNextStreamId(1)
   , mNextRecvStreamId(1)
   , mParent(nullptr)
   , mAlive(this)
+  , mReadyHead(nullptr)
+  , mReadyTail(nullptr)
+  , mReadyNext(nullptr)
+  , mReadyQueued(false)
+  , mTimerDeadline(0)
+  , mTimerIndex(TimerHeap<MozQuic>::kNotQueued)
+  , mAppWakeup(0)
+  , mIntakeBudget(kDefaultIntakeBudget)
+  , mFlushBudget(kDefaultFlushBudget)
+  , mFlushPackets(0)
+  , mIOTimeBudget(0)
+  , mIODeadline(0)
+  , mIOTimeBudgetHit(false)
+  , mIntakeBudgetExhausted(0)
+  , mFlushBudgetExhausted(0)
+  , mIOTimeBudgetExhausted(0)
   , mTimestampConnBegin(0)
+  , mIdleTimeout(kDefaultIdleTimeout)
+  , mLastActivity(0)
+  , mClosingDeadline(0)
+  , mOriginalConnectionID(0)
+  , mIdleTimeouts(0)
+  , mConnectionsReaped(0)
   , mPingDeadline(0)
   , mDecodedOK(false)
+  , mLargestAcked(0)
+  , mSmoothedRTT(0)
+  , mRTTVar(0)
+  , mLatestRTT(0)
+  , mPacketsLost(0)
+  , mCongestionWindow(kInitialCongestionWindow)
+  , mSlowStartThreshold(0xffffffffffffffff)
+  , mBytesInFlight(0)
+  , mRecoveryEndPacket(0)
+  , mPeerMaxData(kInitialMaxData)
+  , mDataSent(0)
+  , mBlockedAt(0)
+  , mLocalMaxData(kInitialMaxData)
+  , mDataRecvd(0)
+  , mDataConsumed(0)
+  , mConnectionWindow(kInitialMaxData)
+  , mLastMaxDataUpdate(0)
+  , mBlockedFramesSent(0)
+  , mBlockedFramesRecvd(0)
+  , mStreamSendBuffer(kDefaultStreamSendBuffer)
+  , mConnectionSendBuffer(kDefaultConnectionSendBuffer)
+  , mDataWritten(0)
+  , mWritableWaiters(0)
+  , mCorkedStreams(0)
+  , mSendBlocked(0)
+  , mMTU(kMozQuicMTU)
+  , mMTUProbeHigh(kMaxMTU)
+  , mMTUProbeSize(0)
+  , mMTUProbeCount(0)
+  , mMTUProbeTime(0)
+  , mMTUNextSearch(0)
+  , mMTUTimeouts(0)
+  , mMTULastTimeout(0)
+  , mStatelessRetry(false)
+  , mStatelessRetryRate(0)
+  , mStatelessRetryActive(false)
+  , mHandshakeRateStart(0)
+  , mHandshakeRateCount(0)
+  , mHandshakeRatePrev(0)
+  , mRetryKeyIndex(0)
+  , mRetryKeyBirth(0)
+  , mHandshakeWorkerThreads(0)
+  , mServerModel(nullptr)
+  , mAddressValidated(true)
+  , mUnvalidatedBytesRecvd(0)
+  , mUnvalidatedBytesSent(0)
+  , mVersionNegotiationTokens(kVersionNegotiationBurst * 1000)
+  , mVersionNegotiationRefill(0)
+  , mAmplificationDropped(0)
+  , mVersionNegotiationSent(0)
+  , mVersionNegotiationDropped(0)
+  , mStatelessRetriesSent(0)
+  , mReceivedRetry(false)
+  , mEarlyDataSent(0)
+  , mEarlyDataRejected(0)
+  , mEarlyPacketsReceived(0)
+  , mHandshakePacketsSent(0)
 {
   assert(!handleIO); // todo
   unsigned char seed[4];
@@ -72,6 +174,9 @@ MozQuic::MozQuic(bool handleIO)
     srandom(seed[0] << 24 | seed[1] << 16 | seed[2] << 8 | seed[3]);
   }
   memset(&mPeer, 0, sizeof(mPeer));
+  memset(mVirtualClock, 0, sizeof(mVirtualClock));
+  memset(mMTUProbePackets, 0, sizeof(mMTUProbePackets));
+  mRetryKey[0] = mRetryKey[1] = nullptr;
 }
 
 MozQuic::~MozQuic()
@@ -79,12 +184,28 @@ MozQuic::~MozQuic()
   if (!mIsChild && (mFD != MOZQUIC_SOCKET_BAD)) {
     close(mFD);
   }
+  for (int i = 0; i < 2; i++) {
+    if (mRetryKey[i]) {
+      PK11_FreeSymKey(mRetryKey[i]);
+    }
+  }
+  if (mServerModel) {
+    PR_Close(mServerModel);
+  }
+  // mstreams does not own the streams. drop the data they hold for us
+  for (auto i = mStreams.begin(); i != mStreams.end(); ++i) {
+    (*i).second->mOut.mUnWritten.clear();
+  }
 }
 
 void
 MozQuic::Destroy(uint32_t code, const char *reason)
 {
   Shutdown(code, reason);
+  // the app is done with it (and maybe its closure), no more events. A
+  // server child stays in mChildren until its parent reaps it
+  mConnEventCB = nullptr;
+  MakeReady();
   mAlive = nullptr;
 }
 
@@ -101,19 +222,19 @@ MozQuic::CheckPeer(uint32_t deadline)
   }
 
   mPingDeadline = Timestamp() + deadline;
+  WakeAt(mPingDeadline);
 
-  unsigned char plainPkt[kMozQuicMTU];
-  unsigned char cipherPkt[kMozQuicMTU];
+  unsigned char pkt[kMaxMTU];
   uint32_t used = 0;
 
-  CreateShortPacketHeader(plainPkt, kMozQuicMTU - 16, used);
+  CreateShortPacketHeader(pkt, mMTU - 16, used);
   uint32_t headerLen = used;
-  plainPkt[used] = FRAME_TYPE_PING;
+  pkt[used] = FRAME_TYPE_PING;
   used++;
 
-  uint32_t room = kMozQuicMTU - used - 16;
+  uint32_t room = mMTU - used - 16;
   uint32_t usedByAck = 0;
-  if (AckPiggyBack(plainPkt + used, mNextTransmitPacketNumber, room, keyPhase1Rtt, usedByAck) == MOZQUIC_OK) {
+  if (AckPiggyBack(pkt + used, mNextTransmitPacketNumber, room, keyPhase1Rtt, usedByAck) == MOZQUIC_OK) {
     if (usedByAck) {
       fprintf(stderr,"Handy-Ack adds to ping packet %lX by %d\n", mNextTransmitPacketNumber, usedByAck);
     }
@@ -122,11 +243,10 @@ MozQuic::CheckPeer(uint32_t deadline)
   
   // 11-13 bytes of aead, 1 ping frame byte. result is 16 longer for aead tag
   uint32_t written = 0;
-  memcpy(cipherPkt, plainPkt, headerLen);
-  uint32_t rv = mNSSHelper->EncryptBlock(plainPkt, headerLen, plainPkt + headerLen, used - headerLen,
-                                         mNextTransmitPacketNumber, cipherPkt + headerLen, kMozQuicMTU - headerLen, written);
+  uint32_t rv = mNSSHelper->EncryptBlock(pkt, headerLen, pkt + headerLen, used - headerLen,
+                                         mNextTransmitPacketNumber, pkt + headerLen, mMTU - headerLen, written);
   mNextTransmitPacketNumber++;
-  Transmit(cipherPkt, written + headerLen, nullptr);
+  Transmit(pkt, written + headerLen, nullptr);
 
   return MOZQUIC_OK;
 }
@@ -134,20 +254,9 @@ MozQuic::CheckPeer(uint32_t deadline)
 void
 MozQuic::Shutdown(uint32_t code, const char *reason)
 {
-  if (mParent) {
-    for (auto iter = mParent->mChildren.begin(); iter != mParent->mChildren.end(); ++iter) {
-      if ((*iter).get() == this) {
-          mParent->mChildren.erase(iter);
-          break;
-      }
-    }    
-    assert(mIsChild);
-    mParent->RemoveSession(mConnectionID);
-  }
-
   if ((mConnectionState != CLIENT_STATE_CONNECTED) &&
       (mConnectionState != SERVER_STATE_CONNECTED)) {
-    mConnectionState = mIsClient ? CLIENT_STATE_CLOSED : SERVER_STATE_CLOSED;
+    EnterClosed();
     return;
   }
   if (!mIsChild && !mIsClient) {
@@ -157,8 +266,7 @@ MozQuic::Shutdown(uint32_t code, const char *reason)
   
   fprintf(stderr, "sending shutdown as %lx\n", mNextTransmitPacketNumber);
 
-  unsigned char plainPkt[kMozQuicMTU];
-  unsigned char cipherPkt[kMozQuicMTU];
+  unsigned char pkt[kMaxMTU];
   uint16_t tmp16;
   uint32_t tmp32;
 
@@ -167,37 +275,45 @@ MozQuic::Shutdown(uint32_t code, const char *reason)
   // todo when transport params allow truncate id, the connid might go
   // short header with connid kp = 0, 4 bytes of packetnumber
   uint32_t used, pktHeaderLen;
-  CreateShortPacketHeader(plainPkt, kMozQuicMTU - 16, used);
+  CreateShortPacketHeader(pkt, mMTU - 16, used);
   pktHeaderLen = used;
 
-  plainPkt[used] = FRAME_TYPE_CLOSE;
+  pkt[used] = FRAME_TYPE_CLOSE;
   used++;
   tmp32 = htonl(code);
-  memcpy(plainPkt + used, &tmp32, 4);
+  memcpy(pkt + used, &tmp32, 4);
   used += 4;
 
   size_t reasonLen = strlen(reason);
-  if (reasonLen > (kMozQuicMTU - 16 - used - 2)) {
-    reasonLen = kMozQuicMTU - 16 - used - 2;
+  if (reasonLen > (mMTU - 16 - used - 2)) {
+    reasonLen = mMTU - 16 - used - 2;
   }
   tmp16 = htons(reasonLen);
-  memcpy(plainPkt + used, &tmp16, 2);
+  memcpy(pkt + used, &tmp16, 2);
   used += 2;
   if (reasonLen) {
-    memcpy(plainPkt + used, reason, reasonLen);
+    memcpy(pkt + used, reason, reasonLen);
     used += reasonLen;
   }
 
   // 11-13 bytes of aead, 1 ping frame byte. result is 16 longer for aead tag
   uint32_t written = 0;
-  memcpy(cipherPkt, plainPkt, pktHeaderLen);
-  uint32_t rv = mNSSHelper->EncryptBlock(plainPkt, pktHeaderLen, plainPkt + pktHeaderLen, 7 + reasonLen,
-                                         mNextTransmitPacketNumber, cipherPkt + pktHeaderLen, kMozQuicMTU - pktHeaderLen, written);
+  uint32_t rv = mNSSHelper->EncryptBlock(pkt, pktHeaderLen, pkt + pktHeaderLen, 7 + reasonLen,
+                                         mNextTransmitPacketNumber, pkt + pktHeaderLen, mMTU - pktHeaderLen, written);
   if (!rv) {
     mNextTransmitPacketNumber++;
-    Transmit(cipherPkt, written + pktHeaderLen, nullptr);
+    Transmit(pkt, written + pktHeaderLen, nullptr);
   }
+  EnterClosed();
+}
+
+void
+MozQuic::EnterClosed()
+{
   mConnectionState = mIsClient ? CLIENT_STATE_CLOSED : SERVER_STATE_CLOSED;
+  if (!mClosingDeadline) {
+    mClosingDeadline = Timestamp() + kClosingPeriod;
+  }
 }
 
 void
@@ -228,10 +344,11 @@ MozQuic::StartClient()
   mIsClient = true;
   mNextStreamId = 1;
   mNextRecvStreamId = 2;
-  mNSSHelper.reset(new NSSHelper(this, mTolerateBadALPN, mOriginName.get(), true));
+  mNSSHelper.reset(new NSSHelper(this, mTolerateBadALPN, mOriginName.get(), mOriginPort));
   mStream0.reset(new MozQuicStreamPair(0, this, this));
 
   mConnectionState = CLIENT_STATE_1RTT;
+  mLastActivity = Timestamp();
   for (int i=0; i < 4; i++) {
     mConnectionID = mConnectionID << 16;
     mConnectionID = mConnectionID | (random() & 0xffff);
@@ -247,6 +364,7 @@ MozQuic::StartClient()
     // the application did not pass in its own fd
     mFD = socket(AF_INET, SOCK_DGRAM, 0); // todo blocking getaddrinfo
     fcntl(mFD, F_SETFL, fcntl(mFD, F_GETFL, 0) | O_NONBLOCK);
+    SetDontFragment(mFD);
     struct addrinfo *outAddr;
     if (getaddrinfo(mOriginName.get(), nullptr, nullptr, &outAddr) != 0) {
       return MOZQUIC_ERR_GENERAL;
@@ -283,12 +401,45 @@ MozQuic::StartServer()
   mNextRecvStreamId = 1;
 
   mConnectionState = SERVER_STATE_LISTEN;
+
+  // the connection id tables are keyed so clients can't pick colliding ids
+  unsigned char hashKey[16];
+  if (SECSuccess != PK11_GenerateRandom(hashKey, sizeof(hashKey))) {
+    for (unsigned int i = 0; i < sizeof(hashKey); i++) {
+      hashKey[i] = random() & 0xff;
+    }
+  }
+  mConnectionHash.SetKey(hashKey);
+  mConnectionHashOriginalNew.SetKey(hashKey);
+
+  if (mEnable0RTT && !NSSHelper::EnableAntiReplay(kAntiReplayWindow)) {
+    mEnable0RTT = false;
+  }
+  mServerModel = NSSHelper::CreateServerModel(mOriginName.get(), mEnable0RTT);
+  if (!mServerModel) {
+    return MOZQUIC_ERR_CRYPTO;
+  }
+  if (mHandshakeWorkerThreads) {
+    mHandshakeWorkers = std::make_shared<HandshakeWorkers>(mHandshakeWorkerThreads);
+  }
   return Bind();
 }
 
 int
 MozQuic::StartNewStream(MozQuicStreamPair **outStream, const void *data, uint32_t amount, bool fin)
 {
+  if (OverMemoryBudget()) {
+    fprintf(stderr, "memory budget spent, not starting a stream\n");
+    *outStream = nullptr;
+    return MOZQUIC_ERR_MEMORY;
+  }
+  if (amount && (mDataWritten != mDataSent) &&
+      ((mDataWritten - mDataSent + amount) > mConnectionSendBuffer)) {
+    // there is no stream yet to hear when it drains, so none is opened
+    mSendBlocked++;
+    *outStream = nullptr;
+    return MOZQUIC_ERR_WOULD_BLOCK;
+  }
   *outStream = new MozQuicStreamPair(mNextStreamId, this, this);
   mStreams.insert( { mNextStreamId, *outStream } );
   mNextStreamId += 2;
@@ -313,6 +464,7 @@ MozQuic::Bind()
   }
   mFD = socket(AF_INET, SOCK_DGRAM, 0); // todo v6 and non 0 addr
   fcntl(mFD, F_SETFL, fcntl(mFD, F_GETFL, 0) | O_NONBLOCK);
+  SetDontFragment(mFD);
   struct sockaddr_in sin;
   memset (&sin, 0, sizeof (sin));
   sin.sin_family = AF_INET;
@@ -330,22 +482,188 @@ MozQuic::FindSession(uint64_t cid)
     return mConnectionID == cid ? this : nullptr;
   }
 
-  auto i = mConnectionHash.find(cid);
-  if (i == mConnectionHash.end()) {
+  MozQuic **session = mConnectionHash.Find(cid);
+  if (!session) {
     Log((char *)"find session could not find id in hash");
     return nullptr;
   }
-  return (*i).second;
+  if ((*session)->mClosingDeadline) {
+    // closed and waiting to be reaped, its late packets are dropped
+    return nullptr;
+  }
+  return *session;
 }
 
+// frees child
 void
-MozQuic::RemoveSession(uint64_t cid)
+MozQuic::ReapChild(MozQuic *child)
 {
-  assert (!mIsChild);
-  if (mIsClient) {
+  assert(!mIsChild && !mIsClient);
+  assert(child->mParent == this);
+  assert(!child->mReadyQueued);
+  fprintf(stderr,"reaping connection %lx\n", child->mConnectionID);
+  mConnectionHash.Erase(child->mConnectionID);
+  InitialClientPacketInfo *info = mConnectionHashOriginalNew.Find(child->mOriginalConnectionID);
+  if (info && (info->mServerConnectionID == child->mConnectionID)) {
+    mConnectionHashOriginalNew.Erase(child->mOriginalConnectionID);
+  }
+  mTimers.Remove(child);
+  mConnectionsReaped++;
+  mChildren.erase(child->mChildIter);
+}
+
+// the server parent's IO() turn for its children. Only the ones that are
+// ready or have a timer due are visited, so idle connections cost nothing
+// here.
+void
+MozQuic::ServiceChildren()
+{
+  assert(!mIsChild && !mIsClient);
+  uint64_t now = Timestamp();
+  MozQuic *child;
+  while ((child = mTimers.PopDue(now))) {
+    child->MakeReady();
+  }
+  if (mHandshakeWorkers) {
+    // a finished handshake turn has output to send and may unblock held
+    // 0-rtt packets. Cancel() keeps reaped children out of this
+    mHandshakeWorkers->TakeCompleted(mHandshakesCompleted);
+    for (auto i = mHandshakesCompleted.begin(); i != mHandshakesCompleted.end(); ++i) {
+      (*i)->Session()->MakeReady();
+    }
+  }
+
+  MozQuic *ready = mReadyHead;
+  MozQuic *readyTail = mReadyTail;
+  mReadyHead = mReadyTail = nullptr;
+  bool serviced = false;
+  while (ready) {
+    if (serviced && IOTimeBudgetSpent()) {
+      // the rest are still queued and go first next time
+      readyTail->mReadyNext = mReadyHead;
+      if (!mReadyHead) {
+        mReadyTail = readyTail;
+      }
+      mReadyHead = ready;
+      break;
+    }
+    serviced = true;
+    child = ready;
+    ready = child->mReadyNext;
+    child->mReadyNext = nullptr;
+    child->mReadyQueued = false;
+
+    // a closed child has nothing left to do but wait out its closing
+    // period. Destroy() does not touch mChildren so a callback can
+    // destroy any connection during the walk.
+    if (!child->mClosingDeadline) {
+      child->IO();
+    }
+    if (child->mClosingDeadline && !child->mAlive && !child->mReadyQueued &&
+        (child->mClosingDeadline <= now)) {
+      ReapChild(child);
+      continue;
+    }
+    uint64_t deadline = child->NextTimer(now);
+    if (deadline) {
+      mTimers.Set(child, deadline);
+    } else {
+      mTimers.Remove(child);
+    }
+  }
+}
+
+// a server child gets an IO() turn on the parent's next one
+void
+MozQuic::MakeReady()
+{
+  if (!mIsChild || mReadyQueued) {
+    return;
+  }
+  mReadyQueued = true;
+  if (mParent->mReadyTail) {
+    mParent->mReadyTail->mReadyNext = this;
+  } else {
+    mParent->mReadyHead = this;
+  }
+  mParent->mReadyTail = this;
+}
+
+// a server child gets an IO() turn no later than deadline
+void
+MozQuic::WakeAt(uint64_t deadline)
+{
+  if (!mIsChild) {
     return;
   }
-  mConnectionHash.erase(cid);
+  if ((mTimerIndex == TimerHeap<MozQuic>::kNotQueued) || (deadline < mTimerDeadline)) {
+    mParent->mTimers.Set(this, deadline);
+  }
+}
+
+// when a server child next needs an IO() turn if nothing arrives for it
+// before then, 0 is never. Early is harmless, late is not.
+uint64_t
+MozQuic::NextTimer(uint64_t now)
+{
+  if (mClosingDeadline) {
+    // one the app still holds waits for Destroy()
+    return mAlive ? 0 : mClosingDeadline;
+  }
+  if (mAppWakeup && (mAppWakeup <= now)) {
+    mAppWakeup = 0; // this turn delivered it
+  }
+
+  // data the flush budget held back is sent on the next turn. Data blocked
+  // by congestion or flow control is not, see Frameable, and a handshake
+  // on a worker gets its turn from ServiceChildren when it finishes
+  if (Frameable()) {
+    return now;
+  }
+
+  uint64_t next = 0;
+  auto earliest = [&next](uint64_t t) {
+    if (t && (!next || (t < next))) {
+      next = t;
+    }
+  };
+
+  // the same walk as RetransmitTimer
+  for (auto i = mUnAckedData.begin(); i != mUnAckedData.end(); ++i) {
+    uint64_t due = (*i)->mTransmitTime + (kRetransmitThresh * (*i)->mTransmitCount);
+    if (due > now) {
+      earliest(due);
+      break;
+    }
+    if ((*i)->mRetransmitted) {
+      earliest((*i)->mTransmitTime + kForgetUnAckedThresh);
+    }
+  }
+  if (mConnectionState == SERVER_STATE_CONNECTED) {
+    earliest(mMTUProbeSize ? (mMTUProbeTime + MTUProbeTimeout()) :
+             std::max(mMTUNextSearch, now));
+  }
+  if (mIdleTimeout && mLastActivity) {
+    earliest(mLastActivity + mIdleTimeout);
+  }
+  if (mWindowsWithheld) {
+    earliest(std::max(mWindowsRetry, now));
+  }
+  if (mCorkedStreams) {
+    for (auto i = mStreams.begin(); i != mStreams.end(); ++i) {
+      earliest((*i).second->mOut.mCorkDeadline);
+    }
+  }
+  earliest(mPingDeadline);
+  earliest(mAppWakeup);
+  return next;
+}
+
+void
+MozQuic::ScheduleIO(uint32_t delay)
+{
+  mAppWakeup = Timestamp() + delay;
+  WakeAt(mAppWakeup);
 }
 
 static uint64_t
@@ -395,20 +713,42 @@ MozQuic::Intake()
           mConnectionState == SERVER_STATE_1RTT ||
           mConnectionState == SERVER_STATE_CLOSED ||
           mConnectionState == CLIENT_STATE_CONNECTED ||
+          mConnectionState == CLIENT_STATE_0RTT ||
           mConnectionState == CLIENT_STATE_1RTT ||
           mConnectionState == CLIENT_STATE_CLOSED);
   uint32_t rv = MOZQUIC_OK;
-  
-  unsigned char pkt[kMozQuicMSS];
+
+  // consecutive short header packets for the same session are decrypted
+  // in place and processed as a batch, one datagram per slot.
+  const uint32_t slotSize = kMaxMTU + 16;
+  if (!mIntakeBuffer) {
+    mIntakeBuffer.reset(new unsigned char[kIntakeBatch * slotSize]);
+  }
+  AEADBlock batch[kIntakeBatch];
+  uint32_t batchCount = 0;
+  MozQuic *batchSession = nullptr;
+
   bool sendAck;
+  uint32_t received = 0;
   do {
+    // whatever is left stays in the socket buffer for the next IO()
+    if (mIntakeBudget && (received == mIntakeBudget)) {
+      fprintf(stderr,"intake budget of %d datagrams spent\n", mIntakeBudget);
+      mIntakeBudgetExhausted++;
+      break;
+    }
+    if (IOTimeBudgetSpent()) {
+      break;
+    }
+    unsigned char *pkt = mIntakeBuffer.get() + (batchCount * slotSize);
     uint32_t pktSize = 0;
     sendAck = false;
     struct sockaddr_in client;
-    rv = Recv(pkt, kMozQuicMSS, pktSize, &client);
+    rv = Recv(pkt, kMaxMTU, pktSize, &client);
     if (rv != MOZQUIC_OK || !pktSize) {
-      return rv;
+      break;
     }
+    received++;
 
     // dispatch to the right MozQuic class.
     MozQuic *session = this; // default
@@ -416,7 +756,7 @@ MozQuic::Intake()
     if (!(pkt[0] & 0x80)) {
       ShortHeaderData tmpShortHeader(pkt, pktSize, 0);
       if (pktSize < tmpShortHeader.mHeaderSize) {
-        return rv;
+        break;
       }
       session = FindSession(tmpShortHeader.mConnectionID);
       if (!session) {
@@ -430,13 +770,33 @@ MozQuic::Intake()
       fprintf(stderr,"SHORTFORM PACKET[%d] id=%lx pkt# %lx hdrsize %d\n",
               pktSize, shortHeader.mConnectionID, shortHeader.mPacketNumber,
               shortHeader.mHeaderSize);
-      rv = session->ProcessGeneral(pkt, pktSize,
-                                   shortHeader.mHeaderSize, shortHeader.mPacketNumber, sendAck);
-      if (rv == MOZQUIC_OK) {
-        session->Acknowledge(shortHeader.mPacketNumber, keyPhase1Rtt);
+      if (batchCount && (session != batchSession)) {
+        batchSession->ProcessGeneralBatch(batch, batchCount);
+        memmove(mIntakeBuffer.get(), pkt, pktSize);
+        pkt = mIntakeBuffer.get();
+        batchCount = 0;
       }
-        
+      batchSession = session;
+      batch[batchCount].aeadData = pkt;
+      batch[batchCount].aeadLen = shortHeader.mHeaderSize;
+      batch[batchCount].in = pkt + shortHeader.mHeaderSize;
+      batch[batchCount].inLen = pktSize - shortHeader.mHeaderSize;
+      batch[batchCount].packetNumber = shortHeader.mPacketNumber;
+      batch[batchCount].out = pkt + shortHeader.mHeaderSize;
+      batch[batchCount].outAvail = slotSize - shortHeader.mHeaderSize;
+      batchCount++;
+      if (batchCount == kIntakeBatch) {
+        batchSession->ProcessGeneralBatch(batch, batchCount);
+        batchCount = 0;
+      }
+      continue;
     } else {
+      // keep packets in order, anything batched goes first
+      if (batchCount) {
+        batchSession->ProcessGeneralBatch(batch, batchCount);
+        batchCount = 0;
+      }
+
       if (pktSize < 17) {
         return rv;
       }
@@ -447,8 +807,9 @@ MozQuic::Intake()
  
       if (!(VersionOK(longHeader.mVersion) ||
             (mIsClient && longHeader.mType == PACKET_TYPE_VERSION_NEGOTIATION && longHeader.mVersion == mVersion))) {
-        // todo this could really be an amplifier
-        session->GenerateVersionNegotiation(longHeader, &client);
+        if (!mIsClient && VersionNegotiationAllowed(pktSize)) {
+          session->GenerateVersionNegotiation(longHeader, &client);
+        }
         continue;
       }
 
@@ -463,10 +824,9 @@ MozQuic::Intake()
         }
         break;
       case PACKET_TYPE_SERVER_STATELESS_RETRY:
-        if (!IntegrityCheck(pkt, pktSize)) {
+        if (!mIsClient || !IntegrityCheck(pkt, pktSize)) {
           rv = MOZQUIC_ERR_GENERAL;
         }
-        assert(false); // todo mvp
         break;
       case PACKET_TYPE_CLIENT_CLEARTEXT:
         if (!IntegrityCheck(pkt, pktSize)) {
@@ -485,6 +845,24 @@ MozQuic::Intake()
           rv = MOZQUIC_ERR_GENERAL;
         }
         break;
+
+      case PACKET_TYPE_0RTT_PROTECTED:
+        if (mIsClient) {
+          rv = MOZQUIC_ERR_GENERAL;
+          break;
+        }
+        {
+          // until it hears from the server the client uses the connection
+          // id of its initial
+          InitialClientPacketInfo *info = mConnectionHashOriginalNew.Find(longHeader.mConnectionID);
+          session = FindSession(info ? info->mServerConnectionID : longHeader.mConnectionID);
+        }
+        if (!session) {
+          // probably got here ahead of its client initial. the client
+          // will send it again
+          rv = MOZQUIC_ERR_GENERAL;
+        }
+        break;
         
       default:
         // reject anything that is not a cleartext packet (not right, but later)
@@ -500,6 +878,9 @@ MozQuic::Intake()
         fprintf(stderr, "unable to find connection for packet\n");
         continue;
       }
+      if (!session->mAddressValidated) {
+        session->mUnvalidatedBytesRecvd += pktSize;
+      }
 
       switch (longHeader.mType) {
       case PACKET_TYPE_VERSION_NEGOTIATION: // version negotiation
@@ -508,19 +889,26 @@ MozQuic::Intake()
         break;
       case PACKET_TYPE_CLIENT_INITIAL:
         rv = session->ProcessClientInitial(pkt, pktSize, &client, longHeader, &session, sendAck);
-        // ack after processing - find new session
-        if (rv == MOZQUIC_OK) {
+        // ack after processing - find new session. there isn't one if
+        // the client was sent a stateless retry
+        if ((rv == MOZQUIC_OK) && session) {
           session->Acknowledge(longHeader.mPacketNumber, keyPhaseUnprotected);
         }
         break;
       case PACKET_TYPE_SERVER_STATELESS_RETRY:
+        rv = session->ProcessServerStatelessRetry(pkt, pktSize, longHeader);
         // do not ack
-        // todo mvp
         break;
       case PACKET_TYPE_SERVER_CLEARTEXT:
         rv = session->ProcessServerCleartext(pkt, pktSize, longHeader, sendAck);
         if (rv == MOZQUIC_OK) {
           session->Acknowledge(longHeader.mPacketNumber, keyPhaseUnprotected);
+          // the server may have sent protected (0.5-rtt) data right behind
+          // its handshake flight. have the keys ready before reading on.
+          if (((mConnectionState == CLIENT_STATE_0RTT) ||
+               (mConnectionState == CLIENT_STATE_1RTT)) && !mAppHandlesSendRecv) {
+            rv = Client1RTT();
+          }
         }
         break;
       case PACKET_TYPE_CLIENT_CLEARTEXT:
@@ -533,6 +921,20 @@ MozQuic::Intake()
         rv = session->ProcessGeneral(pkt, pktSize, 17, longHeader.mPacketNumber, sendAck);
         if (rv == MOZQUIC_OK) {
           session->Acknowledge(longHeader.mPacketNumber, keyPhase1Rtt);
+        } else if (rv == MOZQUIC_ERR_MEMORY) {
+          // refused over the memory budget, left unacked for the peer to resend
+          rv = MOZQUIC_OK;
+          sendAck = false;
+        }
+        break;
+      case PACKET_TYPE_0RTT_PROTECTED:
+        rv = session->ProcessEarlyData(pkt, pktSize, longHeader, sendAck);
+        if (rv == MOZQUIC_OK) {
+          session->Acknowledge(longHeader.mPacketNumber, keyPhase0Rtt);
+        } else {
+          // rejected (or held) early data is not fatal, keep reading
+          rv = MOZQUIC_OK;
+          sendAck = false;
         }
         break;
 
@@ -541,11 +943,18 @@ MozQuic::Intake()
         break;
       }
     }
-    if ((rv == MOZQUIC_OK) && sendAck) {
-      rv = session->MaybeSendAck();
+    if ((rv == MOZQUIC_OK) && session) {
+      session->mLastActivity = Timestamp();
+      session->MakeReady();
+      if (sendAck) {
+        rv = session->MaybeSendAck();
+      }
     }
   } while (rv == MOZQUIC_OK);
 
+  if (batchCount) {
+    batchSession->ProcessGeneralBatch(batch, batchCount);
+  }
   return rv;
 }
 
@@ -555,13 +964,33 @@ MozQuic::IO()
   uint32_t code;
   std::shared_ptr<MozQuic> deleteProtector(mAlive);
 
+  mFlushPackets = 0;
+  if (mIOTimeBudget && !mIsChild) {
+    mIODeadline = TimestampUs() + mIOTimeBudget;
+    mIOTimeBudgetHit = false;
+  }
   Intake();
+  if (!mReadable.empty()) {
+    NotifyReadable();
+  }
   RetransmitTimer();
   ClearOldInitialConnectIdsTimer();
+  IdleTimer();
+  if (mCorkedStreams) {
+    CorkTimer();
+  }
+  if (mWindowsWithheld) {
+    ReopenWindows();
+  }
   Flush();
+  if (mWritableWaiters) {
+    NotifyWritable();
+  }
+  MTUProbeTimer();
 
   if (mIsClient) {
     switch (mConnectionState) {
+    case CLIENT_STATE_0RTT:
     case CLIENT_STATE_1RTT:
       code = Client1RTT();
       if (code != MOZQUIC_OK) {
@@ -569,6 +998,11 @@ MozQuic::IO()
       }
       break;
     case CLIENT_STATE_CONNECTED:
+      // the server's session tickets arrive after the handshake
+      if (!mAppHandlesSendRecv && !mStream0->Empty()) {
+        mNSSHelper->ProcessPostHandshake();
+      }
+      break;
     case CLIENT_STATE_CLOSED:
     case SERVER_STATE_CLOSED:
       break;
@@ -584,16 +1018,12 @@ MozQuic::IO()
       }
     }
     if (!mIsChild) {
-      ssize_t len = mChildren.size();
-      for (auto iter = mChildren.begin();
-           len == mChildren.size() && iter != mChildren.end(); ++iter) {
-        (*iter)->IO();
-      }
+      ServiceChildren();
     }
   }
 
   if ((mConnectionState == SERVER_STATE_1RTT) &&
-      (mNextTransmitPacketNumber - mOriginalTransmitPacketNumber) > 20) {
+      (mHandshakePacketsSent > kMaxHandshakePackets)) {
     RaiseError(MOZQUIC_ERR_GENERAL, (char *)"TimedOut Client In Handshake");
   } else if (mPingDeadline && mConnEventCB && mPingDeadline < Timestamp()) {
     fprintf(stderr,"deadline expired set at %ld now %ld\n", mPingDeadline, Timestamp());
@@ -609,7 +1039,9 @@ void
 MozQuic::Log(char *msg) 
 {
   // todo this should be a structure of some kind
-  mConnEventCB(mClosure, MOZQUIC_EVENT_LOG, msg);
+  if (mConnEventCB) {
+    mConnEventCB(mClosure, MOZQUIC_EVENT_LOG, msg);
+  }
   fprintf(stderr,"MozQuic Logger :%s:\n", msg);
 }
 
@@ -765,7 +1197,7 @@ MozQuic::AckPiggyBack(unsigned char *pkt, uint64_t pktNumOfAck, uint32_t avail,
       uint64_t gap = lowAcked - iter->mPacketNumber - 1;
 
       while (gap > 255) { 
-        if (avail < 3) {
+        if ((avail < 3) || (*numBlocks == 0xff)) {
           break;
         }
         *numBlocks = *numBlocks + 1;
@@ -778,8 +1210,7 @@ MozQuic::AckPiggyBack(unsigned char *pkt, uint64_t pktNumOfAck, uint32_t avail,
         avail -= 3;
         gap -= 255;
       }
-      assert(gap <= 255);
-      if (avail < 3) {
+      if ((gap > 255) || (avail < 3) || (*numBlocks == 0xff)) {
         break;
       }
       *numBlocks = *numBlocks + 1;
@@ -911,6 +1342,20 @@ MozQuic::Transmit(unsigned char *pkt, uint32_t len, struct sockaddr_in *explicit
   // this would be a reasonable place to insert a queuing layer that
   // thought about cong control, flow control, priority, and pacing
   
+  if (!mAddressValidated) {
+    // what is held back here is retransmitted once the client sends more
+    // or acks something
+    if (mUnvalidatedBytesSent + len > kAmplificationFactor * mUnvalidatedBytesRecvd) {
+      fprintf(stderr,"amplification limit, not sending %d bytes to unvalidated address\n", len);
+      mAmplificationDropped++;
+      if (mParent) {
+        mParent->mAmplificationDropped++;
+      }
+      return MOZQUIC_OK;
+    }
+    mUnvalidatedBytesSent += len;
+  }
+
   if (mAppHandlesSendRecv) {
     struct mozquic_eventdata_transmit data;
     data.pkt = pkt;
@@ -1017,7 +1462,21 @@ MozQuic::Client1RTT()
       RaiseError(code, (char *) "client 1rtt handshake failed");
       return code;
     }
+    if ((mConnectionState == CLIENT_STATE_1RTT) && !mNSSHelper->IsHandshakeComplete() &&
+        mNSSHelper->EarlyDataReady()) {
+      // resuming with a ticket that allows early data. stream data goes
+      // out in 0-rtt packets until the handshake is done
+      fprintf(stderr,"CLIENT_STATE_0RTT\n");
+      mConnectionState = CLIENT_STATE_0RTT;
+    }
     if (mNSSHelper->IsHandshakeComplete()) {
+      if (mConnectionState == CLIENT_STATE_0RTT) {
+        if (!mNSSHelper->EarlyDataAccepted()) {
+          fprintf(stderr,"0-rtt rejected, resending as 1-rtt\n");
+          RetransmitEarlyData();
+        }
+        mNSSHelper->DiscardEarlyKeys();
+      }
       fprintf(stderr,"CLIENT_STATE_CONNECTED 1\n");
       mConnectionState = CLIENT_STATE_CONNECTED;
       if (mConnEventCB) {
@@ -1040,21 +1499,32 @@ MozQuic::Server1RTT()
     return MOZQUIC_ERR_GENERAL;
   }
 
-  if (!mStream0->Empty()) {
+  // with handshake workers this also picks up the result of a turn that
+  // finished since the last call
+  if (!mStream0->Empty() || mNSSHelper->HandshakePending()) {
     uint32_t code = mNSSHelper->DriveHandshake();
     if (code != MOZQUIC_OK) {
       RaiseError(code, (char *) "server 1rtt handshake failed");
       return code;
     }
+    ProcessEarlyPending();
     if (mNSSHelper->IsHandshakeComplete()) {
       fprintf(stderr,"SERVER_STATE_CONNECTED 2\n");
       if (mConnEventCB) {
         mConnEventCB(mClosure, MOZQUIC_EVENT_CONNECTED, this);
       }
       mConnectionState = SERVER_STATE_CONNECTED;
+      if (mReleaseHandshakeState) {
+        // our handshake data still in flight is retransmitted from
+        // munackeddata, which does not need the stream
+        mNSSHelper->ReleaseHandshakeState();
+        mStream0.reset();
+      }
       return MaybeSendAck();
     }
   }
+  // a turn that had nothing to send has still settled the helper
+  ProcessEarlyPending();
   return MOZQUIC_OK;
 }
 
@@ -1068,7 +1538,7 @@ MozQuic::ProcessVersionNegotiation(unsigned char *pkt, uint32_t pktSize, LongHea
   assert(mIsClient);
   unsigned char *framePtr = pkt + 17;
 
-  if (mConnectionState != CLIENT_STATE_1RTT) {
+  if ((mConnectionState != CLIENT_STATE_1RTT) && (mConnectionState != CLIENT_STATE_0RTT)) {
     // todo this isn't really strong enough (mvp)
     // any packet recvd on this conn would invalidate
     return MOZQUIC_ERR_VERSION;
@@ -1086,7 +1556,10 @@ MozQuic::ProcessVersionNegotiation(unsigned char *pkt, uint32_t pktSize, LongHea
   for (auto i = mUnAckedData.begin(); i != mUnAckedData.end(); i++) {
     if ((*i)->mPacketNumber == header.mPacketNumber) {
       tmp = std::unique_ptr<MozQuicStreamChunk>(new MozQuicStreamChunk(*(*i)));
+      // the server dropped any 0-rtt data along with the initial
+      RetransmitEarlyData();
       mUnAckedData.clear();
+      mBytesInFlight = 0;
       break;
     }
   }
@@ -1128,6 +1601,57 @@ MozQuic::ProcessVersionNegotiation(unsigned char *pkt, uint32_t pktSize, LongHea
   return MOZQUIC_ERR_VERSION;
 }
 
+uint32_t
+MozQuic::ProcessServerStatelessRetry(unsigned char *pkt, uint32_t pktSize, LongHeaderData &header)
+{
+  assert(pkt[0] & 0x80);
+  assert((pkt[0] & 0x7f) == PACKET_TYPE_SERVER_STATELESS_RETRY);
+  assert(pktSize >= 17);
+  assert(mIsClient);
+
+  if (((mConnectionState != CLIENT_STATE_1RTT) && (mConnectionState != CLIENT_STATE_0RTT)) ||
+      mReceivedServerClearText) {
+    return MOZQUIC_ERR_GENERAL;
+  }
+  if (mReceivedRetry) {
+    // only one retry per connection, this is probably a dup
+    return MOZQUIC_OK;
+  }
+  if ((header.mVersion != mVersion) ||
+      (header.mConnectionID != mConnectionID)) {
+    // these were supposedly copied from the client initial
+    return MOZQUIC_ERR_GENERAL;
+  }
+  if ((pktSize != 17 + FRAME_TYPE_RETRY_TOKEN_LENGTH + kFNV64Size) ||
+      (pkt[17] != FRAME_TYPE_RETRY_TOKEN)) {
+    // not authenticated, so not worth killing the connection over
+    Log((char *)"stateless retry packet format incorrect");
+    return MOZQUIC_ERR_GENERAL;
+  }
+
+  // like version negotiation this echoes the packet number of the client
+  // initial, which is sent again carrying the token
+  std::unique_ptr<MozQuicStreamChunk> tmp(nullptr);
+  for (auto i = mUnAckedData.begin(); i != mUnAckedData.end(); i++) {
+    if ((*i)->mPacketNumber == header.mPacketNumber) {
+      tmp = std::unique_ptr<MozQuicStreamChunk>(new MozQuicStreamChunk(*(*i)));
+      RetransmitEarlyData();
+      mUnAckedData.clear();
+      mBytesInFlight = 0;
+      break;
+    }
+  }
+  if (!tmp) {
+    return MOZQUIC_ERR_GENERAL;
+  }
+
+  memcpy(mRetryToken, pkt + 18, kRetryTokenLength);
+  mReceivedRetry = true;
+  fprintf(stderr, "stateless retry, resending client initial with token\n");
+  DoWriter(tmp);
+  return MOZQUIC_OK;
+}
+
 int
 MozQuic::ProcessServerCleartext(unsigned char *pkt, uint32_t pktSize, LongHeaderData &header, bool &sendAck)
 {
@@ -1161,6 +1685,7 @@ MozQuic::ProcessAck(FrameHeaderData &result, unsigned char *framePtr, bool fromC
   // to read the ackblocks and the tsblocks
   assert (result.mType == FRAME_TYPE_ACK);
   uint16_t numRanges = 0;
+  uint16_t numBlocksRead = 0;
 
   std::array<std::pair<uint64_t, uint64_t>, 257> ackStack;
 
@@ -1172,26 +1697,69 @@ MozQuic::ProcessAck(FrameHeaderData &result, unsigned char *framePtr, bool fromC
     extra = PR_ntohll(extra);
     framePtr += blockLengthLen;
 
-    fprintf(stderr,"ACK RECVD (%s) FOR %lX -> %lX\n",
-            fromCleartext ? "cleartext" : "protected",
-            largestAcked - extra, largestAcked);
-    // form a stack here so we can process them starting at the
-    // lowest packet number, which is how mUnAckedData is ordered and
-    // do it all in one pass
-    assert(numRanges < 257);
-    ackStack[numRanges] =
-      std::pair<uint64_t, uint64_t>(largestAcked - extra, extra + 1);
-
-    largestAcked--;
-    largestAcked -= extra;
-    if (numRanges++ == result.u.mAck.mNumBlocks) {
+    // the first ack block length counts the packets preceding largest
+    // acked, additional block lengths count every packet in the block. A
+    // zero length additional block only extends the gap before it.
+    bool emptyBlock = false;
+    if (numBlocksRead) {
+      if (extra) {
+        extra--;
+      } else {
+        emptyBlock = true;
+      }
+    }
+
+    if (!emptyBlock) {
+      fprintf(stderr,"ACK RECVD (%s) FOR %lX -> %lX\n",
+              fromCleartext ? "cleartext" : "protected",
+              largestAcked - extra, largestAcked);
+      // form a stack here so we can process them starting at the
+      // lowest packet number, which is how mUnAckedData is ordered and
+      // do it all in one pass
+      assert(numRanges < 257);
+      ackStack[numRanges++] =
+        std::pair<uint64_t, uint64_t>(largestAcked - extra, extra + 1);
+
+      largestAcked--;
+      largestAcked -= extra;
+    }
+    if (numBlocksRead++ == result.u.mAck.mNumBlocks) {
       break;
     }
     uint8_t gap = *framePtr;
     largestAcked -= gap;
     framePtr++;
   } while (1);
-  
+
+  uint64_t now = Timestamp();
+  if (result.u.mAck.mLargestAcked > mLargestAcked) {
+    // only a newly acked largest packet gives a usable rtt sample
+    for (auto i = mUnAckedData.begin(); i != mUnAckedData.end(); i++) {
+      if ((*i)->mPacketNumber > result.u.mAck.mLargestAcked) {
+        break;
+      }
+      if ((*i)->mPacketNumber == result.u.mAck.mLargestAcked) {
+        UpdateRTT(now - (*i)->mTransmitTime,
+                  ufloat16_decode(result.u.mAck.mAckDelay) / 1000);
+        break;
+      }
+    }
+    mLargestAcked = result.u.mAck.mLargestAcked;
+    mMTUTimeouts = 0;
+  }
+
+  // any of the attempts at the current size proves it
+  for (uint32_t probe = 0; mMTUProbeSize && (probe <= mMTUProbeCount); probe++) {
+    for (auto iters = numRanges; iters > 0; --iters) {
+      if (mMTUProbePackets[probe] &&
+          (mMTUProbePackets[probe] >= ackStack[iters - 1].first) &&
+          (mMTUProbePackets[probe] < ackStack[iters - 1].first + ackStack[iters - 1].second)) {
+        MTUProbeAcked();
+        break;
+      }
+    }
+  }
+
   auto dataIter = mUnAckedData.begin();
   for (auto iters = numRanges; iters > 0; --iters) {
     uint64_t haveAckFor = ackStack[iters - 1].first;
@@ -1207,12 +1775,17 @@ MozQuic::ProcessAck(FrameHeaderData &result, unsigned char *framePtr, bool fromC
         do {
           assert ((*dataIter)->mPacketNumber == haveAckFor);
           fprintf(stderr,"ACK'd data found for %lX\n", haveAckFor);
+          OnChunkAcked((*dataIter).get());
           dataIter = mUnAckedData.erase(dataIter);
         } while ((dataIter != mUnAckedData.end()) &&
                  (*dataIter)->mPacketNumber == haveAckFor);
       }
     }
   }
+
+  // anything sent sufficiently before the largest acked packet that is
+  // still unacked is lost, don't wait for the retransmit timer
+  DetectLosses(now);
   
   // todo read the timestamps
   // and obviously todo feed the times into congestion control
@@ -1274,7 +1847,6 @@ MozQuic::ProcessGeneral(unsigned char *pkt, uint32_t pktSize, uint32_t headerSiz
 {
   assert(pktSize >= headerSize);
   assert(pktSize <= kMozQuicMSS);
-  unsigned char out[kMozQuicMSS];
 
   if (mConnectionState == CLIENT_STATE_CLOSED ||
       mConnectionState == SERVER_STATE_CLOSED) {
@@ -1282,17 +1854,65 @@ MozQuic::ProcessGeneral(unsigned char *pkt, uint32_t pktSize, uint32_t headerSiz
     return MOZQUIC_ERR_GENERAL;
   }
   uint32_t written;
+  // decrypted in place, the plaintext replaces the ciphertext after the header
   uint32_t rv = mNSSHelper->DecryptBlock(pkt, headerSize, pkt + headerSize,
-                                         pktSize - headerSize, packetNum, out,
-                                         kMozQuicMSS, written);
+                                         pktSize - headerSize, packetNum, pkt + headerSize,
+                                         pktSize - headerSize, written);
   fprintf(stderr,"decrypt (pktnum=%lX) rv=%d sz=%d\n", packetNum, rv, written);
   if (rv != MOZQUIC_OK) {
     fprintf(stderr, "decrypt failed\n");
     return rv;
   }
   mDecodedOK = true;
+  mAddressValidated = true;
   mPingDeadline = 0;
-  return ProcessGeneralDecoded(out, written, sendAck, false);
+  return ProcessGeneralDecoded(pkt + headerSize, written, sendAck, false);
+}
+
+// blocks are consecutive short header packets for this session, with
+// aeadData/in pointing at the datagrams. they are decrypted in place (out == in)
+uint32_t
+MozQuic::ProcessGeneralBatch(AEADBlock *blocks, uint32_t count)
+{
+  // the app may destroy this connection from an event callback while an
+  // earlier packet of the batch is processed
+  std::shared_ptr<MozQuic> deleteProtector(mAlive);
+
+  mNSSHelper->DecryptBatch(blocks, count);
+
+  bool sendAck = false;
+  bool decodedOK = false;
+  for (uint32_t i = 0; (i < count) && mAlive; i++) {
+    if (mConnectionState == CLIENT_STATE_CLOSED ||
+        mConnectionState == SERVER_STATE_CLOSED) {
+      fprintf(stderr,"processgeneral discarding %lX as closed\n", blocks[i].packetNumber);
+      return MOZQUIC_ERR_GENERAL;
+    }
+    fprintf(stderr,"decrypt (pktnum=%lX) rv=%d sz=%d\n", blocks[i].packetNumber,
+            blocks[i].rv, blocks[i].written);
+    if (blocks[i].rv != MOZQUIC_OK) {
+      fprintf(stderr, "decrypt failed\n");
+      continue;
+    }
+    mDecodedOK = true;
+    mAddressValidated = true;
+    mPingDeadline = 0;
+    decodedOK = true;
+    bool pktSendAck = false;
+    if (ProcessGeneralDecoded(blocks[i].out, blocks[i].written, pktSendAck, false) == MOZQUIC_OK) {
+      Acknowledge(blocks[i].packetNumber, keyPhase1Rtt);
+      sendAck = sendAck || pktSendAck;
+    }
+  }
+
+  if (decodedOK) {
+    mLastActivity = Timestamp();
+    MakeReady();
+  }
+  if (sendAck && mAlive) {
+    return MaybeSendAck();
+  }
+  return MOZQUIC_OK;
 }
 
 int
@@ -1301,6 +1921,17 @@ MozQuic::FindStream(uint32_t streamID, std::unique_ptr<MozQuicStreamChunk> &d)
   // Open a new stream and implicitly open all streams with ID smaller than
   // streamID that are not already opened.
   while (streamID >= mNextRecvStreamId) {
+    if (OverMemoryBudget()) {
+      // the packet is not acked so the peer sends it again later. What
+      // came before this frame is dropped as a duplicate then
+      fprintf(stderr, "memory budget spent, refusing stream %d\n", streamID);
+      mMemoryRefused++;
+      if (mParent) {
+        mParent->mMemoryRefused++;
+      }
+      d.reset();
+      return MOZQUIC_ERR_MEMORY;
+    }
     fprintf(stderr, "Add new stream %d\n", mNextRecvStreamId);
     MozQuicStreamPair *stream = new MozQuicStreamPair(mNextRecvStreamId, this, this);
     mStreams.insert( { mNextRecvStreamId, stream } );
@@ -1314,9 +1945,14 @@ MozQuic::FindStream(uint32_t streamID, std::unique_ptr<MozQuicStreamChunk> &d)
     d.reset();
     return MOZQUIC_ERR_ALREADY_FINISHED;
   }
+  uint32_t rv = CheckRecvFlowControl((*i).second, d->mOffset + d->mLen);
+  if (rv != MOZQUIC_OK) {
+    d.reset();
+    return rv;
+  }
   (*i).second->Supply(d);
-  if (!(*i).second->Empty() && mConnEventCB) {
-    mConnEventCB(mClosure, MOZQUIC_EVENT_NEW_STREAM_DATA, (*i).second);
+  if (!(*i).second->Empty()) {
+    QueueReadable((*i).second);
   }
   return MOZQUIC_OK;
 }
@@ -1324,29 +1960,389 @@ MozQuic::FindStream(uint32_t streamID, std::unique_ptr<MozQuicStreamChunk> &d)
 void
 MozQuic::DeleteStream(uint32_t streamID)
 {
+  auto i = mStreams.find(streamID);
+  if (i == mStreams.end()) {
+    return;
+  }
+  if (!(*i).second->mOut.Done()) {
+    // deleted without ending the stream. queue the fin now or the deferral
+    // below would never resolve
+    (*i).second->mOut.EndStream();
+  }
+  if (!(*i).second->mOut.mFinSent) {
+    // the flow control state is needed until the fin has been framed
+    fprintf(stderr, "Delete stream %d deferred until fin is sent\n", streamID);
+    (*i).second->mDeletePending = true;
+    return;
+  }
   fprintf(stderr, "Delete stream %lu\n", streamID);
-  mStreams.erase(streamID);
+  if ((*i).second->mOut.mWantWritable) {
+    mWritableWaiters--;
+  }
+  if ((*i).second->mOut.mCorked) {
+    mCorkedStreams--;
+  }
+  auto &queue = (*i).second->mOut.mUnWritten;
+  if (!queue.empty()) {
+    // retransmissions. they no longer need the stream
+    mSchedule.erase( { (*i).second->mOut.mScheduleKey, streamID } );
+    mUnWrittenData.splice(mUnWrittenData.end(), queue);
+  }
+  mStreams.erase(i);
 }
 
 uint32_t
-MozQuic::ProcessGeneralDecoded(unsigned char *pkt, uint32_t pktSize,
-                               bool &sendAck, bool fromCleartext)
+MozQuic::CheckRecvFlowControl(MozQuicStreamPair *stream, uint64_t endData)
 {
-  // used by both client and server
-  unsigned char *endpkt = pkt + pktSize;
-  uint32_t ptr = 0;
+  if (endData > stream->mIn.mFlowControlLimit) {
+    fprintf(stderr, "stream %d data to %ld exceeds flow control limit %ld\n",
+            stream->mStreamID, endData, stream->mIn.mFlowControlLimit);
+    RaiseError(MOZQUIC_ERR_GENERAL, (char *) "stream flow control violation\n");
+    return MOZQUIC_ERR_GENERAL;
+  }
+  if (endData <= stream->mIn.mMaxOffsetRecvd) {
+    return MOZQUIC_OK;
+  }
+  uint64_t newData = endData - stream->mIn.mMaxOffsetRecvd;
+  if (mDataRecvd + newData > mLocalMaxData) {
+    fprintf(stderr, "connection data %ld exceeds flow control limit %ld\n",
+            mDataRecvd + newData, mLocalMaxData);
+    RaiseError(MOZQUIC_ERR_GENERAL, (char *) "connection flow control violation\n");
+    return MOZQUIC_ERR_GENERAL;
+  }
+  mDataRecvd += newData;
+  stream->mIn.mMaxOffsetRecvd = endData;
+  return MOZQUIC_OK;
+}
 
-  assert(pktSize <= kMozQuicMSS);
-  sendAck = false;
+void
+MozQuic::StreamDataConsumed(MozQuicStreamPair *stream, uint32_t amt)
+{
+  uint64_t now = Timestamp();
+  UpdateStreamWindow(stream, now);
+  mDataConsumed += amt;
+  UpdateConnectionWindow(now);
+}
 
-  // fromCleartext frames may only be ack, stream-0, and padding
-  // and process_client_initial may not be ack
-  
-  while (ptr < pktSize) {
-    FrameHeaderData result(pkt + ptr, pktSize - ptr, this);
-    if (result.mValid != MOZQUIC_OK) {
-      return result.mValid;
-    }
+// advertise more credit once half of a window has been consumed. If the
+// last update was less than 2 rtts ago the reader is keeping up with the
+// window, so grow it to keep the pipe full - unless the memory governor
+// is holding the window back.
+void
+MozQuic::UpdateStreamWindow(MozQuicStreamPair *stream, uint64_t now)
+{
+  uint64_t consumed = stream->mIn.Offset();
+  if ((stream->mIn.mFlowControlLimit - consumed) >= (stream->mIn.mWindow / 2)) {
+    return;
+  }
+  uint64_t rtt = mSmoothedRTT ? mSmoothedRTT : kDefaultRTT;
+  uint64_t window = GovernedWindow(stream->mIn.mWindow);
+  if ((window == stream->mIn.mWindow) &&
+      stream->mIn.mLastWindowUpdate &&
+      ((now - stream->mIn.mLastWindowUpdate) < (2 * rtt)) &&
+      (stream->mIn.mWindow < kMaxStreamWindow)) {
+    stream->mIn.mWindow *= 2;
+    window = stream->mIn.mWindow;
+    fprintf(stderr, "stream %d receive window grows to %ld\n",
+            stream->mStreamID, stream->mIn.mWindow);
+  }
+  if (consumed + window <= stream->mIn.mFlowControlLimit) {
+    return;
+  }
+  stream->mIn.mFlowControlLimit = consumed + window;
+  stream->mIn.mLastWindowUpdate = now;
+  QueueControlFrame(FRAME_TYPE_MAX_STREAM_DATA, stream->mStreamID,
+                    stream->mIn.mFlowControlLimit);
+}
+
+void
+MozQuic::UpdateConnectionWindow(uint64_t now)
+{
+  if ((mLocalMaxData - mDataConsumed) >= (mConnectionWindow / 2)) {
+    return;
+  }
+  uint64_t rtt = mSmoothedRTT ? mSmoothedRTT : kDefaultRTT;
+  uint64_t window = GovernedWindow(mConnectionWindow);
+  if ((window == mConnectionWindow) &&
+      mLastMaxDataUpdate &&
+      ((now - mLastMaxDataUpdate) < (2 * rtt)) &&
+      (mConnectionWindow < kMaxConnectionWindow)) {
+    mConnectionWindow *= 2;
+    window = mConnectionWindow;
+    fprintf(stderr, "connection receive window grows to %ld\n", mConnectionWindow);
+  }
+  // the wire format is in 1KB units
+  uint64_t limit = (mDataConsumed + window) & ~0x3ffULL;
+  if (limit > mLocalMaxData) {
+    mLocalMaxData = limit;
+    mLastMaxDataUpdate = now;
+    QueueControlFrame(FRAME_TYPE_MAX_DATA, 0, mLocalMaxData);
+  }
+}
+
+// credit held back by GovernedWindow is offered again from IO() once
+// there is room for it
+void
+MozQuic::ReopenWindows()
+{
+  uint64_t now = Timestamp();
+  if (now < mWindowsRetry) {
+    return;
+  }
+  mWindowsRetry = now + kWindowRetryInterval;
+  mWindowsWithheld = false; // set again if it is still held back
+  for (auto i = mStreams.begin(); i != mStreams.end(); ++i) {
+    if ((*i).second->mStreamID) {
+      UpdateStreamWindow((*i).second, now);
+    }
+  }
+  UpdateConnectionWindow(now);
+}
+
+// how much of window a receive window update may offer with the memory
+// in use, see kDefaultMemoryBudget
+uint64_t
+MozQuic::GovernedWindow(uint64_t window)
+{
+  MozQuic *root = mParent ? mParent : this;
+  uint64_t budget = root->mMemoryBudget;
+  uint64_t used = root->mMemory.mBytes;
+  if (!budget || (used <= budget / 2)) {
+    return window;
+  }
+  mWindowsWithheld = true;
+  if (used >= budget) {
+    return 0;
+  }
+  return window * (budget - used) / (budget - budget / 2);
+}
+
+bool
+MozQuic::OverMemoryBudget()
+{
+  MozQuic *root = mParent ? mParent : this;
+  return root->mMemoryBudget && (root->mMemory.mBytes >= root->mMemoryBudget);
+}
+
+// a write has to fit in the room the stream and the connection have
+// left. One bigger than a whole limit can never fit, so it is taken only
+// once that buffer has drained completely.
+bool
+MozQuic::SendBufferOpen(MozQuicStreamPair *stream, uint32_t len)
+{
+  uint64_t buffered = stream->mOut.Buffered();
+  uint64_t connBuffered = mDataWritten - mDataSent;
+  if ((!buffered || (buffered + len <= mStreamSendBuffer)) &&
+      (!connBuffered || (connBuffered + len <= mConnectionSendBuffer))) {
+    return true;
+  }
+  mSendBlocked++;
+  if (!stream->mOut.mWantWritable) {
+    stream->mOut.mWantWritable = true;
+    mWritableWaiters++;
+  }
+  return false;
+}
+
+// streams that were refused a write hear once their buffer and the
+// connection's have drained to half of the limit
+void
+MozQuic::NotifyWritable()
+{
+  if ((mDataWritten - mDataSent) > (mConnectionSendBuffer / 2)) {
+    return;
+  }
+  // the callbacks can open and delete streams
+  std::vector<uint32_t> ready;
+  for (auto i = mStreams.begin(); i != mStreams.end(); ++i) {
+    MozQuicStreamOut &out = (*i).second->mOut;
+    if (out.mWantWritable && (out.Buffered() <= (mStreamSendBuffer / 2))) {
+      out.mWantWritable = false;
+      mWritableWaiters--;
+      ready.push_back((*i).first);
+    }
+  }
+  for (auto i = ready.begin(); i != ready.end() && mConnEventCB; ++i) {
+    auto stream = mStreams.find(*i);
+    if (stream != mStreams.end()) {
+      mConnEventCB(mClosure, MOZQUIC_EVENT_STREAM_WRITABLE, (*stream).second);
+    }
+  }
+}
+
+// while a stream is corked its small writes are held until a packet's
+// worth has gathered, the stream is uncorked or ends, or kCorkDelay has
+// passed since the first of them
+uint32_t
+MozQuic::SetCork(MozQuicStreamPair *stream, bool corked)
+{
+  if (!stream->mStreamID) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  if (stream->mOut.mCorked == corked) {
+    return MOZQUIC_OK;
+  }
+  stream->mOut.mCorked = corked;
+  if (corked) {
+    mCorkedStreams++;
+    return MOZQUIC_OK;
+  }
+  mCorkedStreams--;
+  return stream->mOut.FlushCork(false);
+}
+
+void
+MozQuic::CorkHeld(MozQuicStreamPair *stream)
+{
+  stream->mOut.mCorkDeadline = Timestamp() + kCorkDelay;
+  WakeAt(stream->mOut.mCorkDeadline);
+}
+
+void
+MozQuic::CorkTimer()
+{
+  uint64_t now = Timestamp();
+  for (auto i = mStreams.begin(); i != mStreams.end(); ++i) {
+    MozQuicStreamOut &out = (*i).second->mOut;
+    if (out.mCorkDeadline && (out.mCorkDeadline <= now)) {
+      out.FlushCork(false);
+    }
+  }
+}
+
+void
+MozQuic::QueueReadable(MozQuicStreamPair *stream)
+{
+  if (!stream->mIn.mReadQueued) {
+    stream->mIn.mReadQueued = true;
+    mReadable.push_back(stream->mStreamID);
+  }
+}
+
+// MOZQUIC_EVENT_NEW_STREAM_DATA comes once per IO() for each stream that
+// got data in it, not once per frame, and waits for the stream's low
+// watermark to be readable. It does not wait on data that can not come,
+// or stall the peer: the fin, half of the stream's flow control credit
+// (the point where reading it sends a window update), or the connection
+// getting within half a window of blocking also deliver it. Streams short
+// of their watermark stay queued.
+void
+MozQuic::NotifyReadable()
+{
+  std::vector<uint32_t> readable;
+  readable.swap(mReadable);
+  bool connPressed = (mLocalMaxData - mDataRecvd) < (mConnectionWindow / 2);
+
+  for (auto i = readable.begin(); i != readable.end(); ++i) {
+    auto iter = mStreams.find(*i);
+    if (iter == mStreams.end()) {
+      continue;
+    }
+    MozQuicStreamPair *stream = (*iter).second;
+    stream->mIn.mReadQueued = false;
+    if (stream->Empty() || !mConnEventCB) {
+      continue;
+    }
+    uint64_t avail = stream->mIn.Readable();
+    uint64_t lowat = std::min<uint64_t>(stream->mIn.mReadLowat,
+                                        (stream->mIn.mFlowControlLimit - stream->mIn.Offset()) / 2);
+    if ((avail >= lowat) || connPressed || stream->mIn.FinReadable(avail)) {
+      // the callback can delete the stream
+      mConnEventCB(mClosure, MOZQUIC_EVENT_NEW_STREAM_DATA, stream);
+    } else {
+      QueueReadable(stream);
+    }
+  }
+}
+
+void
+MozQuic::QueueControlFrame(uint8_t frameType, uint32_t streamID, uint64_t value)
+{
+  std::unique_ptr<MozQuicStreamChunk> tmp(new MozQuicStreamChunk(frameType, streamID, value));
+  DoWriter(tmp);
+}
+
+uint32_t
+MozQuic::ProcessFlowControlFrame(FrameHeaderData &result)
+{
+  if (result.mType == FRAME_TYPE_MAX_DATA) {
+    uint64_t limit = result.u.mMaxData.mMaximumData << 10;
+    if (limit > mPeerMaxData) {
+      fprintf(stderr, "recvd MAX_DATA %ld\n", limit);
+      mPeerMaxData = limit;
+    }
+  } else if (result.mType == FRAME_TYPE_MAX_STREAM_DATA) {
+    auto i = mStreams.find(result.u.mMaxStreamData.mStreamID);
+    if (i == mStreams.end()) {
+      // a stream that is already gone can still see credit in flight, but
+      // one neither side has opened cannot be given any
+      uint32_t streamID = result.u.mMaxStreamData.mStreamID;
+      uint32_t next = ((streamID & 1) == (mNextStreamId & 1)) ? mNextStreamId : mNextRecvStreamId;
+      if (streamID >= next) {
+        fprintf(stderr, "MAX_STREAM_DATA for unopened stream %d\n", streamID);
+        RaiseError(MOZQUIC_ERR_GENERAL, (char *) "MAX_STREAM_DATA for unopened stream\n");
+        return MOZQUIC_ERR_GENERAL;
+      }
+      return MOZQUIC_OK;
+    }
+    if (result.u.mMaxStreamData.mMaximumStreamData > (*i).second->mOut.mFlowControlLimit) {
+      fprintf(stderr, "recvd MAX_STREAM_DATA %d %ld\n", result.u.mMaxStreamData.mStreamID,
+              result.u.mMaxStreamData.mMaximumStreamData);
+      (*i).second->mOut.mFlowControlLimit = result.u.mMaxStreamData.mMaximumStreamData;
+    }
+  } else if (result.mType == FRAME_TYPE_BLOCKED) {
+    fprintf(stderr, "recvd BLOCKED\n");
+    mBlockedFramesRecvd++;
+  } else if (result.mType == FRAME_TYPE_STREAM_BLOCKED) {
+    fprintf(stderr, "recvd STREAM_BLOCKED %d\n", result.u.mStreamBlocked.mStreamID);
+    mBlockedFramesRecvd++;
+  }
+  return MOZQUIC_OK;
+}
+
+void
+MozQuic::GetStats(struct mozquic_stats_t *stats)
+{
+  stats->packetsLost = mPacketsLost;
+  stats->blockedSent = mBlockedFramesSent;
+  stats->blockedReceived = mBlockedFramesRecvd;
+  stats->amplificationDropped = mAmplificationDropped;
+  stats->versionNegotiationSent = mVersionNegotiationSent;
+  stats->versionNegotiationDropped = mVersionNegotiationDropped;
+  stats->statelessRetriesSent = mStatelessRetriesSent;
+  stats->earlyDataSent = mEarlyDataSent;
+  stats->earlyDataRejected = mEarlyDataRejected;
+  stats->earlyPacketsReceived = mEarlyPacketsReceived;
+  stats->sessionResumed = (mNSSHelper && mNSSHelper->IsResumed()) ? 1 : 0;
+  stats->idleTimeouts = mIdleTimeouts;
+  stats->connectionsReaped = mConnectionsReaped;
+  stats->intakeBudgetExhausted = mIntakeBudgetExhausted;
+  stats->flushBudgetExhausted = mFlushBudgetExhausted;
+  stats->ioTimeBudgetExhausted = mIOTimeBudgetExhausted;
+  stats->memoryBuffered = mMemory.mBytes;
+  stats->memoryRefused = mMemoryRefused;
+  stats->sendBlocked = mSendBlocked;
+}
+
+uint32_t
+MozQuic::ProcessGeneralDecoded(unsigned char *pkt, uint32_t pktSize,
+                               bool &sendAck, bool fromCleartext)
+{
+  // used by both client and server
+  unsigned char *endpkt = pkt + pktSize;
+  uint32_t ptr = 0;
+
+  assert(pktSize <= kMozQuicMSS);
+  sendAck = false;
+
+  // fromCleartext frames may only be ack, stream-0, and padding
+  // and process_client_initial may not be ack
+  
+  while (ptr < pktSize) {
+    FrameHeaderData result(pkt + ptr, pktSize - ptr, this);
+    if (result.mValid != MOZQUIC_OK) {
+      return result.mValid;
+    }
     ptr += result.mFrameLen;
     if (result.mType == FRAME_TYPE_PADDING) {
       continue;
@@ -1379,8 +2375,13 @@ MozQuic::ProcessGeneralDecoded(unsigned char *pkt, uint32_t pktSize,
                                    pkt + ptr,
                                    result.u.mStream.mDataLen,
                                    result.u.mStream.mFinBit));
+      tmp->Charge(&mMemory);
       if (!result.u.mStream.mStreamID) {
-        mStream0->Supply(tmp);
+        // without mstream0 this can only be a retransmit of what the
+        // handshake already used
+        if (mStream0) {
+          mStream0->Supply(tmp);
+        }
       } else {
         
         if (fromCleartext) {
@@ -1419,12 +2420,24 @@ MozQuic::ProcessGeneralDecoded(unsigned char *pkt, uint32_t pktSize,
       }
       fprintf(stderr,"RECVD CLOSE\n");
       sendAck = true;
-      mConnectionState = mIsClient ? CLIENT_STATE_CLOSED : SERVER_STATE_CLOSED;
+      EnterClosed();
       if (mConnEventCB) {
         mConnEventCB(mClosure, MOZQUIC_EVENT_CLOSE_CONNECTION, this);
       } else {
         fprintf(stderr,"No Event callback\n");
       }
+    } else if ((result.mType == FRAME_TYPE_MAX_DATA) ||
+               (result.mType == FRAME_TYPE_MAX_STREAM_DATA) ||
+               (result.mType == FRAME_TYPE_BLOCKED) ||
+               (result.mType == FRAME_TYPE_STREAM_BLOCKED)) {
+      if (fromCleartext) {
+        RaiseError(MOZQUIC_ERR_GENERAL, (char *) "flow control frames not allowed in cleartext\n");
+        return MOZQUIC_ERR_GENERAL;
+      }
+      sendAck = true;
+      if (ProcessFlowControlFrame(result) != MOZQUIC_OK) {
+        return MOZQUIC_ERR_GENERAL;
+      }
     } else {
       sendAck = true;
       if (fromCleartext) {
@@ -1446,6 +2459,7 @@ MozQuic::Accept(struct sockaddr_in *clientAddr, uint64_t aConnectionID)
   child->mIsChild = true;
   child->mIsClient = false;
   child->mParent = this;
+  child->mMemory.mParent = &mMemory;
   child->mConnectionState = SERVER_STATE_LISTEN;
   memcpy(&child->mPeer, clientAddr, sizeof (struct sockaddr_in));
   child->mFD = mFD;
@@ -1456,7 +2470,7 @@ MozQuic::Accept(struct sockaddr_in *clientAddr, uint64_t aConnectionID)
       child->mConnectionID = child->mConnectionID << 16;
       child->mConnectionID = child->mConnectionID | (random() & 0xffff);
     }
-  } while (mConnectionHash.count(child->mConnectionID) != 0);
+  } while (mConnectionHash.Contains(child->mConnectionID));
       
   for (int i=0; i < 2; i++) {
     child->mNextTransmitPacketNumber = child->mNextTransmitPacketNumber << 16;
@@ -1465,14 +2479,25 @@ MozQuic::Accept(struct sockaddr_in *clientAddr, uint64_t aConnectionID)
   child->mNextTransmitPacketNumber &= 0x7fffffff; // 31 bits
   child->mOriginalTransmitPacketNumber = child->mNextTransmitPacketNumber;
 
-  child->mNSSHelper.reset(new NSSHelper(child, mTolerateBadALPN, mOriginName.get()));
+  child->mBuiltinPacketProtection = mBuiltinPacketProtection;
+  child->mEnable0RTT = mEnable0RTT;
+  child->mReleaseHandshakeState = mReleaseHandshakeState;
+  child->mNSSHelper.reset(new NSSHelper(child, mTolerateBadALPN, mServerModel));
+  if (mHandshakeWorkers) {
+    child->mNSSHelper->UseWorkers(mHandshakeWorkers);
+  }
   child->mVersion = mVersion;
   child->mTimestampConnBegin = Timestamp();
+  child->mIdleTimeout = mIdleTimeout;
+  child->mFlushBudget = mFlushBudget;
+  child->mStreamSendBuffer = mStreamSendBuffer;
+  child->mConnectionSendBuffer = mConnectionSendBuffer;
+  child->mLastActivity = child->mTimestampConnBegin;
+  child->mOriginalConnectionID = aConnectionID;
 
-  mConnectionHash.insert( { child->mConnectionID, child });
-  mConnectionHashOriginalNew.insert( { aConnectionID,
-                                       { child->mConnectionID, Timestamp() }
-                                     } );
+  mConnectionHash.Insert(child->mConnectionID, child);
+  mConnectionHashOriginalNew.Insert(aConnectionID,
+                                    { child->mConnectionID, Timestamp() });
 
   return child;
 }
@@ -1529,6 +2554,162 @@ MozQuic::GenerateVersionNegotiation(LongHeaderData &clientHeader, struct sockadd
   return Transmit(pkt, framePtr - pkt, peer);
 }
 
+bool
+MozQuic::VersionNegotiationAllowed(uint32_t pktSize)
+{
+  // a client initial is padded out, anything smaller that gets a reply
+  // is amplified
+  if (pktSize < kMinClientInitial) {
+    mVersionNegotiationDropped++;
+    return false;
+  }
+
+  uint64_t now = Timestamp();
+  if (now > mVersionNegotiationRefill) {
+    mVersionNegotiationTokens += (now - mVersionNegotiationRefill) * kVersionNegotiationRate;
+    if (mVersionNegotiationTokens > kVersionNegotiationBurst * 1000) {
+      mVersionNegotiationTokens = kVersionNegotiationBurst * 1000;
+    }
+  }
+  mVersionNegotiationRefill = now;
+  if (mVersionNegotiationTokens < 1000) {
+    mVersionNegotiationDropped++;
+    return false;
+  }
+  mVersionNegotiationTokens -= 1000;
+  mVersionNegotiationSent++;
+  return true;
+}
+
+bool
+MozQuic::StatelessRetryNeeded()
+{
+  // every client initial without a valid token counts as a handshake
+  // attempt. The rate is checked against this second and the last one so
+  // retry doesn't switch off just because a new second started.
+  uint64_t now = Timestamp();
+  if (now - mHandshakeRateStart >= 1000) {
+    mHandshakeRatePrev = (now - mHandshakeRateStart < 2000) ? mHandshakeRateCount : 0;
+    mHandshakeRateStart = now;
+    mHandshakeRateCount = 0;
+  }
+  mHandshakeRateCount++;
+
+  bool needed = mStatelessRetry ||
+    (mStatelessRetryRate && ((mHandshakeRateCount > mStatelessRetryRate) ||
+                             (mHandshakeRatePrev > mStatelessRetryRate)));
+  if (needed != mStatelessRetryActive) {
+    fprintf(stderr, "stateless retry %s\n", needed ? "on" : "off");
+    mStatelessRetryActive = needed;
+  }
+  return needed;
+}
+
+uint32_t
+MozQuic::MakeRetryToken(struct sockaddr_in *peer, uint64_t connectionID,
+                        uint8_t keyIndex, uint64_t issued, unsigned char *out)
+{
+  assert(keyIndex < 2);
+  if (!mRetryKey[keyIndex]) {
+    return MOZQUIC_ERR_CRYPTO;
+  }
+
+  // the key index and issue time go in the clear, the mac covers them and
+  // the address and connection id the token is good for
+  unsigned char input[1 + 8 + 4 + 2 + 8];
+  uint64_t tmp64;
+  input[0] = keyIndex;
+  tmp64 = PR_htonll(issued);
+  memcpy(input + 1, &tmp64, 8);
+  memcpy(input + 9, &peer->sin_addr.s_addr, 4);
+  memcpy(input + 13, &peer->sin_port, 2);
+  tmp64 = PR_htonll(connectionID);
+  memcpy(input + 15, &tmp64, 8);
+
+  unsigned char mac[32];
+  uint32_t rv = NSSHelper::HMACSHA256(mRetryKey[keyIndex], input, sizeof(input), mac);
+  if (rv != MOZQUIC_OK) {
+    return rv;
+  }
+  memcpy(out, input, 9);
+  memcpy(out + 9, mac, kRetryTokenLength - 9);
+  return MOZQUIC_OK;
+}
+
+bool
+MozQuic::CheckRetryToken(struct sockaddr_in *peer, uint64_t connectionID,
+                         const unsigned char *token)
+{
+  uint8_t keyIndex = token[0];
+  if ((keyIndex > 1) || !mRetryKey[keyIndex]) {
+    return false;
+  }
+  uint64_t issued;
+  memcpy(&issued, token + 1, 8);
+  issued = PR_ntohll(issued);
+  uint64_t now = Timestamp();
+  if ((issued > now) || ((now - issued) > kRetryTokenLifetime)) {
+    return false;
+  }
+
+  unsigned char expected[kRetryTokenLength];
+  if (MakeRetryToken(peer, connectionID, keyIndex, issued, expected) != MOZQUIC_OK) {
+    return false;
+  }
+  return !NSS_SecureMemcmp(expected + 9, token + 9, kRetryTokenLength - 9);
+}
+
+uint32_t
+MozQuic::GenerateStatelessRetry(LongHeaderData &clientHeader, struct sockaddr_in *peer)
+{
+  assert(!mIsChild);
+  assert(!mIsClient);
+
+  // rotate into the other slot so the key tokens were just issued with
+  // stays around for as long as they are valid
+  uint64_t now = Timestamp();
+  if (!mRetryKey[mRetryKeyIndex] || ((now - mRetryKeyBirth) >= kRetryKeyLifetime)) {
+    uint8_t next = mRetryKey[mRetryKeyIndex] ? (mRetryKeyIndex ^ 1) : mRetryKeyIndex;
+    if (mRetryKey[next]) {
+      PK11_FreeSymKey(mRetryKey[next]);
+    }
+    mRetryKey[next] = NSSHelper::GenerateHMACKey();
+    if (!mRetryKey[next]) {
+      Log((char *)"unable to generate stateless retry key");
+      return MOZQUIC_ERR_CRYPTO;
+    }
+    mRetryKeyIndex = next;
+    mRetryKeyBirth = now;
+  }
+
+  unsigned char pkt[17 + FRAME_TYPE_RETRY_TOKEN_LENGTH + kFNV64Size];
+  uint32_t tmp32;
+  uint64_t tmp64;
+
+  pkt[0] = 0x80 | PACKET_TYPE_SERVER_STATELESS_RETRY;
+  // connection id, packet number, and version are echo'd from the client
+  tmp64 = PR_htonll(clientHeader.mConnectionID);
+  memcpy(pkt + 1, &tmp64, 8);
+  tmp32 = htonl(clientHeader.mPacketNumber);
+  memcpy(pkt + 9, &tmp32, 4);
+  tmp32 = htonl(clientHeader.mVersion);
+  memcpy(pkt + 13, &tmp32, 4);
+
+  pkt[17] = FRAME_TYPE_RETRY_TOKEN;
+  uint32_t rv = MakeRetryToken(peer, clientHeader.mConnectionID, mRetryKeyIndex, now, pkt + 18);
+  if (rv != MOZQUIC_OK) {
+    return rv;
+  }
+
+  uint64_t hash = fnv1a(pkt, sizeof(pkt) - kFNV64Size);
+  hash = PR_htonll(hash);
+  memcpy(pkt + sizeof(pkt) - kFNV64Size, &hash, kFNV64Size);
+
+  fprintf(stderr,"TRANSMIT STATELESS RETRY for %lx\n", clientHeader.mConnectionID);
+  mStatelessRetriesSent++;
+  return Transmit(pkt, sizeof(pkt), peer);
+}
+
 int
 MozQuic::ProcessClientInitial(unsigned char *pkt, uint32_t pktSize,
                               struct sockaddr_in *clientAddr,
@@ -1561,15 +2742,23 @@ MozQuic::ProcessClientInitial(unsigned char *pkt, uint32_t pktSize,
   mVersion = header.mVersion;
 
   // Check whether this is an dup.
-  auto i = mConnectionHashOriginalNew.find(header.mConnectionID);
-  if (i != mConnectionHashOriginalNew.end()) {
-    if ((*i).second.mTimestamp < (Timestamp() - kForgetInitialConnectionIDsThresh)) {
+  InitialClientPacketInfo *i = mConnectionHashOriginalNew.Find(header.mConnectionID);
+  if (i) {
+    if (i->mTimestamp < (Timestamp() - kForgetInitialConnectionIDsThresh)) {
       // This connectionId is too old, just remove it.
-      mConnectionHashOriginalNew.erase(i);
+      mConnectionHashOriginalNew.Erase(header.mConnectionID);
     } else {
-      auto j = mConnectionHash.find((*i).second.mServerConnectionID);
-      if (j != mConnectionHash.end()) {
-        *childSession = (*j).second;
+      MozQuic **j = mConnectionHash.Find(i->mServerConnectionID);
+      if (j && (*j)->mClosingDeadline) {
+        // a late retransmission for a connection that is closing
+        *childSession = nullptr;
+        return MOZQUIC_OK;
+      } else if (j) {
+        *childSession = *j;
+        if (!(*j)->mAddressValidated) {
+          // a retransmitted initial raises the amplification limit
+          (*j)->mUnvalidatedBytesRecvd += pktSize;
+        }
         // It is a dup and we will ignore it.
         // TODO: maybe send hrr.
         return MOZQUIC_OK;
@@ -1577,15 +2766,42 @@ MozQuic::ProcessClientInitial(unsigned char *pkt, uint32_t pktSize,
         // TODO maybe do not accept this: we received a dup of connectionId
         // during kForgetInitialConnectionIDsThresh but we do not have a
         // session, i.e. session is terminated.
-        mConnectionHashOriginalNew.erase(i);
+        mConnectionHashOriginalNew.Erase(header.mConnectionID);
       }
     }
   }
+
+  // a client that echoes a valid token has shown it receives at its
+  // address, it doesn't count as a new handshake attempt. Otherwise no
+  // state is created while stateless retry is on.
+  uint32_t tokenLen = 0;
+  bool validated = false;
+  if (pkt[17] == FRAME_TYPE_RETRY_TOKEN) {
+    tokenLen = FRAME_TYPE_RETRY_TOKEN_LENGTH;
+    validated = CheckRetryToken(clientAddr, header.mConnectionID, pkt + 18);
+    if (!validated) {
+      Log((char *)"stateless retry token did not verify");
+    }
+  }
+  if (!validated && StatelessRetryNeeded()) {
+    return GenerateStatelessRetry(header, clientAddr);
+  }
+
+  if (OverMemoryBudget()) {
+    // dropped, the client retries its initial
+    Log((char *)"memory budget spent, refusing connection");
+    mMemoryRefused++;
+    return MOZQUIC_OK;
+  }
+
   MozQuic *child = Accept(clientAddr, header.mConnectionID);
   assert(!mIsChild);
   assert(!mIsClient);
+  child->mAddressValidated = validated;
+  child->mUnvalidatedBytesRecvd = pktSize;
   mChildren.emplace_back(child->mAlive);
-  child->ProcessGeneralDecoded(pkt + 17, pktSize - 17 - 8, sendAck, true);
+  child->mChildIter = std::prev(mChildren.end());
+  child->ProcessGeneralDecoded(pkt + 17 + tokenLen, pktSize - 17 - 8 - tokenLen, sendAck, true);
   child->mConnectionState = SERVER_STATE_1RTT;
   if (mConnEventCB) {
     mConnEventCB(mClosure, MOZQUIC_EVENT_ACCEPT_NEW_CONNECTION, child);
@@ -1593,6 +2809,11 @@ MozQuic::ProcessClientInitial(unsigned char *pkt, uint32_t pktSize,
     fprintf(stderr,"No Event callback\n");
   }
   *childSession = child;
+  if (child->mEnable0RTT) {
+    // 0-rtt packets usually follow the initial in the same burst, so find
+    // out now whether early data is accepted
+    child->Server1RTT();
+  }
   return MOZQUIC_OK;
 }
 
@@ -1606,7 +2827,7 @@ MozQuic::ProcessClientCleartext(unsigned char *pkt, uint32_t pktSize, LongHeader
   assert(mIsChild);
 
   assert(!mIsClient);
-  assert(mStream0);
+  assert(mStream0 || mReleaseHandshakeState);
 
   if (header.mVersion != mVersion) {
     RaiseError(MOZQUIC_ERR_GENERAL, (char *)"version mismatch");
@@ -1623,8 +2844,8 @@ MozQuic::FlushStream0(bool forceAck)
     return MOZQUIC_OK;
   }
 
-  unsigned char pkt[kMozQuicMTU];
-  unsigned char *endpkt = pkt + kMozQuicMTU;
+  unsigned char pkt[kMaxMTU];
+  unsigned char *endpkt = pkt + mMTU;
   uint32_t tmp32;
 
   // section 5.4.1 of transport
@@ -1646,14 +2867,20 @@ MozQuic::FlushStream0(bool forceAck)
   memcpy(pkt + 13, &tmp32, 4);
 
   unsigned char *framePtr = pkt + 17;
-  CreateStreamAndAckFrames(framePtr, endpkt - 8, true); // last 8 are for checksum
-  bool sentStream = (framePtr != (pkt + 17));
+  if (((pkt[0] & 0x7f) == PACKET_TYPE_CLIENT_INITIAL) && mReceivedRetry) {
+    framePtr[0] = FRAME_TYPE_RETRY_TOKEN;
+    memcpy(framePtr + 1, mRetryToken, kRetryTokenLength);
+    framePtr += FRAME_TYPE_RETRY_TOKEN_LENGTH;
+  }
+  unsigned char *payload = framePtr;
+  CreateStreamAndAckFrames(framePtr, endpkt - 8, true, keyPhaseUnprotected); // last 8 are for checksum
+  bool sentStream = (framePtr != payload);
 
   // then padding as needed up to mtu on client_initial
   uint32_t finalLen;
 
   if ((pkt[0] & 0x7f) == PACKET_TYPE_CLIENT_INITIAL) {
-    finalLen = kMozQuicMTU;
+    finalLen = mMTU;
   } else {
     uint32_t room = endpkt - framePtr - 8; // the last 8 are for checksum
     uint32_t used;
@@ -1666,7 +2893,7 @@ MozQuic::FlushStream0(bool forceAck)
     finalLen = ((framePtr - pkt) + 8);
   }
 
-  if (framePtr != (pkt + 17)) {
+  if (framePtr != payload) {
     uint32_t paddingNeeded = finalLen - 8 - (framePtr - pkt);
     memset (framePtr, 0, paddingNeeded);
     framePtr += paddingNeeded;
@@ -1686,6 +2913,7 @@ MozQuic::FlushStream0(bool forceAck)
             mNextTransmitPacketNumber - mOriginalTransmitPacketNumber);
 
     mNextTransmitPacketNumber++;
+    mHandshakePacketsSent++;
   
     if (sentStream && !mUnWrittenData.empty()) {
       return FlushStream0(false);
@@ -1694,179 +2922,560 @@ MozQuic::FlushStream0(bool forceAck)
   return MOZQUIC_OK;
 }
 
+// the scheduling key of a stream with unwritten data. Within an urgency
+// sequential streams are sent in stream id order ahead of incremental
+// ones, which are interleaved by weighted virtual time
+void
+MozQuic::Schedule(MozQuicStreamPair *stream)
+{
+  MozQuicStreamOut &out = stream->mOut;
+  uint64_t key = (uint64_t)out.mUrgency << 56;
+  if (out.mIncremental) {
+    if (out.mVirtualTime < mVirtualClock[out.mUrgency]) {
+      out.mVirtualTime = mVirtualClock[out.mUrgency];
+    }
+    key |= 1ULL << 55;
+    key |= out.mVirtualTime & ((1ULL << 55) - 1);
+  } else {
+    key |= stream->mStreamID;
+  }
+  out.mScheduleKey = key;
+  mSchedule.insert( { key, stream->mStreamID } );
+}
+
+uint32_t
+MozQuic::SetPriority(MozQuicStreamPair *stream, uint8_t urgency, uint16_t weight,
+                     bool incremental)
+{
+  bool scheduled = !stream->mOut.mUnWritten.empty();
+  if (scheduled) {
+    mSchedule.erase( { stream->mOut.mScheduleKey, stream->mStreamID } );
+  }
+  uint32_t rv = stream->mOut.SetPriority(urgency, weight, incremental);
+  if (scheduled) {
+    Schedule(stream);
+  }
+  return rv;
+}
+
+// control frames, stream 0 and retransmissions of deleted streams go
+// first, in the order they were queued. Then streams are served from
+// mschedule
 uint32_t
-MozQuic::CreateStreamAndAckFrames(unsigned char *&framePtr, unsigned char *endpkt, bool justZero)
+MozQuic::CreateStreamAndAckFrames(unsigned char *&framePtr, unsigned char *endpkt, bool justZero,
+                                  keyPhase kp)
 {
+  bool blocked;
   auto iter = mUnWrittenData.begin();
   while (iter != mUnWrittenData.end()) {
+    if ((*iter)->mType != FRAME_TYPE_STREAM) {
+      if (justZero) {
+        iter++;
+        continue;
+      }
+      uint32_t used = CreateControlFrame((*iter).get(), framePtr, endpkt);
+      if (used == 0xffffffff) {
+        // no longer needed
+        iter = mUnWrittenData.erase(iter);
+        continue;
+      }
+      if (!used) {
+        break;
+      }
+      framePtr += used;
+      MoveToUnAcked(*iter, kp);
+      iter = mUnWrittenData.erase(iter);
+      continue;
+    }
     if (justZero && (*iter)->mStreamID) {
       iter++;
       continue;
     }
-    
-    uint32_t room = endpkt - framePtr; // the last 8 are for checksum // todo only on plaintext
-    if (room < 1) {
-      break; // this is only for type, we will do a second check later.
-    }
-
-    // 11fssood -> 11000001 -> 0xC1. Fill in fin, offset-len and id-len below dynamically
-    auto typeBytePtr = framePtr;
-    framePtr[0] = 0xc1;
-
-    // Determine streamId size
-    uint32_t tmp32 = (*iter)->mStreamID;
-    tmp32 = htonl(tmp32);
-    uint8_t idLen = 4;
-    for (int i=0; (i < 3) && (((uint8_t*)(&tmp32))[i] == 0); i++) {
-      idLen--;
+    if ((*iter)->mStreamID && (mBytesInFlight >= mCongestionWindow)) {
+      // congestion limited. stream 0 (the handshake) is exempt
+      iter++;
+      continue;
     }
-
-    // determine offset size
-    uint64_t offsetValue = PR_htonll((*iter)->mOffset);
-    uint8_t offsetLen = 8;
-    for (int i=0; (i < 8) && (((uint8_t*)(&offsetValue))[i] == 0);) {
-      i++;
-      if ( (i == 4) || (i == 6) || (i == 8)) {
-        offsetLen = 8 - i;
+    if (!CreateStreamFrame(mUnWrittenData, iter, framePtr, endpkt, kp, blocked)) {
+      if (!blocked) {
+        break;
       }
+      iter++;
     }
-
-    // 1(type) + idLen + offsetLen + 2(len) + 1(data)
-    if (room < (4 + idLen + offsetLen)) {
-      break;
+  }
+  if (justZero) {
+    return MOZQUIC_OK;
+  }
+
+  auto s = mSchedule.begin();
+  while ((s != mSchedule.end()) && (mBytesInFlight < mCongestionWindow)) {
+    auto i = mStreams.find(s->second);
+    assert(i != mStreams.end());
+    MozQuicStreamPair *stream = (*i).second;
+    auto &queue = stream->mOut.mUnWritten;
+
+    // a sequential stream keeps going while it can. An incremental one
+    // gives up its turn after each frame
+    bool framed = false;
+    bool full = false;
+    auto chunk = queue.begin();
+    while (chunk != queue.end()) {
+      if (!CreateStreamFrame(queue, chunk, framePtr, endpkt, kp, blocked)) {
+        full = !blocked;
+        break;
+      }
+      framed = true;
+      if (stream->mOut.mIncremental) {
+        break;
+      }
+    }
+    if (!framed) {
+      if (full) {
+        break;
+      }
+      s++; // flow control blocked
+      continue;
     }
 
-    // adjust the frame type:
-    framePtr[0] |= (idLen - 1) << 3;
-    if (offsetLen == 2) {
-      framePtr[0] |= 0x02;
-    } else if (offsetLen == 4) {
-      framePtr[0] |= 0x04;
-    } else if (offsetLen == 8) {
-      framePtr[0] |= 0x06;
+    auto next = mSchedule.erase(s);
+    if (stream->mDeletePending && stream->mOut.mFinSent) {
+      DeleteStream(stream->mStreamID);
+    } else if (!queue.empty()) {
+      // its key may have moved past the next stream's
+      Schedule(stream);
+      auto again = mSchedule.find( { stream->mOut.mScheduleKey, stream->mStreamID } );
+      if ((next == mSchedule.end()) || (*again < *next)) {
+        next = again;
+      }
     }
-    framePtr++;
+    if (full) {
+      break;
+    }
+    s = next;
+  }
+  return MOZQUIC_OK;
+}
 
-    // Set streamId
-    memcpy(framePtr, ((uint8_t*)(&tmp32)) + (4 - idLen), idLen);
-    framePtr += idLen;
+// frames the chunk at iter, which is removed from queue. Returns false if
+// it is flow control blocked (blocked is set) or the packet has no room
+bool
+MozQuic::CreateStreamFrame(std::list<std::unique_ptr<MozQuicStreamChunk>> &queue,
+                           std::list<std::unique_ptr<MozQuicStreamChunk>>::iterator &iter,
+                           unsigned char *&framePtr, unsigned char *endpkt, keyPhase kp,
+                           bool &blocked)
+{
+  MozQuicStreamPair *stream = nullptr;
+  uint32_t fcRoom = 0xffffffff;
+  if ((*iter)->mStreamID && !FlowControlRoom((*iter).get(), stream, fcRoom)) {
+    blocked = true;
+    return false;
+  }
+  
+  uint32_t room = endpkt - framePtr; // the last 8 are for checksum // todo only on plaintext
+  blocked = false;
+  if (room < 1) {
+    return false; // this is only for type, we will do a second check later.
+  }
+
+  // 11fssood -> 11000001 -> 0xC1. Fill in fin, offset-len and id-len below dynamically
+  auto typeBytePtr = framePtr;
+  framePtr[0] = 0xc1;
 
-    // Set offset
-    if (offsetLen) {
-      memcpy(framePtr, ((uint8_t*)(&offsetValue)) + (8 - offsetLen), offsetLen);
-      framePtr += offsetLen;
+  // Determine streamId size
+  uint32_t tmp32 = (*iter)->mStreamID;
+  tmp32 = htonl(tmp32);
+  uint8_t idLen = 4;
+  for (int i=0; (i < 3) && (((uint8_t*)(&tmp32))[i] == 0); i++) {
+    idLen--;
+  }
+
+  // determine offset size
+  uint64_t offsetValue = PR_htonll((*iter)->mOffset);
+  uint8_t offsetLen = 8;
+  for (int i=0; (i < 8) && (((uint8_t*)(&offsetValue))[i] == 0);) {
+    i++;
+    if ( (i == 4) || (i == 6) || (i == 8)) {
+      offsetLen = 8 - i;
     }
+  }
 
-    room -= (3 + idLen + offsetLen); //  1(type) + idLen + offsetLen + 2(len)
+  // 1(type) + idLen + offsetLen + 2(len) + 1(data)
+  if (room < (4 + idLen + offsetLen)) {
+    return false;
+  }
 
-    if (room < (*iter)->mLen) {
-      // we need to split this chunk. its too big
-      // todo iterate on them all instead of doing this n^2
-      // as there is a copy involved
-      std::unique_ptr<MozQuicStreamChunk>
-        tmp(new MozQuicStreamChunk((*iter)->mStreamID,
-                                   (*iter)->mOffset + room,
-                                   (*iter)->mData.get() + room,
-                                   (*iter)->mLen - room,
-                                   (*iter)->mFin));
-      (*iter)->mLen = room;
-      (*iter)->mFin = false;
-      auto iterReg = iter++;
-      mUnWrittenData.insert(iter, std::move(tmp));
-      iter = iterReg;
-    }
-    assert(room >= (*iter)->mLen);
-
-    // set the len and fin bits after any potential split
-    uint16_t tmp16 = (*iter)->mLen;
-    tmp16 = htons(tmp16);
-    memcpy(framePtr, &tmp16, 2);
-    framePtr += 2;
+  // adjust the frame type:
+  framePtr[0] |= (idLen - 1) << 3;
+  if (offsetLen == 2) {
+    framePtr[0] |= 0x02;
+  } else if (offsetLen == 4) {
+    framePtr[0] |= 0x04;
+  } else if (offsetLen == 8) {
+    framePtr[0] |= 0x06;
+  }
+  framePtr++;
 
-    if ((*iter)->mFin) {
-      *typeBytePtr = *typeBytePtr | FRAME_FIN_BIT;
-    }
+  // Set streamId
+  memcpy(framePtr, ((uint8_t*)(&tmp32)) + (4 - idLen), idLen);
+  framePtr += idLen;
 
-    memcpy(framePtr, (*iter)->mData.get(), (*iter)->mLen);
-    fprintf(stderr,"writing a stream %d frame %d @ offset %d [fin=%d] in packet %lX\n",
-            (*iter)->mStreamID, (*iter)->mLen, (*iter)->mOffset, (*iter)->mFin, mNextTransmitPacketNumber);
-    framePtr += (*iter)->mLen;
+  // Set offset
+  if (offsetLen) {
+    memcpy(framePtr, ((uint8_t*)(&offsetValue)) + (8 - offsetLen), offsetLen);
+    framePtr += offsetLen;
+  }
 
-    (*iter)->mPacketNumber = mNextTransmitPacketNumber;
-    (*iter)->mTransmitTime = Timestamp();
-    if ((mConnectionState == CLIENT_STATE_CONNECTED) ||
-        (mConnectionState == SERVER_STATE_CONNECTED) ||
-        (mConnectionState == CLIENT_STATE_0RTT)) {
-      (*iter)->mTransmitKeyPhase = keyPhase1Rtt;
-    } else {
-      (*iter)->mTransmitKeyPhase = keyPhaseUnprotected;
+  room -= (3 + idLen + offsetLen); //  1(type) + idLen + offsetLen + 2(len)
+  if (fcRoom < room) {
+    room = fcRoom;
+  }
+
+  if (room < (*iter)->mLen) {
+    // we need to split this chunk. its too big
+    // todo iterate on them all instead of doing this n^2
+    // as there is a copy involved
+    std::unique_ptr<MozQuicStreamChunk>
+      tmp(new MozQuicStreamChunk((*iter)->mStreamID,
+                                 (*iter)->mOffset + room,
+                                 (*iter)->mData.get() + room,
+                                 (*iter)->mLen - room,
+                                 (*iter)->mFin));
+    (*iter)->mLen = room;
+    (*iter)->mFin = false;
+    auto iterReg = iter++;
+    queue.insert(iter, std::move(tmp));
+    iter = iterReg;
+  }
+  assert(room >= (*iter)->mLen);
+
+  // set the len and fin bits after any potential split
+  uint16_t tmp16 = (*iter)->mLen;
+  tmp16 = htons(tmp16);
+  memcpy(framePtr, &tmp16, 2);
+  framePtr += 2;
+
+  if ((*iter)->mFin) {
+    *typeBytePtr = *typeBytePtr | FRAME_FIN_BIT;
+  }
+
+  memcpy(framePtr, (*iter)->mData.get(), (*iter)->mLen);
+  fprintf(stderr,"writing a stream %d frame %d @ offset %d [fin=%d] in packet %lX\n",
+          (*iter)->mStreamID, (*iter)->mLen, (*iter)->mOffset, (*iter)->mFin, mNextTransmitPacketNumber);
+  framePtr += (*iter)->mLen;
+
+  if (stream) {
+    if (stream->mOut.mIncremental) {
+      mVirtualClock[stream->mOut.mUrgency] = stream->mOut.mVirtualTime;
+      stream->mOut.mVirtualTime += (((*iter)->mLen + 1) * kMaxWeight) / stream->mOut.mWeight;
+    }
+    uint64_t endData = (*iter)->mOffset + (*iter)->mLen;
+    if (endData > stream->mOut.mOffsetSent) {
+      mDataSent += endData - stream->mOut.mOffsetSent;
+      stream->mOut.mOffsetSent = endData;
     }
-    (*iter)->mRetransmitted = false;
+    if ((*iter)->mFin) {
+      stream->mOut.mFinSent = true;
+    }
+  }
 
-    // move it to the unacked list
-    std::unique_ptr<MozQuicStreamChunk> x(std::move(*iter));
-    mUnAckedData.push_back(std::move(x));
-    iter = mUnWrittenData.erase(iter);
+  MoveToUnAcked(*iter, kp);
+  iter = queue.erase(iter);
+  return true;
+}
+
+void
+MozQuic::MoveToUnAcked(std::unique_ptr<MozQuicStreamChunk> &chunk, keyPhase kp)
+{
+  chunk->mPacketNumber = mNextTransmitPacketNumber;
+  chunk->mTransmitTime = Timestamp();
+  chunk->mTransmitKeyPhase = kp;
+  if ((kp == keyPhase0Rtt) && (chunk->mType == FRAME_TYPE_STREAM)) {
+    mEarlyDataSent += chunk->mLen;
   }
-  return MOZQUIC_OK;
+  chunk->mRetransmitted = false;
+  mBytesInFlight += chunk->mLen;
+
+  // the caller removes the now empty entry from the unwritten list
+  std::unique_ptr<MozQuicStreamChunk> x(std::move(chunk));
+  mUnAckedData.push_back(std::move(x));
 }
 
   
 
+// returns the number of bytes written, 0 if it does not fit, or 0xffffffff
+// if the frame is stale and can be dropped
 uint32_t
-MozQuic::FlushStream(bool forceAck)
+MozQuic::CreateControlFrame(MozQuicStreamChunk *chunk, unsigned char *framePtr,
+                            unsigned char *endpkt)
 {
-  if (!mDecodedOK) {
-    FlushStream0(forceAck);
+  uint32_t room = endpkt - framePtr;
+  uint32_t tmp32;
+  uint64_t tmp64;
+
+  switch (chunk->mType) {
+  case FRAME_TYPE_MAX_DATA:
+    if (room < FRAME_TYPE_MAX_DATA_LENGTH) {
+      return 0;
+    }
+    framePtr[0] = FRAME_TYPE_MAX_DATA;
+    tmp64 = PR_htonll(chunk->mOffset >> 10);
+    memcpy(framePtr + 1, &tmp64, 8);
+    fprintf(stderr,"writing MAX_DATA %ld in packet %lX\n",
+            chunk->mOffset, mNextTransmitPacketNumber);
+    return FRAME_TYPE_MAX_DATA_LENGTH;
+
+  case FRAME_TYPE_MAX_STREAM_DATA:
+    if (room < FRAME_TYPE_MAX_STREAM_DATA_LENGTH) {
+      return 0;
+    }
+    framePtr[0] = FRAME_TYPE_MAX_STREAM_DATA;
+    tmp32 = htonl(chunk->mStreamID);
+    memcpy(framePtr + 1, &tmp32, 4);
+    tmp64 = PR_htonll(chunk->mOffset);
+    memcpy(framePtr + 5, &tmp64, 8);
+    fprintf(stderr,"writing MAX_STREAM_DATA %d %ld in packet %lX\n",
+            chunk->mStreamID, chunk->mOffset, mNextTransmitPacketNumber);
+    return FRAME_TYPE_MAX_STREAM_DATA_LENGTH;
+
+  case FRAME_TYPE_BLOCKED:
+    // mOffset is the limit we were blocked at
+    if (mPeerMaxData > chunk->mOffset) {
+      return 0xffffffff;
+    }
+    if (room < FRAME_TYPE_BLOCKED_LENGTH) {
+      return 0;
+    }
+    framePtr[0] = FRAME_TYPE_BLOCKED;
+    fprintf(stderr,"writing BLOCKED in packet %lX\n", mNextTransmitPacketNumber);
+    return FRAME_TYPE_BLOCKED_LENGTH;
+
+  case FRAME_TYPE_STREAM_BLOCKED:
+    {
+      auto i = mStreams.find(chunk->mStreamID);
+      if ((i == mStreams.end()) ||
+          ((*i).second->mOut.mFlowControlLimit > chunk->mOffset)) {
+        return 0xffffffff;
+      }
+    }
+    if (room < FRAME_TYPE_STREAM_BLOCKED_LENGTH) {
+      return 0;
+    }
+    framePtr[0] = FRAME_TYPE_STREAM_BLOCKED;
+    tmp32 = htonl(chunk->mStreamID);
+    memcpy(framePtr + 1, &tmp32, 4);
+    fprintf(stderr,"writing STREAM_BLOCKED %d in packet %lX\n",
+            chunk->mStreamID, mNextTransmitPacketNumber);
+    return FRAME_TYPE_STREAM_BLOCKED_LENGTH;
   }
-      
-  if (mUnWrittenData.empty() && !forceAck) {
-    return MOZQUIC_OK;
+
+  assert(false);
+  return 0xffffffff;
+}
+
+// returns false if the chunk cannot be sent at all right now. Otherwise
+// room is set to the number of bytes that may be framed. Only data beyond
+// what has already been framed on the stream consumes credit, so
+// retransmissions are never blocked.
+bool
+MozQuic::FlowControlRoom(MozQuicStreamChunk *chunk, MozQuicStreamPair *&stream,
+                         uint32_t &room)
+{
+  auto i = mStreams.find(chunk->mStreamID);
+  if (i == mStreams.end()) {
+    // a retransmission of a stream that has been fully framed and deleted
+    stream = nullptr;
+    room = 0xffffffff;
+    return true;
   }
+  stream = (*i).second;
 
-  unsigned char plainPkt[kMozQuicMTU];
-  unsigned char cipherPkt[kMozQuicMTU];
-  unsigned char *endpkt = plainPkt + kMozQuicMTU - 16; // reserve 16 for aead tag
-  uint32_t pktHeaderLen;
+  bool connBlocked;
+  uint64_t limit = SendLimit(stream, connBlocked);
+  uint64_t endData = chunk->mOffset + chunk->mLen;
+  if (endData <= limit) {
+    room = 0xffffffff;
+    return true;
+  }
+  if (chunk->mOffset < limit) {
+    room = limit - chunk->mOffset;
+    return true;
+  }
 
-  CreateShortPacketHeader(plainPkt, kMozQuicMTU - 16, pktHeaderLen);
+  // blocked. tell the peer once per limit
+  if (connBlocked) {
+    if (mBlockedAt != mPeerMaxData) {
+      mBlockedAt = mPeerMaxData;
+      mBlockedFramesSent++;
+      QueueControlFrame(FRAME_TYPE_BLOCKED, 0, mPeerMaxData);
+    }
+  } else if (stream->mOut.mBlockedAt != stream->mOut.mFlowControlLimit) {
+    stream->mOut.mBlockedAt = stream->mOut.mFlowControlLimit;
+    mBlockedFramesSent++;
+    QueueControlFrame(FRAME_TYPE_STREAM_BLOCKED, stream->mStreamID,
+                      stream->mOut.mFlowControlLimit);
+  }
+  return false;
+}
 
-  unsigned char *framePtr = plainPkt + pktHeaderLen;
-  CreateStreamAndAckFrames(framePtr, endpkt, false);
+// the offset a stream may send up to, whichever of its own and the
+// connection's credit runs out first
+uint64_t
+MozQuic::SendLimit(MozQuicStreamPair *stream, bool &connBlocked)
+{
+  uint64_t limit = stream->mOut.mFlowControlLimit;
+  uint64_t connLimit = stream->mOut.mOffsetSent + (mPeerMaxData - mDataSent);
+  connBlocked = connLimit < limit;
+  return connBlocked ? connLimit : limit;
+}
 
-  uint32_t room = endpkt - framePtr;
-  uint32_t used;
-  if (AckPiggyBack(framePtr, mNextTransmitPacketNumber, room, keyPhase1Rtt, used) == MOZQUIC_OK) {
-    if (used) {
-      fprintf(stderr,"Handy-Ack Flush protected stream packet %lX frame-len=%d\n", mNextTransmitPacketNumber, used);
+// whether a flush now would frame anything. Data held back by the
+// congestion window or flow control is not, it waits for the ack or
+// MAX_DATA that opens them up and Intake makes the connection ready then
+bool
+MozQuic::Frameable()
+{
+  bool keys = ProtectedSendPhase() != keyPhaseUnknown;
+  bool cwndOpen = keys && (mBytesInFlight < mCongestionWindow);
+  for (auto i = mUnWrittenData.begin(); i != mUnWrittenData.end(); ++i) {
+    if ((*i)->mType != FRAME_TYPE_STREAM) {
+      if (keys) {
+        return true;
+      }
+    } else if (!(*i)->mStreamID || cwndOpen) {
+      // stream 0 is exempt from the congestion window
+      return true;
+    }
+  }
+  if (!cwndOpen) {
+    return false;
+  }
+  // a stream's queue is in offset order, so its first chunk decides
+  for (auto s = mSchedule.begin(); s != mSchedule.end(); ++s) {
+    auto i = mStreams.find(s->second);
+    MozQuicStreamChunk *chunk = (*i).second->mOut.mUnWritten.front().get();
+    bool connBlocked;
+    uint64_t limit = SendLimit((*i).second, connBlocked);
+    if ((chunk->mOffset < limit) || (chunk->mOffset + chunk->mLen <= limit)) {
+      return true;
     }
-    framePtr += used;
   }
-  uint32_t finalLen = framePtr - plainPkt;
+  return false;
+}
 
-  if (framePtr == (plainPkt + pktHeaderLen)) {
-    fprintf(stderr,"nothing to write\n");
+uint32_t
+MozQuic::FlushStream(bool forceAck)
+{
+  if (!mDecodedOK) {
+    FlushStream0(forceAck);
+  }
+      
+  if (UnWrittenEmpty() && !forceAck) {
     return MOZQUIC_OK;
   }
-  
-  uint32_t written = 0;
-  memcpy(cipherPkt, plainPkt, pktHeaderLen);
-  uint32_t rv = mNSSHelper->EncryptBlock(plainPkt, pktHeaderLen, plainPkt + pktHeaderLen,
-                                         finalLen - pktHeaderLen, mNextTransmitPacketNumber,
-                                         cipherPkt + pktHeaderLen, kMozQuicMTU - pktHeaderLen, written);
-  fprintf(stderr,"encrypt[%lX] rv=%d inputlen=%d (+%d of aead) outputlen=%d pktheaderLen =%d\n",
-          mNextTransmitPacketNumber, rv, finalLen - pktHeaderLen, pktHeaderLen, written, pktHeaderLen);
-
-  uint32_t code = Transmit(cipherPkt, written + pktHeaderLen, nullptr);
-  if (code != MOZQUIC_OK) {
-    return code;
+
+  // without keys the data waits in munwrittendata
+  keyPhase kp = ProtectedSendPhase();
+  if (kp == keyPhaseUnknown) {
+    return MOZQUIC_OK;
   }
 
-  fprintf(stderr,"TRANSMIT[%lX] len=%d\n", mNextTransmitPacketNumber, written + pktHeaderLen);
-  mNextTransmitPacketNumber++;
+  // packets are framed into a burst and then encrypted in place and sent
+  // together. each packet stays in one buffer from framing to the wire
+  if (!mFlushBuffer) {
+    mFlushBuffer.reset(new unsigned char[kFlushBufferSize]);
+  }
+  unsigned char *pkts = mFlushBuffer.get();
+  AEADBlock blocks[kFlushBatch];
+  bool more = true;
+
+  while (more) {
+    uint32_t count = 0;
+    uint32_t offset = 0;
+    while (more && (count < kFlushBatch) && ((offset + mMTU) <= kFlushBufferSize)) {
+      unsigned char *plainPkt = pkts + offset;
+      unsigned char *endpkt = plainPkt + mMTU - 16; // reserve 16 for aead tag
+      uint32_t pktHeaderLen;
+
+      if (kp == keyPhase0Rtt) {
+        CreateLongPacketHeader(plainPkt, PACKET_TYPE_0RTT_PROTECTED);
+        pktHeaderLen = 17;
+      } else {
+        CreateShortPacketHeader(plainPkt, mMTU - 16, pktHeaderLen);
+      }
+
+      unsigned char *framePtr = plainPkt + pktHeaderLen;
+      CreateStreamAndAckFrames(framePtr, endpkt, false, kp);
+      bool sentStream = (framePtr != (plainPkt + pktHeaderLen));
+
+      uint32_t room = endpkt - framePtr;
+      uint32_t used;
+      // acks of the server's cleartext go in cleartext, not in 0-rtt
+      if ((kp == keyPhase1Rtt) &&
+          (AckPiggyBack(framePtr, mNextTransmitPacketNumber, room, keyPhase1Rtt, used) == MOZQUIC_OK)) {
+        if (used) {
+          fprintf(stderr,"Handy-Ack Flush protected stream packet %lX frame-len=%d\n", mNextTransmitPacketNumber, used);
+        }
+        framePtr += used;
+      }
+      uint32_t finalLen = framePtr - plainPkt;
+
+      if (framePtr == (plainPkt + pktHeaderLen)) {
+        if (!count) {
+          fprintf(stderr,"nothing to write\n");
+        }
+        more = false;
+        break;
+      }
+
+      blocks[count].aeadData = plainPkt;
+      blocks[count].aeadLen = pktHeaderLen;
+      blocks[count].in = plainPkt + pktHeaderLen;
+      blocks[count].inLen = finalLen - pktHeaderLen;
+      blocks[count].packetNumber = mNextTransmitPacketNumber;
+      blocks[count].out = plainPkt + pktHeaderLen;
+      blocks[count].outAvail = mMTU - pktHeaderLen;
+      mNextTransmitPacketNumber++;
+      count++;
+      offset += mMTU;
+
+      // stop once nothing more fits in the congestion window or the
+      // turn's budget is spent. The rest waits for the next IO()
+      mFlushPackets++;
+      more = sentStream && !UnWrittenEmpty();
+      if (more && mFlushBudget && (mFlushPackets >= mFlushBudget)) {
+        // a server child is back on the ready list for the next tick
+        more = false;
+        MakeReady();
+        mFlushBudgetExhausted++;
+        if (mParent) {
+          mParent->mFlushBudgetExhausted++;
+        }
+      }
+    }
+    if (!count) {
+      break;
+    }
 
-  if (!mUnWrittenData.empty()) {
-    return FlushStream(false);
+    if (kp == keyPhase0Rtt) {
+      mNSSHelper->EarlyEncryptBatch(blocks, count);
+    } else {
+      mNSSHelper->EncryptBatch(blocks, count);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      fprintf(stderr,"encrypt[%lX] rv=%d inputlen=%d (+%d of aead) outputlen=%d pktheaderLen =%d\n",
+              blocks[i].packetNumber, blocks[i].rv, blocks[i].inLen, blocks[i].aeadLen,
+              blocks[i].written, blocks[i].aeadLen);
+      if (blocks[i].rv != MOZQUIC_OK) {
+        continue;
+      }
+      uint32_t code = Transmit(blocks[i].aeadData,
+                               blocks[i].written + blocks[i].aeadLen, nullptr);
+      if (code != MOZQUIC_OK) {
+        return code;
+      }
+      fprintf(stderr,"TRANSMIT[%lX] len=%d\n", blocks[i].packetNumber,
+              blocks[i].written + blocks[i].aeadLen);
+    }
   }
   return MOZQUIC_OK;
 }
@@ -1880,6 +3489,30 @@ MozQuic::Timestamp()
   return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
+uint64_t
+MozQuic::TimestampUs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+// counted once per IO() call
+bool
+MozQuic::IOTimeBudgetSpent()
+{
+  if (mIOTimeBudgetHit) {
+    return true;
+  }
+  if (!mIODeadline || (TimestampUs() < mIODeadline)) {
+    return false;
+  }
+  fprintf(stderr,"io time budget of %dus spent\n", mIOTimeBudget);
+  mIOTimeBudgetExhausted++;
+  mIOTimeBudgetHit = true;
+  return true;
+}
+
 uint32_t
 MozQuic::Flush()
 {
@@ -1894,7 +3527,29 @@ MozQuic::DoWriter(std::unique_ptr<MozQuicStreamChunk> &p)
   // transmitted after prioritization by flush()
   assert (mConnectionState != STATE_UNINITIALIZED);
 
-  mUnWrittenData.push_back(std::move(p));
+  p->Charge(&mMemory);
+  MozQuicStreamPair *stream = nullptr;
+  if ((p->mType == FRAME_TYPE_STREAM) && p->mStreamID) {
+    auto i = mStreams.find(p->mStreamID);
+    if (i != mStreams.end()) {
+      stream = (*i).second;
+    }
+  }
+  if (!stream) {
+    mUnWrittenData.push_back(std::move(p));
+  } else if (stream->mOut.mUnWritten.empty()) {
+    stream->mOut.mUnWritten.push_back(std::move(p));
+    Schedule(stream);
+  } else {
+    // new data goes at the back, a retransmission by its offset
+    auto &queue = stream->mOut.mUnWritten;
+    auto iter = queue.end();
+    while ((iter != queue.begin()) && ((*std::prev(iter))->mOffset > p->mOffset)) {
+      iter--;
+    }
+    queue.insert(iter, std::move(p));
+  }
+  MakeReady();
 
   return MOZQUIC_OK;
 }
@@ -1948,6 +3603,7 @@ MozQuic::RetransmitTimer()
   // recovery system built
   uint64_t now = Timestamp();
   uint64_t discardEpoch = now - kForgetUnAckedThresh;
+  bool timedOut = false;
 
   for (auto i = mUnAckedData.begin(); i != mUnAckedData.end(); ) {
     // just a linear backoff for now
@@ -1962,24 +3618,352 @@ MozQuic::RetransmitTimer()
       assert(!(*i)->mData);
       i = mUnAckedData.erase(i);
     } else if (!(*i)->mRetransmitted) {
-      assert((*i)->mData);
       fprintf(stderr,"data associated with packet %lX retransmitted\n",
               (*i)->mPacketNumber);
-      (*i)->mRetransmitted = true;
-
-      // the ctor steals the data pointer
-      std::unique_ptr<MozQuicStreamChunk> tmp(new MozQuicStreamChunk(*(*i)));
-      assert(!(*i)->mData);
-      DoWriter(tmp);
+      mPacketsLost++;
+      OnPacketsLost((*i)->mPacketNumber);
+      RetransmitChunk(*i);
+      timedOut = true;
       i++;
     } else {
       i++;
     }
   }
 
+  if (timedOut) {
+    MTUTimeout(now);
+  }
+  return MOZQUIC_OK;
+}
+
+// only protected packets are probed, the handshake uses the base mtu
+uint32_t
+MozQuic::MTUProbeTimer()
+{
+  if ((mConnectionState != CLIENT_STATE_CONNECTED) &&
+      (mConnectionState != SERVER_STATE_CONNECTED)) {
+    return MOZQUIC_OK;
+  }
+  if (!mIsClient && !mIsChild) {
+    // the listener does not send packets
+    return MOZQUIC_OK;
+  }
+
+  uint64_t now = Timestamp();
+  if (mMTUProbeSize) {
+    if ((now - mMTUProbeTime) < MTUProbeTimeout()) {
+      return MOZQUIC_OK;
+    }
+    if (++mMTUProbeCount < kMTUMaxProbes) {
+      SendMTUProbe(mMTUProbeSize);
+      return MOZQUIC_OK;
+    }
+    fprintf(stderr,"mtu probe of %d failed\n", mMTUProbeSize);
+    mMTUProbeHigh = mMTUProbeSize - 1;
+    mMTUProbeSize = 0;
+  }
+
+  if (now < mMTUNextSearch) {
+    return MOZQUIC_OK;
+  }
+  if ((mMTUProbeHigh < mMTU) || ((mMTUProbeHigh - mMTU) < kMTUSearchGranularity)) {
+    // search is done. look for a bigger mtu again later
+    fprintf(stderr,"mtu search complete at %d\n", mMTU);
+    mMTUNextSearch = now + kMTURaiseInterval;
+    mMTUProbeHigh = kMaxMTU;
+    return MOZQUIC_OK;
+  }
+
+  // jumbo frames are the common case, so try the top of the range first
+  uint32_t size = mMTUProbeHigh;
+  if (mMTUProbeHigh != kMaxMTU) {
+    size = mMTU + (mMTUProbeHigh - mMTU + 1) / 2;
+  }
+  mMTUProbeCount = 0;
+  SendMTUProbe(size);
   return MOZQUIC_OK;
 }
 
+void
+MozQuic::SendMTUProbe(uint32_t size)
+{
+  assert(size <= kMaxMTU);
+  unsigned char pkt[kMaxMTU];
+  uint32_t headerLen = 0;
+
+  // ping so the peer acks it, padding to fill it out. no data rides in
+  // a probe so losing it costs nothing but the probe
+  CreateShortPacketHeader(pkt, size - 16, headerLen);
+  pkt[headerLen] = FRAME_TYPE_PING;
+  memset(pkt + headerLen + 1, FRAME_TYPE_PADDING, size - 16 - headerLen - 1);
+
+  uint32_t written = 0;
+  uint32_t rv = mNSSHelper->EncryptBlock(pkt, headerLen, pkt + headerLen,
+                                         size - 16 - headerLen, mNextTransmitPacketNumber,
+                                         pkt + headerLen, size - headerLen, written);
+  if (rv != MOZQUIC_OK) {
+    // nothing went out, so nothing in this slot can be acked
+    mMTUProbePackets[mMTUProbeCount] = 0;
+    return;
+  }
+  fprintf(stderr,"mtu probe of %d in packet %lX\n", written + headerLen,
+          mNextTransmitPacketNumber);
+  mMTUProbeSize = size;
+  mMTUProbePackets[mMTUProbeCount] = mNextTransmitPacketNumber;
+  mMTUProbeTime = Timestamp();
+  mNextTransmitPacketNumber++;
+  Transmit(pkt, written + headerLen, nullptr);
+}
+
+// an unacked probe is lost after a few round trips, never sooner than
+// the floor
+uint64_t
+MozQuic::MTUProbeTimeout()
+{
+  uint64_t rtt = mSmoothedRTT ? mSmoothedRTT : kDefaultRTT;
+  return std::max((uint64_t) kMTUProbeMinTimeout, 3 * rtt);
+}
+
+void
+MozQuic::MTUProbeAcked()
+{
+  fprintf(stderr,"mtu probe of %d acked\n", mMTUProbeSize);
+  mMTU = mMTUProbeSize;
+  mMTUProbeSize = 0;
+  mMTUNextSearch = 0;
+}
+
+// a run of retransmit timeouts with nothing newly acked after the mtu has
+// been raised looks like a black hole for the bigger packets. Drop back to
+// the base mtu and search again.
+void
+MozQuic::MTUTimeout(uint64_t now)
+{
+  if ((now - mMTULastTimeout) < kRetransmitThresh) {
+    // same episode
+    return;
+  }
+  mMTULastTimeout = now;
+  if ((++mMTUTimeouts < kMTUBlackHoleTimeouts) || (mMTU == kMozQuicMTU)) {
+    return;
+  }
+  fprintf(stderr,"mtu black hole suspected at %d\n", mMTU);
+  mMTUProbeHigh = mMTU - 1;
+  mMTU = kMozQuicMTU;
+  mMTUProbeSize = 0;
+  mMTUTimeouts = 0;
+  mMTUNextSearch = now + MTUProbeTimeout();
+}
+
+void
+MozQuic::UpdateRTT(uint64_t sample, uint64_t ackDelay)
+{
+  // rfc 6298 style smoothing, with the peer's reported ack delay removed
+  // when that doesn't make the sample nonsensical
+  if (sample > ackDelay) {
+    sample -= ackDelay;
+  }
+  mLatestRTT = sample;
+  if (!mSmoothedRTT) {
+    mSmoothedRTT = sample;
+    mRTTVar = sample / 2;
+  } else {
+    uint64_t delta = (mSmoothedRTT > sample) ? (mSmoothedRTT - sample) : (sample - mSmoothedRTT);
+    mRTTVar = (3 * mRTTVar + delta) / 4;
+    mSmoothedRTT = (7 * mSmoothedRTT + sample) / 8;
+  }
+  fprintf(stderr,"rtt sample %lu srtt %lu rttvar %lu\n", sample, mSmoothedRTT, mRTTVar);
+}
+
+void
+MozQuic::RetransmitChunk(std::unique_ptr<MozQuicStreamChunk> &chunk)
+{
+  assert(chunk->mData);
+  assert(!chunk->mRetransmitted);
+  chunk->mRetransmitted = true;
+  assert(mBytesInFlight >= chunk->mLen);
+  mBytesInFlight -= chunk->mLen;
+
+  // the ctor steals the data pointer
+  std::unique_ptr<MozQuicStreamChunk> tmp(new MozQuicStreamChunk(*chunk));
+  assert(!chunk->mData);
+  DoWriter(tmp);
+}
+
+void
+MozQuic::OnChunkAcked(MozQuicStreamChunk *chunk)
+{
+  // the peer could only ack this if it got it, so its address is good
+  mAddressValidated = true;
+
+  if (chunk->mRetransmitted) {
+    // already taken out of flight when it was retransmitted
+    return;
+  }
+  assert(mBytesInFlight >= chunk->mLen);
+  mBytesInFlight -= chunk->mLen;
+
+  if (chunk->mPacketNumber < mRecoveryEndPacket) {
+    // don't grow the window for data sent before the last loss
+    return;
+  }
+  if (mCongestionWindow < mSlowStartThreshold) {
+    mCongestionWindow += chunk->mLen;
+  } else {
+    mCongestionWindow += (mMTU * chunk->mLen) / mCongestionWindow;
+  }
+}
+
+void
+MozQuic::OnPacketsLost(uint64_t largestLost)
+{
+  if (largestLost < mRecoveryEndPacket) {
+    // one reduction per window of data
+    return;
+  }
+  mRecoveryEndPacket = mNextTransmitPacketNumber;
+  mCongestionWindow /= 2;
+  if (mCongestionWindow < kMinimumCongestionWindow) {
+    mCongestionWindow = kMinimumCongestionWindow;
+  }
+  mSlowStartThreshold = mCongestionWindow;
+  fprintf(stderr,"congestion event at %lX cwnd now %lu\n", largestLost, mCongestionWindow);
+}
+
+void
+MozQuic::DetectLosses(uint64_t now)
+{
+  uint64_t rtt = (mLatestRTT > mSmoothedRTT) ? mLatestRTT : mSmoothedRTT;
+  if (!rtt) {
+    rtt = kDefaultRTT;
+  }
+  uint64_t delayThresh = (rtt * 9) / 8;
+  uint64_t largestLost = 0;
+  uint64_t lastLostPacket = 0;
+
+  // mUnAckedData is ordered by packet number, so only the front of
+  // the list can be below the largest ack
+  for (auto i = mUnAckedData.begin();
+       (i != mUnAckedData.end()) && ((*i)->mPacketNumber < mLargestAcked); i++) {
+    if ((*i)->mRetransmitted) {
+      continue;
+    }
+    if (((mLargestAcked - (*i)->mPacketNumber) < kReorderingThreshold) &&
+        (((*i)->mTransmitTime + delayThresh) > now)) {
+      continue;
+    }
+    fprintf(stderr,"data associated with packet %lX lost (largest acked %lX)\n",
+            (*i)->mPacketNumber, mLargestAcked);
+    if ((*i)->mPacketNumber != lastLostPacket) {
+      lastLostPacket = (*i)->mPacketNumber;
+      mPacketsLost++;
+    }
+    largestLost = (*i)->mPacketNumber;
+    RetransmitChunk(*i);
+  }
+
+  if (largestLost) {
+    OnPacketsLost(largestLost);
+  }
+}
+
+// 0-rtt data the server will never process (it rejected early data, or
+// answered the client initial with version negotiation or a retry) is
+// sent again. Once the handshake is done that is under 1-rtt.
+void
+MozQuic::RetransmitEarlyData()
+{
+  for (auto i = mUnAckedData.begin(); i != mUnAckedData.end(); i++) {
+    if (((*i)->mTransmitKeyPhase == keyPhase0Rtt) && !(*i)->mRetransmitted) {
+      if ((*i)->mType == FRAME_TYPE_STREAM) {
+        mEarlyDataRejected += (*i)->mLen;
+      }
+      RetransmitChunk(*i);
+    }
+  }
+}
+
+// the keys protected packets go out under right now
+keyPhase
+MozQuic::ProtectedSendPhase()
+{
+  if (mConnectionState == CLIENT_STATE_0RTT) {
+    return keyPhase0Rtt;
+  }
+  // a server has its keys as soon as its handshake flight is written and
+  // can send (0.5-rtt) before the handshake completes
+  if (mNSSHelper && mNSSHelper->SendKeysReady()) {
+    return keyPhase1Rtt;
+  }
+  return keyPhaseUnknown;
+}
+
+uint32_t
+MozQuic::ProcessEarlyData(unsigned char *pkt, uint32_t pktSize, LongHeaderData &header,
+                          bool &sendAck)
+{
+  assert(pkt[0] & 0x80);
+  assert((pkt[0] & 0x7f) == PACKET_TYPE_0RTT_PROTECTED);
+  assert(!mIsClient);
+
+  if ((mConnectionState != SERVER_STATE_1RTT) &&
+      (mConnectionState != SERVER_STATE_CONNECTED)) {
+    return MOZQUIC_ERR_GENERAL;
+  }
+  if (mNSSHelper->HandshakePending()) {
+    // the turn on the worker may be the one that accepts early data
+    if (mEarlyPending.size() < kMaxEarlyPending) {
+      fprintf(stderr,"0-rtt packet %lX held for the handshake\n", header.mPacketNumber);
+      mEarlyPending.emplace_back(pkt, pkt + pktSize);
+    } else {
+      fprintf(stderr,"0-rtt packet %lX discarded\n", header.mPacketNumber);
+    }
+    return MOZQUIC_ERR_GENERAL;
+  }
+  if (!mNSSHelper->EarlyDataReady()) {
+    // not accepted (or a replay). the client sends it again under 1-rtt
+    fprintf(stderr,"0-rtt packet %lX discarded\n", header.mPacketNumber);
+    return MOZQUIC_ERR_GENERAL;
+  }
+
+  uint32_t written;
+  uint32_t rv = mNSSHelper->EarlyDecryptBlock(pkt, 17, pkt + 17, pktSize - 17,
+                                              header.mPacketNumber, pkt + 17,
+                                              pktSize - 17, written);
+  fprintf(stderr,"decrypt 0-rtt (pktnum=%lX) rv=%d sz=%d\n", header.mPacketNumber, rv, written);
+  if (rv != MOZQUIC_OK) {
+    return rv;
+  }
+  // unlike 1-rtt this does not validate the client address, early data
+  // can be replayed from anywhere
+  mEarlyPacketsReceived++;
+  if (mParent) {
+    mParent->mEarlyPacketsReceived++;
+  }
+  return ProcessGeneralDecoded(pkt + 17, written, sendAck, false);
+}
+
+// the 0-rtt packets held while a handshake turn was on a worker
+void
+MozQuic::ProcessEarlyPending()
+{
+  if (mEarlyPending.empty() || mNSSHelper->HandshakePending()) {
+    return;
+  }
+  std::vector<std::vector<unsigned char>> pending;
+  pending.swap(mEarlyPending);
+  bool sendAck = false;
+  for (auto i = pending.begin(); i != pending.end(); ++i) {
+    LongHeaderData header(i->data(), i->size());
+    if (ProcessEarlyData(i->data(), i->size(), header, sendAck) == MOZQUIC_OK) {
+      Acknowledge(header.mPacketNumber, keyPhase0Rtt);
+    }
+  }
+  if (sendAck) {
+    MaybeSendAck();
+  }
+}
+
 uint32_t
 MozQuic::ClearOldInitialConnectIdsTimer()
 {
@@ -1988,18 +3972,57 @@ MozQuic::ClearOldInitialConnectIdsTimer()
   uint64_t now = Timestamp();
   uint64_t discardEpoch = now - kForgetInitialConnectionIDsThresh;
 
-  for (auto i = mConnectionHashOriginalNew.begin(); i != mConnectionHashOriginalNew.end(); ) {
-    if ((*i).second.mTimestamp < discardEpoch) {
-      fprintf(stderr,"Forget an old client initial connectionID: %lX\n",
-                    (*i).first);
-      i = mConnectionHashOriginalNew.erase(i);
-    } else {
-      i++;
-    }
+  mConnectionHashOriginalNew.EraseIf(
+    [discardEpoch](uint64_t cid, const InitialClientPacketInfo &info) {
+      if (info.mTimestamp < discardEpoch) {
+        fprintf(stderr,"Forget an old client initial connectionID: %lX\n", cid);
+        return true;
+      }
+      return false;
+    });
+  return MOZQUIC_OK;
+}
+
+uint32_t
+MozQuic::IdleTimer()
+{
+  // the server parent has no peer, its children time out on their own
+  if ((!mIsClient && !mIsChild) || mClosingDeadline ||
+      !mIdleTimeout || !mLastActivity) {
+    return MOZQUIC_OK;
+  }
+  uint64_t now = Timestamp();
+  if (now - mLastActivity < mIdleTimeout) {
+    return MOZQUIC_OK;
+  }
+
+  fprintf(stderr,"connection %lx idle for %ldms, closing\n",
+          mConnectionID, now - mLastActivity);
+  EnterClosed();
+  mIdleTimeouts++;
+  if (mParent) {
+    mParent->mIdleTimeouts++;
+  }
+  if (mConnEventCB) {
+    mConnEventCB(mClosure, MOZQUIC_EVENT_CLOSE_CONNECTION, this);
   }
   return MOZQUIC_OK;
 }
 
+// 17 bytes, section 5.4.1 of transport
+void
+MozQuic::CreateLongPacketHeader(unsigned char *pkt, uint8_t type)
+{
+  uint32_t tmp32;
+  pkt[0] = 0x80 | type;
+  uint64_t connID = PR_htonll(mConnectionID);
+  memcpy(pkt + 1, &connID, 8);
+  tmp32 = htonl(mNextTransmitPacketNumber);
+  memcpy(pkt + 9, &tmp32, 4);
+  tmp32 = htonl(mVersion);
+  memcpy(pkt + 13, &tmp32, 4);
+}
+
 int
 MozQuic::CreateShortPacketHeader(unsigned char *pkt, uint32_t pktSize,
                                  uint32_t &used)
@@ -2036,85 +4059,199 @@ MozQuic::CreateShortPacketHeader(unsigned char *pkt, uint32_t pktSize,
   return MOZQUIC_OK;
 }
 
+// The type byte alone decides how a frame is parsed and how long its header
+// is. Even stream and ack headers are sized by the type bits, only their
+// payloads (and close's reason) are variable. kFrameParseTable is generated
+// at compile time from these rules so each frame costs one lookup and one
+// length check.
+enum FrameParseClass {
+  FRAME_PARSE_INVALID,
+  FRAME_PARSE_PADDING,
+  FRAME_PARSE_FIXED,
+  FRAME_PARSE_ACK,
+  FRAME_PARSE_STREAM
+};
+
+struct FrameParseEntry
+{
+  uint8_t     mClass;
+  uint8_t     mLength; // header bytes, including the type
+  const char *mShortError;
+};
+
+static constexpr uint8_t
+StreamHeaderLength(unsigned type)
+{
+  // type, 1-4 byte id, 0/2/4/8 byte offset, optional 2 byte data length
+  return 1 + (((type & 0x18) >> 3) + 1) +
+    (((type & 0x06) >> 1) ? (1 << ((type & 0x06) >> 1)) : 0) +
+    ((type & 0x01) ? 2 : 0);
+}
+
+static constexpr uint8_t
+AckHeaderLength(unsigned type)
+{
+  // type, optional num blocks, num ts, 1-8 byte largest acked, ack delay
+  return 1 + ((type & 0x10) ? 1 : 0) + 1 + (1 << ((type & 0x0c) >> 2)) + 2;
+}
+
+static constexpr FrameParseEntry
+FixedFrameEntry(uint8_t length, const char *shortError)
+{
+  return FrameParseEntry{ FRAME_PARSE_FIXED, length, shortError };
+}
+
+static constexpr FrameParseEntry
+MakeFrameParseEntry(unsigned type)
+{
+  return
+    ((type & MozQuic::FRAME_MASK_STREAM) == MozQuic::FRAME_TYPE_STREAM) ?
+      FrameParseEntry{ FRAME_PARSE_STREAM, StreamHeaderLength(type), "stream frame header short" } :
+    ((type & MozQuic::FRAME_MASK_ACK) == MozQuic::FRAME_TYPE_ACK) ?
+      FrameParseEntry{ FRAME_PARSE_ACK, AckHeaderLength(type), "ack frame header short" } :
+    (type == MozQuic::FRAME_TYPE_PADDING) ?
+      FrameParseEntry{ FRAME_PARSE_PADDING, MozQuic::FRAME_TYPE_PADDING_LENGTH, nullptr } :
+    (type == MozQuic::FRAME_TYPE_RST_STREAM) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_RST_STREAM_LENGTH, "RST_STREAM frame length expected") :
+    (type == MozQuic::FRAME_TYPE_CLOSE) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_CLOSE_LENGTH, "CONNECTION_CLOSE frame length expected") :
+    (type == MozQuic::FRAME_TYPE_GOAWAY) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_GOAWAY_LENGTH, "GOAWAY frame length expected") :
+    (type == MozQuic::FRAME_TYPE_MAX_DATA) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_MAX_DATA_LENGTH, "MAX_DATA frame length expected") :
+    (type == MozQuic::FRAME_TYPE_MAX_STREAM_DATA) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_MAX_STREAM_DATA_LENGTH, "MAX_STREAM_DATA frame length expected") :
+    (type == MozQuic::FRAME_TYPE_MAX_STREAM_ID) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_MAX_STREAM_ID_LENGTH, "MAX_STREAM_ID frame length expected") :
+    (type == MozQuic::FRAME_TYPE_PING) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_PING_LENGTH, "PING frame length expected") :
+    (type == MozQuic::FRAME_TYPE_BLOCKED) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_BLOCKED_LENGTH, "BLOCKED frame length expected") :
+    (type == MozQuic::FRAME_TYPE_STREAM_BLOCKED) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_STREAM_BLOCKED_LENGTH, "STREAM_BLOCKED frame length expected") :
+    (type == MozQuic::FRAME_TYPE_STREAM_ID_NEEDED) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_STREAM_ID_NEEDED_LENGTH, "STREAM_ID_NEEDED frame length expected") :
+    (type == MozQuic::FRAME_TYPE_NEW_CONNECTION_ID) ?
+      FixedFrameEntry(MozQuic::FRAME_TYPE_NEW_CONNECTION_ID_LENGTH, "NEW_CONNECTION_ID frame length expected") :
+    FrameParseEntry{ FRAME_PARSE_INVALID, 1, "unknown frame type" };
+}
+
+#define MOZQUIC_FRAME_ENTRY_4(t) \
+  MakeFrameParseEntry(t), MakeFrameParseEntry(t + 1), MakeFrameParseEntry(t + 2), MakeFrameParseEntry(t + 3)
+#define MOZQUIC_FRAME_ENTRY_16(t) \
+  MOZQUIC_FRAME_ENTRY_4(t), MOZQUIC_FRAME_ENTRY_4(t + 4), MOZQUIC_FRAME_ENTRY_4(t + 8), MOZQUIC_FRAME_ENTRY_4(t + 12)
+#define MOZQUIC_FRAME_ENTRY_64(t) \
+  MOZQUIC_FRAME_ENTRY_16(t), MOZQUIC_FRAME_ENTRY_16(t + 16), MOZQUIC_FRAME_ENTRY_16(t + 32), MOZQUIC_FRAME_ENTRY_16(t + 48)
+
+static constexpr FrameParseEntry kFrameParseTable[256] = {
+  MOZQUIC_FRAME_ENTRY_64(0), MOZQUIC_FRAME_ENTRY_64(64),
+  MOZQUIC_FRAME_ENTRY_64(128), MOZQUIC_FRAME_ENTRY_64(192)
+};
+
+#undef MOZQUIC_FRAME_ENTRY_64
+#undef MOZQUIC_FRAME_ENTRY_16
+#undef MOZQUIC_FRAME_ENTRY_4
+
+static_assert(kFrameParseTable[MozQuic::FRAME_TYPE_MAX_STREAM_DATA].mLength ==
+              MozQuic::FRAME_TYPE_MAX_STREAM_DATA_LENGTH, "frame parse table");
+static_assert(kFrameParseTable[0xff].mLength == 1 + 4 + 8 + 2, "frame parse table");
+static_assert(kFrameParseTable[0xbf].mLength == 1 + 1 + 1 + 8 + 2, "frame parse table");
+
+// runs of padding (a padded client initial is mostly zeros) are skipped as
+// one frame, 16 bytes per compare
+static uint32_t
+PaddingRunLength(const unsigned char *pkt, uint32_t len)
+{
+  uint32_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 16 <= len) {
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pkt + i)), zero));
+    if (mask != 0xffff) {
+      return i + __builtin_ctz(~mask);
+    }
+    i += 16;
+  }
+#endif
+  while ((i < len) && !pkt[i]) {
+    i++;
+  }
+  return i;
+}
+
 MozQuic::FrameHeaderData::FrameHeaderData(unsigned char *pkt, uint32_t pktSize, MozQuic *session)
 {
-  memset(&u, 0, sizeof (u));
+  // only the union member for mType is filled in
   mValid = MOZQUIC_ERR_GENERAL;
 
   unsigned char type = pkt[0];
   unsigned char *framePtr = pkt + 1;
+  const FrameParseEntry &entry = kFrameParseTable[type];
+
+  if (entry.mClass == FRAME_PARSE_INVALID) {
+    fprintf(stderr,"unknown frame type %X\n", type);
+    session->RaiseError(MOZQUIC_ERR_GENERAL, (char *) entry.mShortError);
+    return;
+  }
+  if (entry.mLength > pktSize) {
+    session->RaiseError(MOZQUIC_ERR_GENERAL, (char *) entry.mShortError);
+    return;
+  }
+  mFrameLen = entry.mLength;
+
+  switch (entry.mClass) {
+  case FRAME_PARSE_PADDING:
+    mType = FRAME_TYPE_PADDING;
+    mValid = MOZQUIC_OK;
+    mFrameLen = PaddingRunLength(pkt, pktSize);
+    return;
 
-  if ((type & FRAME_MASK_STREAM) == FRAME_TYPE_STREAM) {
+  case FRAME_PARSE_STREAM:
+  {
     mType = FRAME_TYPE_STREAM;
 
     u.mStream.mFinBit = (type & FRAME_FIN_BIT);
 
-    uint8_t ssBit = (type & 0x18) >> 3;
+    uint32_t idLen = ((type & 0x18) >> 3) + 1;
     uint8_t ooBit = (type & 0x06) >> 1;
-    uint8_t dBit = (type & 0x01);
-    
-    uint32_t lenLen = dBit ? 2 : 0;
-    uint32_t offsetLen = 0;
-    assert(!(ooBit & 0xFC));
-    if (ooBit == 0) {
-      offsetLen = 0;
-    } else if (ooBit == 1) {
-      offsetLen = 2;
-    } else if (ooBit == 2) {
-      offsetLen = 4;
-    } else if (ooBit == 3) {
-      offsetLen = 8;
-    }
-
-    assert(!(ssBit & 0xFC));
-    uint32_t idLen = ssBit + 1;
-
-    uint32_t bytesNeeded = 1 + lenLen + idLen + offsetLen;
-    if (bytesNeeded > pktSize) {
-      session->RaiseError(MOZQUIC_ERR_GENERAL, (char *) "stream frame header short");
-      return;
-    }
+    uint32_t offsetLen = ooBit ? (1 << ooBit) : 0;
 
+    u.mStream.mStreamID = 0;
     memcpy(((char *)&u.mStream.mStreamID) + (4 - idLen), framePtr, idLen);
     framePtr += idLen;
     u.mStream.mStreamID = ntohl(u.mStream.mStreamID);
 
+    u.mStream.mOffset = 0;
     memcpy(((char *)&u.mStream.mOffset) + (8 - offsetLen), framePtr, offsetLen);
     framePtr += offsetLen;
     u.mStream.mOffset = PR_ntohll(u.mStream.mOffset);
-    if (dBit) {
+    if (type & 0x01) {
       memcpy (&u.mStream.mDataLen, framePtr, 2);
       framePtr += 2;
       u.mStream.mDataLen = ntohs(u.mStream.mDataLen);
     } else {
-      u.mStream.mDataLen = pktSize - bytesNeeded;
+      u.mStream.mDataLen = pktSize - mFrameLen;
     }
 
     // todo log frame len
-    if (bytesNeeded + u.mStream.mDataLen > pktSize) {
+    if (mFrameLen + u.mStream.mDataLen > pktSize) {
       session->RaiseError(MOZQUIC_ERR_GENERAL, (char *) "stream frame data short");
       return;
     }
 
     mValid = MOZQUIC_OK;
-    mFrameLen = bytesNeeded;
     return;
-  } else if ((type & FRAME_MASK_ACK) == FRAME_TYPE_ACK) {
+  }
+
+  case FRAME_PARSE_ACK:
+  {
     mType = FRAME_TYPE_ACK;
-    uint8_t numBlocks = (type & 0x10) ? 1 : 0; // N bit
-    uint32_t ackedLen = (type & 0x0c) >> 2; // LL bits
-    ackedLen = 1 << ackedLen;
+    uint32_t ackedLen = 1 << ((type & 0x0c) >> 2); // LL bits
 
     // MM bits are type & 0x03
     u.mAck.mAckBlockLengthLen = 1 << (type & 0x03);
 
-    uint16_t bytesNeeded = 1 + numBlocks + 1 + ackedLen + 2;
-    if (bytesNeeded > pktSize) {
-      session->RaiseError(MOZQUIC_ERR_GENERAL, (char *) "ack frame header short");
-      return;
-    }
-
-    if (numBlocks) {
+    if (type & 0x10) { // N bit
       u.mAck.mNumBlocks = framePtr[0];
       framePtr++;
     } else {
@@ -2128,7 +4265,8 @@ MozQuic::FrameHeaderData::FrameHeaderData(unsigned char *pkt, uint32_t pktSize,
     memcpy(&u.mAck.mAckDelay, framePtr, 2);
     framePtr += 2;
     u.mAck.mAckDelay = ntohs(u.mAck.mAckDelay);
-    bytesNeeded += u.mAck.mAckBlockLengthLen + // required First ACK Block
+    uint32_t bytesNeeded = mFrameLen +
+                   u.mAck.mAckBlockLengthLen + // required First ACK Block
                    u.mAck.mNumBlocks * (1 + u.mAck.mAckBlockLengthLen); // additional ACK Blocks
     if (u.mAck.mNumTS) {
       bytesNeeded += u.mAck.mNumTS * (1 + 2) + 2;
@@ -2138,196 +4276,100 @@ MozQuic::FrameHeaderData::FrameHeaderData(unsigned char *pkt, uint32_t pktSize,
       return;
     }
     mValid = MOZQUIC_OK;
-    mFrameLen = framePtr - pkt;
     return;
-  } else {
-    switch(type) {
-
-    case FRAME_TYPE_PADDING:
-      mType = FRAME_TYPE_PADDING;
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_PADDING_LENGTH;
-      return;
+  }
 
-    case FRAME_TYPE_RST_STREAM:
-      if (pktSize < FRAME_TYPE_RST_STREAM_LENGTH) {
-        session->RaiseError(MOZQUIC_ERR_GENERAL,
-                   (char *) "RST_STREAM frame length expected");
-        return;
-      }
+  default:
+    break;
+  }
 
-      mType = FRAME_TYPE_RST_STREAM;
+  // fixed size frames, the length has been checked
+  mType = static_cast<FrameType>(type);
+  switch(type) {
 
-      memcpy(&u.mRstStream.mErrorCode, framePtr, 4);
-      u.mRstStream.mErrorCode = ntohl(u.mRstStream.mErrorCode);
-      framePtr += 4;
-      memcpy(&u.mRstStream.mStreamID, framePtr, 4);
-      u.mRstStream.mStreamID = ntohl(u.mRstStream.mStreamID);
-      framePtr += 4;
-      memcpy(&u.mRstStream.mFinalOffset, framePtr, 8);
-      u.mRstStream.mFinalOffset = PR_ntohll(u.mRstStream.mFinalOffset);
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_RST_STREAM_LENGTH;
-      return;
+  case FRAME_TYPE_RST_STREAM:
+    memcpy(&u.mRstStream.mErrorCode, framePtr, 4);
+    u.mRstStream.mErrorCode = ntohl(u.mRstStream.mErrorCode);
+    framePtr += 4;
+    memcpy(&u.mRstStream.mStreamID, framePtr, 4);
+    u.mRstStream.mStreamID = ntohl(u.mRstStream.mStreamID);
+    framePtr += 4;
+    memcpy(&u.mRstStream.mFinalOffset, framePtr, 8);
+    u.mRstStream.mFinalOffset = PR_ntohll(u.mRstStream.mFinalOffset);
+    break;
 
-    case FRAME_TYPE_CLOSE:
-      if (pktSize < FRAME_TYPE_CLOSE_LENGTH) {
+  case FRAME_TYPE_CLOSE:
+  {
+    memcpy(&u.mClose.mErrorCode, framePtr, 4);
+    u.mClose.mErrorCode = ntohl(u.mClose.mErrorCode);
+    framePtr += 4;
+    uint16_t len;
+    memcpy(&len, framePtr, 2);
+    len = ntohs(len);
+    framePtr += 2;
+    if (len) {
+      if (pktSize < ((uint32_t)FRAME_TYPE_CLOSE_LENGTH + len)) {
         session->RaiseError(MOZQUIC_ERR_GENERAL,
                    (char *) "CONNECTION_CLOSE frame length expected");
         return;
       }
-
-      mType = FRAME_TYPE_CLOSE;
-
-      memcpy(&u.mClose.mErrorCode, framePtr, 4);
-      u.mClose.mErrorCode = ntohl(u.mClose.mErrorCode);
-      framePtr += 4;
-      uint16_t len;
-      memcpy(&len, framePtr, 2);
-      len = ntohs(len);
-      framePtr += 2;
-      if (len) {
-        if (pktSize < ((uint32_t)FRAME_TYPE_CLOSE_LENGTH + len)) {
-          session->RaiseError(MOZQUIC_ERR_GENERAL,
-                     (char *) "CONNECTION_CLOSE frame length expected");
-          return;
-        }
-        // Log error!
-        char reason[kMozQuicMSS];
-        if (len < kMozQuicMSS) {
-          memcpy(reason, framePtr, len);
-          reason[len] = '\0';
-          session->Log((char *)reason);
-        }
-      }
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_CLOSE_LENGTH + len;
-      return;
-
-    case FRAME_TYPE_GOAWAY:
-      if (pktSize < FRAME_TYPE_GOAWAY_LENGTH) {
-        session->RaiseError(MOZQUIC_ERR_GENERAL,
-                   (char *) "GOAWAY frame length expected");
-        return;
-      }
-
-      mType = FRAME_TYPE_GOAWAY;
-
-      memcpy(&u.mGoaway.mClientStreamID, framePtr, 4);
-      u.mGoaway.mClientStreamID = ntohl(u.mGoaway.mClientStreamID);
-      framePtr += 4;
-      memcpy(&u.mGoaway.mServerStreamID, framePtr, 4);
-      u.mGoaway.mServerStreamID = ntohl(u.mGoaway.mServerStreamID);
-      framePtr += 4;
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_GOAWAY_LENGTH;
-      return;
-
-    case FRAME_TYPE_MAX_DATA:
-      if (pktSize < FRAME_TYPE_MAX_DATA_LENGTH) {
-        session->RaiseError(MOZQUIC_ERR_GENERAL,
-                   (char *) "MAX_DATA frame length expected");
-        return;
-      }
-
-      mType = FRAME_TYPE_MAX_DATA;
-
-      memcpy(&u.mMaxData.mMaximumData, framePtr, 8);
-      u.mMaxData.mMaximumData = PR_ntohll(u.mMaxData.mMaximumData);
-      mValid = MOZQUIC_OK;
-      mFrameLen =  FRAME_TYPE_MAX_DATA_LENGTH;
-      return;
-
-    case FRAME_TYPE_MAX_STREAM_DATA:
-      if (pktSize < FRAME_TYPE_MAX_STREAM_DATA_LENGTH) {
-        session->RaiseError(MOZQUIC_ERR_GENERAL,
-                   (char *) "MAX_STREAM_DATA frame length expected");
-        return;
-      }
-
-      mType = FRAME_TYPE_MAX_STREAM_DATA;
-
-      memcpy(&u.mMaxStreamData.mStreamID, framePtr, 4);
-      u.mMaxStreamData.mStreamID = ntohl(u.mMaxStreamData.mStreamID);
-      framePtr += 4;
-      memcpy(&u.mMaxStreamData.mMaximumStreamData, framePtr, 8);
-      u.mMaxStreamData.mMaximumStreamData =
-        PR_ntohll(u.mMaxStreamData.mMaximumStreamData);
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_MAX_STREAM_DATA_LENGTH;
-      return;
-
-    case FRAME_TYPE_MAX_STREAM_ID:
-      if (pktSize < FRAME_TYPE_MAX_STREAM_ID_LENGTH) {
-        session->RaiseError(MOZQUIC_ERR_GENERAL,
-                   (char *) "MAX_STREAM_ID frame length expected");
-        return;
-      }
-
-      mType = FRAME_TYPE_MAX_STREAM_ID;
-
-      memcpy(&u.mMaxStreamID.mMaximumStreamID, framePtr, 4);
-      u.mMaxStreamID.mMaximumStreamID =
-        ntohl(u.mMaxStreamID.mMaximumStreamID);
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_MAX_STREAM_ID_LENGTH;
-      return;
-
-    case FRAME_TYPE_PING:
-      mType = FRAME_TYPE_PING;
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_PING_LENGTH;
-      return;
-
-    case FRAME_TYPE_BLOCKED:
-      mType = FRAME_TYPE_BLOCKED;
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_BLOCKED_LENGTH;
-      return;
-
-    case FRAME_TYPE_STREAM_BLOCKED:
-      if (pktSize < FRAME_TYPE_STREAM_BLOCKED_LENGTH) {
-        session->RaiseError(MOZQUIC_ERR_GENERAL,
-                   (char *) "STREAM_BLOCKED frame length expected");
-        return;
+      // Log error!
+      char reason[kMozQuicMSS];
+      if (len < kMozQuicMSS) {
+        memcpy(reason, framePtr, len);
+        reason[len] = '\0';
+        session->Log((char *)reason);
       }
+    }
+    mFrameLen = FRAME_TYPE_CLOSE_LENGTH + len;
+    break;
+  }
 
-      mType = FRAME_TYPE_STREAM_BLOCKED;
+  case FRAME_TYPE_GOAWAY:
+    memcpy(&u.mGoaway.mClientStreamID, framePtr, 4);
+    u.mGoaway.mClientStreamID = ntohl(u.mGoaway.mClientStreamID);
+    framePtr += 4;
+    memcpy(&u.mGoaway.mServerStreamID, framePtr, 4);
+    u.mGoaway.mServerStreamID = ntohl(u.mGoaway.mServerStreamID);
+    break;
 
-      memcpy(&u.mStreamBlocked.mStreamID, framePtr, 4);
-      u.mStreamBlocked.mStreamID = ntohl(u.mStreamBlocked.mStreamID);
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_STREAM_BLOCKED_LENGTH;
-      return;
+  case FRAME_TYPE_MAX_DATA:
+    memcpy(&u.mMaxData.mMaximumData, framePtr, 8);
+    u.mMaxData.mMaximumData = PR_ntohll(u.mMaxData.mMaximumData);
+    break;
 
-    case FRAME_TYPE_STREAM_ID_NEEDED:
-      mType = FRAME_TYPE_STREAM_ID_NEEDED;
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_STREAM_ID_NEEDED_LENGTH;
-      return;
+  case FRAME_TYPE_MAX_STREAM_DATA:
+    memcpy(&u.mMaxStreamData.mStreamID, framePtr, 4);
+    u.mMaxStreamData.mStreamID = ntohl(u.mMaxStreamData.mStreamID);
+    framePtr += 4;
+    memcpy(&u.mMaxStreamData.mMaximumStreamData, framePtr, 8);
+    u.mMaxStreamData.mMaximumStreamData =
+      PR_ntohll(u.mMaxStreamData.mMaximumStreamData);
+    break;
 
-    case FRAME_TYPE_NEW_CONNECTION_ID:
-      if (pktSize < FRAME_TYPE_NEW_CONNECTION_ID_LENGTH) {
-        session->RaiseError(MOZQUIC_ERR_GENERAL,
-                   (char *) "NEW_CONNECTION_ID frame length expected");
-        return;
-      }
+  case FRAME_TYPE_MAX_STREAM_ID:
+    memcpy(&u.mMaxStreamID.mMaximumStreamID, framePtr, 4);
+    u.mMaxStreamID.mMaximumStreamID =
+      ntohl(u.mMaxStreamID.mMaximumStreamID);
+    break;
 
-      mType = FRAME_TYPE_NEW_CONNECTION_ID;
+  case FRAME_TYPE_STREAM_BLOCKED:
+    memcpy(&u.mStreamBlocked.mStreamID, framePtr, 4);
+    u.mStreamBlocked.mStreamID = ntohl(u.mStreamBlocked.mStreamID);
+    break;
 
-      memcpy(&u.mNewConnectionID.mSequence, framePtr, 2);
-      u.mNewConnectionID.mSequence = ntohs(u.mNewConnectionID.mSequence);
-      framePtr += 2;
-      memcpy(&u.mNewConnectionID.mConnectionID, framePtr, 8);
-      u.mNewConnectionID.mConnectionID =
-        PR_ntohll(u.mNewConnectionID.mConnectionID);
-      mValid = MOZQUIC_OK;
-      mFrameLen = FRAME_TYPE_NEW_CONNECTION_ID_LENGTH;
-      return;
+  case FRAME_TYPE_NEW_CONNECTION_ID:
+    memcpy(&u.mNewConnectionID.mSequence, framePtr, 2);
+    u.mNewConnectionID.mSequence = ntohs(u.mNewConnectionID.mSequence);
+    framePtr += 2;
+    memcpy(&u.mNewConnectionID.mConnectionID, framePtr, 8);
+    u.mNewConnectionID.mConnectionID =
+      PR_ntohll(u.mNewConnectionID.mConnectionID);
+    break;
 
-    default:
-      assert(false);
-    }
+  default:
+    // PING, BLOCKED and STREAM_ID_NEEDED are just the type byte
+    break;
   }
   mValid = MOZQUIC_OK;
 }
@@ -28,6 +28,7 @@ extern "C" {
     MOZQUIC_ERR_CRYPTO           = 5,
     MOZQUIC_ERR_VERSION          = 6,
     MOZQUIC_ERR_ALREADY_FINISHED = 7,
+    MOZQUIC_ERR_WOULD_BLOCK      = 8,
   };
 
   // The event Callbacks receive an application specified closure,
@@ -46,6 +47,7 @@ extern "C" {
     MOZQUIC_EVENT_TRANSMIT               =  8, // mozquic_eventdata_transmit
     MOZQUIC_EVENT_RECV                   =  9, // mozquic_eventdata_recv
     MOZQUIC_EVENT_TLSINPUT               = 10, // mozquic_eventdata_tlsinput
+    MOZQUIC_EVENT_STREAM_WRITABLE        = 11, // mozquic_stream_t *
   };
 
   enum {
@@ -69,6 +71,38 @@ extern "C" {
     unsigned int ignorePKI; // flag
     unsigned int tolerateBadALPN; // flag
     unsigned int appHandlesSendRecv; // flag to control TRANSMIT/RECV/TLSINPUT events
+    unsigned int builtinPacketProtection; // flag, use the in tree simd aead instead of nss
+                                          // when the cpu supports it. tls stays on nss
+    unsigned int statelessRetry; // flag, server validates every client address with a retry
+    unsigned int statelessRetryRate; // server validates client addresses with a retry while
+                                     // more than this many handshakes/sec arrive. 0 is never
+    unsigned int enable0RTT; // flag, client sends stream data before the handshake completes
+                             // when it resumes a session, server accepts it. Early data
+                             // can be replayed by an attacker, see kAntiReplayWindow
+    unsigned int handshakeWorkers; // server, threads that run tls handshakes so they do not
+                                   // stall the io thread. 0 runs them inline on it
+    unsigned int releaseHandshakeState; // flag, server keeps only the packet protection keys of
+                                        // a connected session and frees its tls socket and
+                                        // stream 0
+    unsigned int idleTimeout; // ms without hearing from the peer before a connection is
+                              // closed (silently). 0 is the default of 60 seconds
+    // per mozquic_IO() work budgets, so one busy peer can not starve the others. Work
+    // over budget waits for the next call
+    unsigned int intakeBudget; // datagrams read from the socket. 0 is the default of 512
+    unsigned int flushBudget; // packets sent per connection. 0 is the default of 128
+    unsigned int ioTimeBudget; // microseconds for the whole call. 0 is no limit
+    // bytes of stream data buffered by a client, or by all of a server's connections. Receive
+    // windows shrink as it fills and new streams and connections are refused once it is
+    // used up. 0 is the default of 256MB
+    uint64_t memoryBudget;
+    // bytes accepted by mozquic_send() but not yet sent. A write that does not fit in what
+    // is left of the stream's or the connection's limit is refused whole with
+    // MOZQUIC_ERR_WOULD_BLOCK, and the stream gets MOZQUIC_EVENT_STREAM_WRITABLE once both
+    // have drained to half. A write bigger than a limit is only taken when that buffer is
+    // empty. mozquic_start_new_stream() with data opens no stream when it does not fit in
+    // the connection. 0 is the default of 1MB per stream and 4MB per connection
+    unsigned int streamSendBuffer;
+    unsigned int connectionSendBuffer;
 
     int  (*connection_event_callback)(void *, uint32_t event, void *aParam);
   };
@@ -85,9 +119,96 @@ extern "C" {
   int mozquic_send(mozquic_stream_t *stream, void *data, uint32_t amount, int fin);
   int mozquic_end_stream(mozquic_stream_t *stream);
   int mozquic_recv(mozquic_stream_t *stream, void *data, uint32_t aval, uint32_t *amount, int *fin);
+  // as mozquic_recv() but also gives the stream offset of what it returns, see
+  // mozquic_stream_set_unordered()
+  int mozquic_recv_unordered(mozquic_stream_t *stream, void *data, uint32_t avail,
+                             uint64_t *offset, uint32_t *amount, int *fin);
   int mozquic_set_event_callback(mozquic_connection_t *conn, int (*fx)(mozquic_connection_t *, uint32_t event, void * param));
   int mozquic_set_event_callback_closure(mozquic_connection_t *conn, void *closure);
   int mozquic_check_peer(mozquic_connection_t *conn, uint32_t deadline);
+  // a server's connections only get MOZQUIC_EVENT_IO on the IO turns they
+  // need (packets arrived, data to send, a timer). This asks for one
+  // within delayMs even if nothing else happens. Client connections get
+  // one on every mozquic_IO() anyway.
+  int mozquic_schedule_io(mozquic_connection_t *conn, uint32_t delayMs);
+
+  // urgency 0 (most urgent) to 7, default 3. weight 1 to 256, default 16,
+  // shares bandwidth among incremental streams of the same urgency.
+  // Non-incremental (sequential) streams of an urgency are sent one at a
+  // time in stream id order before any incremental ones.
+  int mozquic_stream_set_priority(mozquic_stream_t *stream, uint8_t urgency,
+                                  uint16_t weight, int incremental);
+
+  // while a stream is corked small mozquic_send() writes are gathered and
+  // sent as full packets. Held data goes out when a packet's worth has
+  // gathered, the stream is uncorked or ended, or after 10ms.
+  int mozquic_stream_set_cork(mozquic_stream_t *stream, int corked);
+
+  // an unordered stream gives its data to the app as it arrives instead of
+  // holding everything behind a loss, and reassembly is up to the app. It
+  // is read with mozquic_recv_unordered() (mozquic_recv() is
+  // MOZQUIC_ERR_INVALID), each range once, and fin comes when all data up
+  // to it has been read. It can not be made ordered again.
+  int mozquic_stream_set_unordered(mozquic_stream_t *stream);
+
+  // MOZQUIC_EVENT_NEW_STREAM_DATA comes at most once per mozquic_IO() for a
+  // stream, and waits until bytes are readable (default 1). It still comes
+  // for a fin, or when the peer can not send more until the app reads.
+  int mozquic_stream_set_read_lowat(mozquic_stream_t *stream, uint32_t bytes);
+
+  // counters are cumulative over the life of the connection
+  struct mozquic_stats_t
+  {
+    uint64_t packetsLost;
+    uint64_t blockedSent;     // BLOCKED and STREAM_BLOCKED frames
+    uint64_t blockedReceived; // BLOCKED and STREAM_BLOCKED frames
+
+    // server address validation. on a server's listening connection these
+    // also count what was dropped for its connections
+    uint64_t amplificationDropped;      // packets held back from unvalidated addresses
+    uint64_t versionNegotiationSent;
+    uint64_t versionNegotiationDropped; // too small to be a client initial, or rate limited
+    uint64_t statelessRetriesSent;
+
+    // 0-rtt
+    uint64_t earlyDataSent;         // stream bytes (client)
+    uint64_t earlyDataRejected;     // of earlyDataSent, resent under 1-rtt (client)
+    uint64_t earlyPacketsReceived;  // (server)
+    uint64_t sessionResumed;        // 1 when the handshake resumed a ticket
+
+    // lifecycle. a server's listening connection counts for all of its
+    // connections
+    uint64_t idleTimeouts;
+    uint64_t connectionsReaped;     // destroyed and freed (server)
+
+    // mozquic_IO() calls that stopped short on a budget, see mozquic_config_t
+    uint64_t intakeBudgetExhausted;
+    uint64_t flushBudgetExhausted;
+    uint64_t ioTimeBudgetExhausted;
+
+    // memory governor, see mozquic_config_t memoryBudget
+    uint64_t memoryBuffered;        // bytes now
+    uint64_t memoryRefused;         // streams and connections
+    uint64_t sendBlocked;           // mozquic_send() calls that would have blocked
+  };
+  int mozquic_get_stats(mozquic_connection_t *conn, struct mozquic_stats_t *stats);
+
+  // tls session tickets. A client connection saves the newest ticket from
+  // its server (by originName and originPort) and the next connection to
+  // the same origin uses it to resume, skipping the certificate exchange.
+  // Tickets are single use. export/import let the app keep them across
+  // restarts: import before the process makes any connection, since an
+  // exported ticket brings along the key nss wrapped the session with and
+  // a process has only one (MOZQUIC_ERR_CRYPTO otherwise). The export is
+  // as secret as the session itself. A server process seals tickets with
+  // its own key, so a ticket resumes only against the server process that
+  // issued it.
+  // export sets written to the size needed and returns
+  // MOZQUIC_ERR_MEMORY if avail is too small.
+  int mozquic_export_session_ticket(const char *originName, int originPort,
+                                    unsigned char *data, uint32_t avail, uint32_t *written);
+  int mozquic_import_session_ticket(const char *originName, int originPort,
+                                    const unsigned char *data, uint32_t len);
 
   ////////////////////////////////////////////////////
   // IO handlers
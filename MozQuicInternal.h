@@ -9,11 +9,14 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <forward_list>
+#include <set>
 #include <unordered_map>
 #include <memory>
 #include <vector>
+#include "ConnectionIDTable.h"
 #include "MozQuicStream.h"
 #include "NSSHelper.h"
+#include "TimerHeap.h"
 #include "prnetdb.h"
 
 namespace mozquic {
@@ -48,13 +51,118 @@ class MozQuicStreamAck;
 class MozQuic final : public MozQuicWriter
 {
 public:
-  static const uint32_t kMozQuicMTU = 1252; // todo pmtud and assumes v4
+  static const uint32_t kMozQuicMTU = 1252; // base mtu, todo assumes v4
+  static const uint32_t kMaxMTU = 8972; // 9000 byte jumbo frames less ip and udp
+
+  // path mtu discovery (dplpmtud flavored). probes are ping+padding packets
+  // of the candidate size and the search is binary between the confirmed
+  // mtu and the smallest size that has failed.
+  static const uint32_t kMTUProbeMinTimeout = 500; // ms, else 3 srtt
+  static const uint32_t kMTUMaxProbes = 3; // per size before it is a failure
+  static const uint32_t kMTUSearchGranularity = 32;
+  static const uint32_t kMTURaiseInterval = 600000; // ms between searches
+  static const uint32_t kMTUBlackHoleTimeouts = 3; // consecutive rto's
   static const uint32_t kMinClientInitial = 1200; // an assumption
   static const uint32_t kMozQuicMSS = 16384;
 
+  // FlushStream frames up to kFlushBatch packets (that fit in
+  // kFlushBufferSize) before encrypting and sending them as a burst, and
+  // Intake decrypts up to kIntakeBatch datagrams for one session together
+  static const uint32_t kFlushBatch = 16;
+  static const uint32_t kFlushBufferSize = 65536;
+  static const uint32_t kIntakeBatch = 16;
+
+  // per IO() work budgets so one busy peer can't hold up the timers and
+  // everyone else. Intake reads at most mIntakeBudget datagrams, and a
+  // connection sends at most mFlushBudget packets a turn (plus one per
+  // flush, so acks are never held back). mIOTimeBudget (us, 0 is none)
+  // bounds a whole IO() call of a client or server parent.
+  static const uint32_t kDefaultIntakeBudget = 512;
+  static const uint32_t kDefaultFlushBudget = 128;
+
   static const uint32_t kRetransmitThresh = 500;
   static const uint32_t kForgetUnAckedThresh = 4000; // ms
   static const uint32_t kForgetInitialConnectionIDsThresh = 4000; // ms
+
+  // stateless retry. a token is an hmac over the client address, port,
+  // connection id and issue time, keyed with a secret that rotates every
+  // kRetryKeyLifetime. The previous secret is kept so tokens issued just
+  // before a rotation still verify.
+  static const uint32_t kRetryTokenLifetime = 10000; // ms
+  static const uint32_t kRetryKeyLifetime = 30000; // ms
+  static const uint32_t kRetryTokenLength = 25; // key index, 8 byte issue time, 16 byte mac
+
+  // until a client has shown it receives at its address (acked something
+  // or sent a 1rtt packet) a server sends at most kAmplificationFactor
+  // times the bytes it got from it. Version negotiation is only sent in
+  // reply to client initial sized packets, through a token bucket.
+  static const uint32_t kAmplificationFactor = 3;
+  static const uint32_t kVersionNegotiationRate = 100; // per second
+  static const uint32_t kVersionNegotiationBurst = 20;
+
+  // 0-rtt. a server accepts early data only for client hellos whose
+  // ticket age is within kAntiReplayWindow and that its replay filter has
+  // not seen in the last two windows. The filter rejects everything for
+  // the first window after the server starts.
+  static const uint32_t kAntiReplayWindow = 10000; // ms
+  // 0-rtt packets that arrive while a handshake turn is on a worker are
+  // held until it is done, at most this many per connection
+  static const uint32_t kMaxEarlyPending = 16;
+  // a server connection that has not finished its handshake after sending
+  // this many cleartext packets is given up on
+  static const uint32_t kMaxHandshakePackets = 20;
+
+  // lifecycle. a connection that hears nothing from its peer for its idle
+  // timeout is closed without sending anything. A closed server connection
+  // keeps its connection id for kClosingPeriod after the app destroys it so
+  // late packets for it are dropped rather than taken for new connections,
+  // then the parent frees it.
+  static const uint32_t kDefaultIdleTimeout = 60000; // ms
+  static const uint32_t kClosingPeriod = 3 * 500; // ms, 3 retransmit intervals
+
+  // loss detection: a packet is lost once a packet kReorderingThreshold
+  // numbers later has been acked, or once it was sent more than 9/8 of an
+  // rtt before a later packet that has been acked
+  static const uint32_t kReorderingThreshold = 3;
+  static const uint32_t kDefaultRTT = 100; // ms, until we have a sample
+
+  // congestion control (newreno flavored) in bytes
+  static const uint32_t kInitialCongestionWindow = 10 * kMozQuicMTU;
+  static const uint32_t kMinimumCongestionWindow = 2 * kMozQuicMTU;
+
+  // flow control in bytes. there are no transport parameters yet, so both
+  // ends assume these initial limits. receive windows double (up to the
+  // max) when the app consumes a window in less than 2 rtts. MAX_DATA is
+  // expressed in units of 1024 octets on the wire.
+  static const uint64_t kInitialMaxStreamData = 256 * 1024;
+  static const uint64_t kInitialMaxData = 1024 * 1024;
+  static const uint64_t kMaxStreamWindow = 16 * 1024 * 1024;
+  static const uint64_t kMaxConnectionWindow = 24 * 1024 * 1024;
+
+  // memory governor. the stream data buffered by a client, or by all of a
+  // server's connections together, is held to a budget. Past half of it
+  // receive windows stop growing and the credit advertised shrinks with
+  // the room left, none at all once it is used up (it is offered again
+  // every kWindowRetryInterval). Over the budget new streams and server
+  // connections are refused.
+  static const uint64_t kDefaultMemoryBudget = 256 * 1024 * 1024;
+  static const uint32_t kWindowRetryInterval = 100; // ms
+
+  // send buffer limits in bytes, see SendBufferOpen
+  static const uint32_t kDefaultStreamSendBuffer = 1024 * 1024;
+  static const uint32_t kDefaultConnectionSendBuffer = 4 * 1024 * 1024;
+
+  // corked streams gather small writes into chunks of kCorkSize (a base
+  // mtu packet less headers, an ack and the aead tag), held no longer
+  // than kCorkDelay
+  static const uint32_t kCorkSize = kMozQuicMTU - 64;
+  static const uint32_t kCorkDelay = 10; // ms
+
+  // stream scheduling, see MozQuicStreamOut::SetPriority
+  static const uint8_t  kDefaultUrgency = 3;
+  static const uint8_t  kMaxUrgency = 7;
+  static const uint16_t kDefaultWeight = 16;
+  static const uint16_t kMaxWeight = 256;
  
   MozQuic(bool handleIO);
   MozQuic();
@@ -79,10 +187,34 @@ public:
   void SetIgnorePKI() { mIgnorePKI = true; }
   void SetTolerateBadALPN() { mTolerateBadALPN = true; }
   void SetAppHandlesSendRecv() { mAppHandlesSendRecv = true; }
+  void SetBuiltinPacketProtection() { mBuiltinPacketProtection = true; }
+  bool BuiltinPacketProtection() { return mBuiltinPacketProtection; }
+  void SetStatelessRetry() { mStatelessRetry = true; }
+  void SetStatelessRetryRate(uint32_t rate) { mStatelessRetryRate = rate; }
+  void SetEnable0RTT() { mEnable0RTT = true; }
+  bool Enabled0RTT() { return mEnable0RTT; }
+  void SetHandshakeWorkers(uint32_t threads) { mHandshakeWorkerThreads = threads; }
+  void SetReleaseHandshakeState() { mReleaseHandshakeState = true; }
+  void SetIdleTimeout(uint32_t ms) { mIdleTimeout = ms; }
+  void SetIntakeBudget(uint32_t datagrams) { mIntakeBudget = datagrams; }
+  void SetFlushBudget(uint32_t packets) { mFlushBudget = packets; }
+  void SetIOTimeBudget(uint32_t us) { mIOTimeBudget = us; }
+  void SetMemoryBudget(uint64_t bytes) { mMemoryBudget = bytes; }
+  void SetStreamSendBuffer(uint32_t bytes) { mStreamSendBuffer = bytes; }
+  void SetConnectionSendBuffer(uint32_t bytes) { mConnectionSendBuffer = bytes; }
   bool IgnorePKI();
   void DeleteStream(uint32_t streamID);
   void Destroy(uint32_t, const char *);
   uint32_t CheckPeer(uint32_t);
+  void ScheduleIO(uint32_t delay);
+  void StreamDataConsumed(MozQuicStreamPair *stream, uint32_t amt);
+  bool SendBufferOpen(MozQuicStreamPair *stream, uint32_t len);
+  void StreamDataWritten(uint32_t amt) { mDataWritten += amt; }
+  uint32_t SetCork(MozQuicStreamPair *stream, bool corked);
+  uint32_t SetPriority(MozQuicStreamPair *stream, uint8_t urgency, uint16_t weight,
+                       bool incremental);
+  void CorkHeld(MozQuicStreamPair *stream);
+  void GetStats(struct mozquic_stats_t *stats);
 
   uint32_t DoWriter(std::unique_ptr<MozQuicStreamChunk> &p) override;
 private:
@@ -96,7 +228,19 @@ private:
 
   uint32_t Transmit(unsigned char *, uint32_t len, struct sockaddr_in *peer);
   uint32_t RetransmitTimer();
+  uint32_t MTUProbeTimer();
+  void SendMTUProbe(uint32_t size);
+  uint64_t MTUProbeTimeout();
+  void MTUProbeAcked();
+  void MTUTimeout(uint64_t now);
   uint32_t ClearOldInitialConnectIdsTimer();
+  uint32_t IdleTimer();
+  void EnterClosed();
+  void ReapChild(MozQuic *child);
+  void ServiceChildren();
+  void MakeReady();
+  void WakeAt(uint64_t deadline);
+  uint64_t NextTimer(uint64_t now);
   void Acknowledge(uint64_t packetNum, keyPhase kp);
   uint32_t AckPiggyBack(unsigned char *pkt, uint64_t pktNumber, uint32_t avail, keyPhase kp, uint32_t &used);
   uint32_t Recv(unsigned char *, uint32_t len, uint32_t &outLen, struct sockaddr_in *peer);
@@ -106,20 +250,55 @@ private:
   int ProcessClientCleartext(unsigned char *pkt, uint32_t pktSize, LongHeaderData &, bool&);
   uint32_t ProcessGeneralDecoded(unsigned char *, uint32_t size, bool &, bool fromClearText);
   uint32_t ProcessGeneral(unsigned char *, uint32_t size, uint32_t headerSize, uint64_t packetNumber, bool &);
+  uint32_t ProcessGeneralBatch(AEADBlock *blocks, uint32_t count);
   bool IntegrityCheck(unsigned char *, uint32_t size);
   void ProcessAck(class FrameHeaderData &result, unsigned char *framePtr, bool fromCleartext);
+  void UpdateRTT(uint64_t sample, uint64_t ackDelay);
+  void DetectLosses(uint64_t now);
+  void RetransmitChunk(std::unique_ptr<MozQuicStreamChunk> &chunk);
+  void OnChunkAcked(MozQuicStreamChunk *chunk);
+  void OnPacketsLost(uint64_t largestLost);
+  void RetransmitEarlyData();
+  keyPhase ProtectedSendPhase();
+  uint32_t ProcessEarlyData(unsigned char *pkt, uint32_t pktSize, LongHeaderData &header, bool &sendAck);
+  void ProcessEarlyPending();
+  uint32_t CheckRecvFlowControl(MozQuicStreamPair *stream, uint64_t endData);
+  uint32_t ProcessFlowControlFrame(class FrameHeaderData &result);
+  void QueueControlFrame(uint8_t frameType, uint32_t streamID, uint64_t value);
+  void NotifyWritable();
+  void QueueReadable(MozQuicStreamPair *stream);
+  void NotifyReadable();
+  void CorkTimer();
+  void UpdateStreamWindow(MozQuicStreamPair *stream, uint64_t now);
+  void UpdateConnectionWindow(uint64_t now);
+  void ReopenWindows();
+  uint64_t GovernedWindow(uint64_t window);
+  bool OverMemoryBudget();
 
   bool ServerState() { return mConnectionState > SERVER_STATE_BREAK; }
   MozQuic *FindSession(uint64_t cid);
-  void RemoveSession(uint64_t cid);
   void Shutdown(uint32_t, const char *);
 
   uint64_t Timestamp();
+  static uint64_t TimestampUs(); // monotonic
+  bool IOTimeBudgetSpent();
   uint32_t Intake();
   uint32_t Flush();
   uint32_t FlushStream0(bool forceAck);
   uint32_t FlushStream(bool forceAck);
-  uint32_t CreateStreamAndAckFrames(unsigned char *&framePtr, unsigned char *endpkt, bool justZero);
+  void Schedule(MozQuicStreamPair *stream);
+  bool UnWrittenEmpty() { return mUnWrittenData.empty() && mSchedule.empty(); }
+  uint32_t CreateStreamAndAckFrames(unsigned char *&framePtr, unsigned char *endpkt, bool justZero,
+                                    keyPhase kp);
+  bool CreateStreamFrame(std::list<std::unique_ptr<MozQuicStreamChunk>> &queue,
+                         std::list<std::unique_ptr<MozQuicStreamChunk>>::iterator &iter,
+                         unsigned char *&framePtr, unsigned char *endpkt, keyPhase kp,
+                         bool &blocked);
+  uint32_t CreateControlFrame(MozQuicStreamChunk *chunk, unsigned char *framePtr, unsigned char *endpkt);
+  void MoveToUnAcked(std::unique_ptr<MozQuicStreamChunk> &chunk, keyPhase kp);
+  bool FlowControlRoom(MozQuicStreamChunk *chunk, MozQuicStreamPair *&stream, uint32_t &room);
+  uint64_t SendLimit(MozQuicStreamPair *stream, bool &connBlocked);
+  bool Frameable();
 
   int Client1RTT();
   int Server1RTT();
@@ -128,7 +307,16 @@ private:
   bool VersionOK(uint32_t proposed);
   uint32_t GenerateVersionNegotiation(LongHeaderData &clientHeader, struct sockaddr_in *peer);
   uint32_t ProcessVersionNegotiation(unsigned char *pkt, uint32_t pktSize, LongHeaderData &header);
+  bool VersionNegotiationAllowed(uint32_t pktSize);
+  bool StatelessRetryNeeded();
+  uint32_t MakeRetryToken(struct sockaddr_in *peer, uint64_t connectionID,
+                          uint8_t keyIndex, uint64_t issued, unsigned char *out);
+  bool CheckRetryToken(struct sockaddr_in *peer, uint64_t connectionID,
+                       const unsigned char *token);
+  uint32_t GenerateStatelessRetry(LongHeaderData &clientHeader, struct sockaddr_in *peer);
+  uint32_t ProcessServerStatelessRetry(unsigned char *pkt, uint32_t pktSize, LongHeaderData &header);
   int CreateShortPacketHeader(unsigned char *pkt, uint32_t pktSize, uint32_t &used);
+  void CreateLongPacketHeader(unsigned char *pkt, uint8_t type);
 
   MozQuic *Accept(struct sockaddr_in *peer, uint64_t aConnectionID);
 
@@ -142,6 +330,9 @@ private:
   bool mIgnorePKI;
   bool mTolerateBadALPN;
   bool mAppHandlesSendRecv;
+  bool mBuiltinPacketProtection;
+  bool mEnable0RTT;
+  bool mReleaseHandshakeState; // server, mStream0 is gone once connected
   bool mIsLoopback;
   enum connectionState mConnectionState;
   int mOriginPort;
@@ -150,8 +341,8 @@ private:
 
   uint32_t mVersion;
 
-  // todo mvp lifecycle.. stuff never comes out of here
-  std::unordered_map<uint64_t, MozQuic *> mConnectionHash;
+  // children leave this (and mChildren) in ReapChild()
+  ConnectionIDTable<MozQuic *> mConnectionHash;
   // This maps connectionId sent by a client and connectionId chosen by the
   // server. This is used to detect dup client initial packets.
   // The elemets are going to be removed using a timer.
@@ -159,7 +350,7 @@ private:
     uint64_t mServerConnectionID;
     uint64_t mTimestamp;
   };
-  std::unordered_map<uint64_t, struct InitialClientPacketInfo> mConnectionHashOriginalNew;
+  ConnectionIDTable<struct InitialClientPacketInfo> mConnectionHashOriginalNew;
 
   uint64_t mConnectionID;
   uint64_t mNextTransmitPacketNumber;
@@ -169,8 +360,18 @@ private:
   void *mClosure;
   int  (*mConnEventCB)(void *, uint32_t, void *);
  
+  // declared ahead of everything that holds stream chunks so it outlives
+  // them. see kDefaultMemoryBudget
+  MemoryAccount mMemory;
+  uint64_t      mMemoryBudget;  // client or server parent
+  bool          mWindowsWithheld;
+  uint64_t      mWindowsRetry;
+  uint64_t      mMemoryRefused; // streams and connections
+
   std::unique_ptr<MozQuicStreamPair> mStream0;
   std::unique_ptr<NSSHelper>         mNSSHelper;
+  std::unique_ptr<unsigned char []>  mIntakeBuffer; // only where the fd is read
+  std::unique_ptr<unsigned char []>  mFlushBuffer;  // kFlushBufferSize, only where packets are sent
 
   uint32_t mNextStreamId;
   uint32_t mNextRecvStreamId;
@@ -183,6 +384,9 @@ private:
   // it won't be retransmitted again - that happens to the dup'd
   // incarnation)
   // mUnackedData is sorted by the packet number it was sent in.
+  // munwrittendata only holds control frames, stream 0 and retransmissions
+  // of deleted streams. Other stream data waits in its stream's
+  // mOut.mUnWritten and the stream is in mschedule
   std::list<std::unique_ptr<MozQuicStreamChunk>> mUnWrittenData;
   std::list<std::unique_ptr<MozQuicStreamChunk>> mUnAckedData;
 
@@ -201,13 +405,152 @@ private:
   MozQuic *mParent; // only in child
   std::shared_ptr<MozQuic> mAlive;
   std::list<std::shared_ptr<MozQuic>> mChildren; // only in parent
+  std::list<std::shared_ptr<MozQuic>>::iterator mChildIter; // only in child
+
+  // the parent gives a child an IO() turn only when it is on the ready
+  // list (it received packets, has data to send or was destroyed) or its
+  // next timer, see NextTimer(), is due. Children made ready during a turn
+  // wait for the next one.
+  template <typename T> friend class TimerHeap;
+  TimerHeap<MozQuic> mTimers;   // only in parent
+  MozQuic *mReadyHead;          // only in parent
+  MozQuic *mReadyTail;          // only in parent
+  MozQuic *mReadyNext;          // only in child
+  bool     mReadyQueued;        // only in child
+  uint64_t mTimerDeadline;      // only in child
+  uint32_t mTimerIndex;         // only in child, position in mTimers
+  uint64_t mAppWakeup;          // see mozquic_schedule_io
+
+  // see kDefaultIntakeBudget. the exhausted counters are kept on the
+  // connection and summed on the server parent
+  uint32_t mIntakeBudget;
+  uint32_t mFlushBudget;
+  uint32_t mFlushPackets; // this turn
+  uint32_t mIOTimeBudget;
+  uint64_t mIODeadline;   // TimestampUs(), 0 if there is no time budget
+  bool     mIOTimeBudgetHit; // this IO() call
+  uint64_t mIntakeBudgetExhausted;
+  uint64_t mFlushBudgetExhausted;
+  uint64_t mIOTimeBudgetExhausted;
 
   // The beginning of a connection.
   uint64_t mTimestampConnBegin;
 
+  // see kDefaultIdleTimeout. mClosingDeadline is set when the connection
+  // closes, a server child is reaped once it is past and mAlive is gone
+  uint32_t mIdleTimeout; // ms, 0 never times out
+  uint64_t mLastActivity; // a packet from the peer was processed
+  uint64_t mClosingDeadline;
+  uint64_t mOriginalConnectionID; // server child, the id of the client initial
+  uint64_t mIdleTimeouts;
+  uint64_t mConnectionsReaped; // server parent
+
   uint64_t mPingDeadline;
   bool     mDecodedOK;
 
+  // rtt estimation and loss detection state. times are in ms
+  uint64_t mLargestAcked;
+  uint64_t mSmoothedRTT;
+  uint64_t mRTTVar;
+  uint64_t mLatestRTT;
+  uint64_t mPacketsLost;
+
+  // congestion control state. bytes in flight counts stream data that has
+  // been sent and is neither acked nor declared lost.
+  uint64_t mCongestionWindow;
+  uint64_t mSlowStartThreshold;
+  uint64_t mBytesInFlight;
+  uint64_t mRecoveryEndPacket; // no further window reduction for losses below this
+
+  // connection level flow control. send side counts the new bytes framed
+  // against the peer's MAX_DATA, receive side counts the highest offset
+  // received on each stream against what we advertised.
+  uint64_t mPeerMaxData;
+  uint64_t mDataSent;
+  uint64_t mBlockedAt; // peer limit we last sent BLOCKED for
+  uint64_t mLocalMaxData;
+  uint64_t mDataRecvd;
+  uint64_t mDataConsumed;
+  uint64_t mConnectionWindow;
+  uint64_t mLastMaxDataUpdate;
+  uint64_t mBlockedFramesSent;
+  uint64_t mBlockedFramesRecvd;
+
+  // send buffering. mDataWritten - mDataSent is what the app has written
+  // that is not framed yet
+  uint32_t mStreamSendBuffer;
+  uint32_t mConnectionSendBuffer;
+  uint64_t mDataWritten;
+  uint32_t mWritableWaiters; // streams with mWantWritable
+  uint32_t mCorkedStreams;
+  std::vector<uint32_t> mReadable; // streams owed MOZQUIC_EVENT_NEW_STREAM_DATA
+  uint64_t mSendBlocked;
+
+  // path mtu discovery. mMTU is the confirmed size of a whole udp payload
+  uint32_t mMTU;
+  uint32_t mMTUProbeHigh;   // largest size not yet ruled out
+  uint32_t mMTUProbeSize;   // outstanding probe, 0 if none
+  uint32_t mMTUProbeCount;  // attempts at mMTUProbeSize
+  uint64_t mMTUProbePackets[kMTUMaxProbes]; // one per attempt at mMTUProbeSize
+  uint64_t mMTUProbeTime;
+  uint64_t mMTUNextSearch;
+  uint32_t mMTUTimeouts;    // consecutive retransmit timeouts for black hole detection
+  uint64_t mMTULastTimeout;
+
+  // stateless retry on the server parent. mStatelessRetry forces it on,
+  // otherwise it is used while more than mStatelessRetryRate client
+  // initials without a valid token arrive per second
+  bool        mStatelessRetry;
+  uint32_t    mStatelessRetryRate; // 0 never turns it on automatically
+  bool        mStatelessRetryActive;
+  uint64_t    mHandshakeRateStart;
+  uint32_t    mHandshakeRateCount;
+  uint32_t    mHandshakeRatePrev;
+  PK11SymKey *mRetryKey[2];
+  uint8_t     mRetryKeyIndex; // of the current key
+  uint64_t    mRetryKeyBirth;
+
+  // server parent, shared with the children's NSSHelpers which keep it
+  // alive until their handshakes are done
+  uint32_t    mHandshakeWorkerThreads;
+  std::shared_ptr<HandshakeWorkers> mHandshakeWorkers;
+  std::vector<NSSHelper *> mHandshakesCompleted; // scratch for ServiceChildren
+  // server parent, tls config and credentials the children are cloned from
+  PRFileDesc *mServerModel;
+
+  // anti amplification, see kAmplificationFactor. the counters are kept on
+  // the connection that dropped and summed on the server parent
+  bool        mAddressValidated;
+  uint64_t    mUnvalidatedBytesRecvd;
+  uint64_t    mUnvalidatedBytesSent;
+  uint64_t    mVersionNegotiationTokens; // thousandths of a reply
+  uint64_t    mVersionNegotiationRefill;
+  uint64_t    mAmplificationDropped;
+  uint64_t    mVersionNegotiationSent;
+  uint64_t    mVersionNegotiationDropped;
+  uint64_t    mStatelessRetriesSent;
+
+  // on the client, the token from a stateless retry. it is echoed at the
+  // front of every client initial from then on
+  bool          mReceivedRetry;
+  unsigned char mRetryToken[kRetryTokenLength];
+
+  // 0-rtt stream bytes sent and, of those, resent under 1-rtt because the
+  // server rejected them (client). 0-rtt packets processed (server).
+  uint64_t mEarlyDataSent;
+  uint64_t mEarlyDataRejected;
+  uint64_t mEarlyPacketsReceived;
+  uint32_t mHandshakePacketsSent; // server cleartext, see kMaxHandshakePackets
+  std::vector<std::vector<unsigned char>> mEarlyPending; // see kMaxEarlyPending
+
+  // per urgency virtual time of the last incremental stream served, so a
+  // stream that goes idle and comes back does not get to catch up
+  uint64_t mVirtualClock[kMaxUrgency + 1];
+
+  // streams with unwritten data, ordered by (urgency, stream id) for
+  // sequential streams and (urgency, virtual time) for incremental ones
+  std::set<std::pair<uint64_t, uint32_t>> mSchedule;
+
   // need other frame 2 list
 public: // callbacks from nsshelper
   int32_t NSSInput(void *buf, int32_t amount);
@@ -227,6 +570,10 @@ public:
     FRAME_TYPE_STREAM_BLOCKED    = 0x9,
     FRAME_TYPE_STREAM_ID_NEEDED  = 0xA,
     FRAME_TYPE_NEW_CONNECTION_ID = 0xB,
+    // not in draft-05. carries a stateless retry token as the body of a
+    // stateless retry and as the first frame of a client initial. It is
+    // consumed before the rest of the packet is parsed.
+    FRAME_TYPE_RETRY_TOKEN       = 0xC,
     // ACK                       = 0xa0 - 0xbf
     FRAME_MASK_ACK               = 0xe0,
     FRAME_TYPE_ACK               = 0xa0, // 101. ....
@@ -247,7 +594,8 @@ public:
     FRAME_TYPE_BLOCKED_LENGTH           = 1,
     FRAME_TYPE_STREAM_BLOCKED_LENGTH    = 5,
     FRAME_TYPE_STREAM_ID_NEEDED_LENGTH  = 1,
-    FRAME_TYPE_NEW_CONNECTION_ID_LENGTH = 11
+    FRAME_TYPE_NEW_CONNECTION_ID_LENGTH = 11,
+    FRAME_TYPE_RETRY_TOKEN_LENGTH       = 1 + kRetryTokenLength
   };
 
   enum LongHeaderType {
@@ -263,6 +611,8 @@ public:
   };
 
 private:
+  friend class FrameParserBench; // test/bench.cpp
+
   class LongHeaderData
   {
   public:
@@ -7,6 +7,7 @@
 #include "MozQuicInternal.h"
 #include "MozQuicStream.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -19,6 +20,7 @@ MozQuicStreamPair::MozQuicStreamPair(uint32_t id, MozQuicWriter *w, MozQuic *m)
   , mOut(id, w)
   , mIn(id)
   , mMozQuic(m)
+  , mDeletePending(false)
 {
 }
 
@@ -32,8 +34,52 @@ MozQuicStreamPair::Done()
   return mOut.Done() && mIn.Done();
 }
 
+uint32_t
+MozQuicStreamPair::Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool &fin)
+{
+  uint32_t rv = mIn.Read(buffer, avail, amt, fin);
+  if ((rv == MOZQUIC_OK) && amt && mStreamID) {
+    mMozQuic->StreamDataConsumed(this, amt);
+  }
+  return rv;
+}
+
+uint32_t
+MozQuicStreamPair::ReadUnordered(unsigned char *buffer, uint32_t avail, uint64_t &offset,
+                                 uint32_t &amt, bool &fin)
+{
+  uint32_t rv = mIn.ReadUnordered(buffer, avail, offset, amt, fin);
+  if ((rv == MOZQUIC_OK) && amt && mStreamID) {
+    mMozQuic->StreamDataConsumed(this, amt);
+  }
+  return rv;
+}
+
+uint32_t
+MozQuicStreamPair::Write(const unsigned char *data, uint32_t len, bool fin)
+{
+  if (!mOut.Done() && len && mStreamID && !mMozQuic->SendBufferOpen(this, len)) {
+    return MOZQUIC_ERR_WOULD_BLOCK;
+  }
+  uint32_t rv = mOut.Write(data, len, fin);
+  if ((rv == MOZQUIC_OK) && len && mStreamID) {
+    mMozQuic->StreamDataWritten(len);
+    if (mOut.Holding() && !mOut.mCorkDeadline) {
+      mMozQuic->CorkHeld(this);
+    }
+  }
+  return rv;
+}
+
 MozQuicStreamIn::MozQuicStreamIn(uint32_t id)
-  : mOffset(0)
+  : mUnordered(false)
+  , mReadLowat(1)
+  , mReadQueued(false)
+  , mFlowControlLimit(MozQuic::kInitialMaxStreamData)
+  , mMaxOffsetRecvd(0)
+  , mWindow(MozQuic::kInitialMaxStreamData)
+  , mLastWindowUpdate(0)
+  , mOffset(0)
   , mFinOffset(0)
   , mFinRecvd(false)
   , mFinGivenToApp(false)
@@ -49,6 +95,9 @@ uint32_t
 MozQuicStreamIn::Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool &fin)
 {
   amt = 0;
+  if (mUnordered) {
+    return MOZQUIC_ERR_INVALID;
+  }
   if (mFinRecvd && mFinOffset == mOffset) {
     fin = true;
     mFinGivenToApp = true;
@@ -86,6 +135,89 @@ MozQuicStreamIn::Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool
   return MOZQUIC_OK;
 }
 
+uint32_t
+MozQuicStreamIn::ReadUnordered(unsigned char *buffer, uint32_t avail, uint64_t &offset,
+                               uint32_t &amt, bool &fin)
+{
+  offset = mOffset;
+  if (!mUnordered) {
+    return Read(buffer, avail, amt, fin);
+  }
+
+  amt = 0;
+  fin = false;
+  auto i = mAvailable.begin();
+  while ((i != mAvailable.end()) &&
+         (!(*i)->mData || !(*i)->mLen || (((*i)->mOffset + (*i)->mLen) <= mOffset))) {
+    i++;
+  }
+  if (i != mAvailable.end()) {
+    MozQuicStreamChunk *chunk = (*i).get();
+    uint64_t skip = (mOffset > chunk->mOffset) ? (mOffset - chunk->mOffset) : 0;
+    uint32_t copyLen = std::min<uint64_t>(chunk->mLen - skip, avail);
+    memcpy(buffer, chunk->mData.get() + skip, copyLen);
+    offset = chunk->mOffset + skip;
+    amt = copyLen;
+
+    uint32_t used = skip + copyLen;
+    if (used < chunk->mLen) {
+      // keep the part that did not fit
+      std::unique_ptr<MozQuicStreamChunk>
+        rest(new MozQuicStreamChunk(chunk->mStreamID, chunk->mOffset + used,
+                                    chunk->mData.get() + used, chunk->mLen - used, false));
+      if (chunk->Account()) {
+        rest->Charge(chunk->Account());
+      }
+      mAvailable.insert(std::next(i), std::move(rest));
+      chunk->mLen = used;
+    }
+    chunk->Discard();
+  }
+
+  // read ranges at the front extend the in order part
+  while (!mAvailable.empty()) {
+    MozQuicStreamChunk *front = mAvailable.front().get();
+    uint64_t endData = front->mOffset + front->mLen;
+    if (endData > mOffset) {
+      if (front->mData || (front->mOffset > mOffset)) {
+        break;
+      }
+      mOffset = endData;
+    }
+    mAvailable.pop_front();
+  }
+
+  if (mFinRecvd && mFinOffset == mOffset) {
+    fin = true;
+    mFinGivenToApp = true;
+  }
+  return MOZQUIC_OK;
+}
+
+uint64_t
+MozQuicStreamIn::Readable()
+{
+  if (mUnordered) {
+    uint64_t rv = 0;
+    for (auto i = mAvailable.begin(); i != mAvailable.end(); ++i) {
+      uint64_t endData = (*i)->mOffset + (*i)->mLen;
+      if ((*i)->mData && (endData > mOffset)) {
+        rv += endData - std::max((*i)->mOffset, mOffset);
+      }
+    }
+    return rv;
+  }
+
+  uint64_t pos = mOffset;
+  for (auto i = mAvailable.begin(); i != mAvailable.end(); ++i) {
+    if ((*i)->mOffset > pos) {
+      break;
+    }
+    pos = std::max(pos, (*i)->mOffset + (*i)->mLen);
+  }
+  return pos - mOffset;
+}
+
 uint32_t
 MozQuicStreamIn::Supply(std::unique_ptr<MozQuicStreamChunk> &d)
 {
@@ -159,6 +291,9 @@ MozQuicStreamIn::Supply(std::unique_ptr<MozQuicStreamChunk> &d)
                                         d->mData.get() + skip,
                                         d->mLen - skip, false));
       d->mLen = skip;
+      if (d->Account()) {
+        newChunk->Charge(d->Account());
+      }
 
       // todo log
       // append it to the right
@@ -193,6 +328,15 @@ MozQuicStreamIn::Empty()
     return true;
   }
 
+  if (mUnordered) {
+    for (auto i = mAvailable.begin(); i != mAvailable.end(); ++i) {
+      if ((*i)->mData && (((*i)->mOffset + (*i)->mLen) > mOffset)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
   auto i = mAvailable.begin();
   if ((*i)->mOffset > mOffset) {
     return true;
@@ -202,10 +346,23 @@ MozQuicStreamIn::Empty()
 }
     
 MozQuicStreamOut::MozQuicStreamOut(uint32_t id, MozQuicWriter *w)
-  : mWriter(w)
+  : mFlowControlLimit(MozQuic::kInitialMaxStreamData)
+  , mOffsetSent(0)
+  , mBlockedAt(0)
+  , mFinSent(false)
+  , mUrgency(MozQuic::kDefaultUrgency)
+  , mWeight(MozQuic::kDefaultWeight)
+  , mIncremental(true)
+  , mVirtualTime(0)
+  , mScheduleKey(0)
+  , mWantWritable(false)
+  , mCorked(false)
+  , mCorkDeadline(0)
+  , mWriter(w)
   , mStreamID(id)
   , mOffset(0)
   , mFin(false)
+  , mCorkLen(0)
 {
 }
 
@@ -220,12 +377,72 @@ MozQuicStreamOut::Write(const unsigned char *data, uint32_t len, bool fin)
     return MOZQUIC_ERR_ALREADY_FINISHED;
   }
 
+  if (mCorked && (len < MozQuic::kCorkSize)) {
+    while (len) {
+      if (!mCorkData) {
+        mCorkData.reset(new unsigned char[MozQuic::kCorkSize]);
+      }
+      uint32_t amt = std::min(len, MozQuic::kCorkSize - mCorkLen);
+      memcpy(mCorkData.get() + mCorkLen, data, amt);
+      mCorkLen += amt;
+      mOffset += amt;
+      data += amt;
+      len -= amt;
+      if (mCorkLen == MozQuic::kCorkSize) {
+        uint32_t rv = FlushCork(false);
+        if (rv != MOZQUIC_OK) {
+          return rv;
+        }
+      }
+    }
+    mFin = fin;
+    if (fin) {
+      return FlushCork(true);
+    }
+    return MOZQUIC_OK;
+  }
+
+  // a large write goes out on its own, after what the cork holds
+  uint32_t rv = FlushCork(false);
+  if (rv != MOZQUIC_OK) {
+    return rv;
+  }
   std::unique_ptr<MozQuicStreamChunk> tmp(new MozQuicStreamChunk(mStreamID, mOffset, data, len, fin));
   mOffset += len;
   mFin = fin;
   return mWriter->DoWriter(tmp);
 }
 
+// queues what the cork holds as one chunk. With fin it always queues one,
+// even if it is empty
+uint32_t
+MozQuicStreamOut::FlushCork(bool fin)
+{
+  mCorkDeadline = 0;
+  if (!mCorkLen && !fin) {
+    return MOZQUIC_OK;
+  }
+  std::unique_ptr<MozQuicStreamChunk>
+    tmp(new MozQuicStreamChunk(mStreamID, mOffset - mCorkLen, mCorkData.get(), mCorkLen, fin));
+  mCorkLen = 0;
+  if (!mCorked) {
+    mCorkData.reset();
+  }
+  return mWriter->DoWriter(tmp);
+}
+
+uint32_t
+MozQuicStreamOut::SetPriority(uint8_t urgency, uint16_t weight, bool incremental)
+{
+  if ((urgency > MozQuic::kMaxUrgency) || !weight || (weight > MozQuic::kMaxWeight)) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  mUrgency = urgency;
+  mWeight = weight;
+  mIncremental = incremental;
+  return MOZQUIC_OK;
+}
+
 int
 MozQuicStreamOut::EndStream()
 {
@@ -233,9 +450,7 @@ MozQuicStreamOut::EndStream()
     return MOZQUIC_ERR_ALREADY_FINISHED;
   }
   mFin = true;
-
-  std::unique_ptr<MozQuicStreamChunk> tmp(new MozQuicStreamChunk(mStreamID, mOffset, nullptr, 0, true));
-  return mWriter->DoWriter(tmp);
+  return FlushCork(true);
 }
 
 MozQuicStreamChunk::MozQuicStreamChunk(uint32_t id, uint64_t offset,
@@ -246,10 +461,13 @@ MozQuicStreamChunk::MozQuicStreamChunk(uint32_t id, uint64_t offset,
   , mStreamID(id)
   , mOffset(offset)
   , mFin(fin)
+  , mType(MozQuic::FRAME_TYPE_STREAM)
   , mTransmitTime(0)
   , mTransmitCount(1)
   , mRetransmitted(false)
   , mTransmitKeyPhase(keyPhaseUnknown)
+  , mAccount(nullptr)
+  , mCharged(0)
 {
   if ((0xfffffffffffffffe - offset) < len) {
     // todo should not silently truncate like this
@@ -259,22 +477,69 @@ MozQuicStreamChunk::MozQuicStreamChunk(uint32_t id, uint64_t offset,
   memcpy((void *)mData.get(), data, len);
 }
 
+MozQuicStreamChunk::MozQuicStreamChunk(uint8_t frameType, uint32_t id, uint64_t value)
+  : mData(new unsigned char[0])
+  , mLen(0)
+  , mStreamID(id)
+  , mOffset(value)
+  , mFin(false)
+  , mType(frameType)
+  , mTransmitTime(0)
+  , mTransmitCount(1)
+  , mRetransmitted(false)
+  , mTransmitKeyPhase(keyPhaseUnknown)
+  , mAccount(nullptr)
+  , mCharged(0)
+{
+}
+
 MozQuicStreamChunk::MozQuicStreamChunk(MozQuicStreamChunk &orig)
   : mLen(orig.mLen)
   , mStreamID(orig.mStreamID)
   , mOffset(orig.mOffset)
   , mFin(orig.mFin)
+  , mType(orig.mType)
   , mTransmitTime(0)
   , mTransmitCount(orig.mTransmitCount + 1)
   , mRetransmitted(false)
   , mTransmitKeyPhase(keyPhaseUnknown)
+  , mAccount(nullptr)
+  , mCharged(0)
 {
   mData = std::move(orig.mData);
+  mAccount = orig.mAccount;
+  mCharged = orig.mCharged;
+  orig.mAccount = nullptr;
+  orig.mCharged = 0;
 }
 
-
 MozQuicStreamChunk::~MozQuicStreamChunk()
 {
+  if (mAccount) {
+    mAccount->Release(mCharged);
+  }
+}
+
+void
+MozQuicStreamChunk::Discard()
+{
+  mData.reset();
+  if (mAccount) {
+    mAccount->Release(mCharged);
+    mAccount = nullptr;
+    mCharged = 0;
+  }
+}
+
+void
+MozQuicStreamChunk::Charge(MemoryAccount *account)
+{
+  if (mAccount || !mLen) {
+    return;
+  }
+  mAccount = account;
+  mCharged = mLen;
+  mAccount->Charge(mCharged);
 }
 
 } // namespace
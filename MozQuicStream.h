@@ -19,22 +19,63 @@ enum keyPhase {
   keyPhase1Rtt
 };
 
+// bytes of stream data a connection holds in its send and receive
+// buffers. A server child's account also charges its parent's, which is
+// where the budget is, see MozQuic::kDefaultMemoryBudget
+struct MemoryAccount
+{
+  MemoryAccount() : mBytes(0), mParent(nullptr) {}
+
+  void Charge(uint64_t amt)
+  {
+    mBytes += amt;
+    if (mParent) {
+      mParent->mBytes += amt;
+    }
+  }
+
+  void Release(uint64_t amt)
+  {
+    mBytes -= amt;
+    if (mParent) {
+      mParent->mBytes -= amt;
+    }
+  }
+
+  uint64_t       mBytes;
+  MemoryAccount *mParent;
+};
+
 class MozQuicStreamChunk
 {
 public:
   MozQuicStreamChunk(uint32_t id, uint64_t offset, const unsigned char *data,
                      uint32_t len, bool fin);
 
-  // This form of ctor steals the data pointer. used for retransmit
+  // control frames (MAX_DATA, MAX_STREAM_DATA, BLOCKED, STREAM_BLOCKED)
+  // are queued as zero length chunks so they are retransmitted by the same
+  // machinery as stream data. mOffset carries the frame's value.
+  MozQuicStreamChunk(uint8_t frameType, uint32_t id, uint64_t value);
+
+  // This form of ctor steals the data pointer (and its charge). used for
+  // retransmit
   MozQuicStreamChunk(MozQuicStreamChunk &);
 
   ~MozQuicStreamChunk();
 
+  // mData counts against account until the chunk is freed. a no-op if it
+  // already does
+  void Charge(MemoryAccount *account);
+  MemoryAccount *Account() { return mAccount; }
+  // frees mData (and its charge), keeping the range it covered
+  void Discard();
+
   std::unique_ptr<const unsigned char []>mData;
   uint32_t mLen;
   uint32_t mStreamID;
   uint64_t mOffset;
   bool     mFin;
+  uint8_t  mType; // MozQuic::FrameType, FRAME_TYPE_STREAM for data
 
   // when unacked these are set
   uint64_t mPacketNumber;
@@ -42,6 +83,10 @@ public:
   uint16_t mTransmitCount;
   bool     mRetransmitted; // no data after retransmitted
   enum keyPhase mTransmitKeyPhase;
+
+private:
+  MemoryAccount *mAccount;
+  uint32_t       mCharged;
 };
 
 class MozQuicWriter 
@@ -63,11 +108,46 @@ public:
     return mFin;
   }
 
+  // flow control state, managed by MozQuic when the data is framed
+  uint64_t mFlowControlLimit; // from the peer's MAX_STREAM_DATA
+  uint64_t mOffsetSent;       // highest offset framed so far
+  uint64_t mBlockedAt;        // limit we last sent STREAM_BLOCKED for
+  bool     mFinSent;
+
+  // scheduling. lower urgency is served first. within an urgency,
+  // sequential streams go in stream id order and then incremental streams
+  // share by weight. mVirtualTime advances by bytes/weight as data is framed.
+  uint32_t SetPriority(uint8_t urgency, uint16_t weight, bool incremental);
+  uint8_t  mUrgency;
+  uint16_t mWeight;
+  bool     mIncremental;
+  uint64_t mVirtualTime;
+
+  // chunks queued by MozQuic::DoWriter and not framed yet, in offset
+  // order. While it is not empty the stream is in MozQuic::mSchedule
+  // under mScheduleKey
+  std::list<std::unique_ptr<MozQuicStreamChunk>> mUnWritten;
+  uint64_t mScheduleKey;
+
+  // written by the app but not framed yet
+  uint64_t Buffered() { return mOffset - mOffsetSent; }
+  bool     mWantWritable; // a write was refused, MOZQUIC_EVENT_STREAM_WRITABLE is owed
+
+  // corking, see MozQuic::SetCork. small writes are gathered into chunks
+  // of kCorkSize
+  uint32_t FlushCork(bool fin);
+  bool     Holding() { return mCorkLen; }
+  bool     mCorked;
+  uint64_t mCorkDeadline; // held data goes out anyway, 0 when nothing is held
+
 private:
   MozQuicWriter *mWriter;
   uint32_t mStreamID;
   uint64_t mOffset;
   bool mFin;
+
+  std::unique_ptr<unsigned char []> mCorkData;
+  uint32_t mCorkLen;
 };
 
 class MozQuicStreamIn
@@ -76,6 +156,10 @@ public:
   MozQuicStreamIn(uint32_t id);
   ~MozQuicStreamIn();
   uint32_t Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool &fin);
+  // gives the offset of what it returns. on an unordered stream that is
+  // whatever has arrived, see mUnordered
+  uint32_t ReadUnordered(unsigned char *buffer, uint32_t avail, uint64_t &offset,
+                         uint32_t &amt, bool &fin);
   uint32_t Supply(std::unique_ptr<MozQuicStreamChunk> &p);
   bool     Empty();
 
@@ -83,6 +167,29 @@ public:
     return (mOffset == mFinOffset) && mFinGivenToApp;
   }
 
+  uint64_t Offset() { return mOffset; } // consumed by the app, in order
+
+  // data is given to the app as it arrives. What has been read stays in
+  // mAvailable without its data, so retransmissions of it are dropped,
+  // until mOffset (everything before it has been read) passes it.
+  bool     mUnordered;
+
+  // bytes that can be read now, and whether that is everything up to fin
+  uint64_t Readable();
+  bool     FinReadable(uint64_t readable) {
+    return mFinRecvd && ((mOffset + readable) == mFinOffset);
+  }
+
+  // see MozQuic::NotifyReadable
+  uint32_t mReadLowat;
+  bool     mReadQueued;
+
+  // flow control state, managed by MozQuic
+  uint64_t mFlowControlLimit; // what we have advertised to the peer
+  uint64_t mMaxOffsetRecvd;
+  uint64_t mWindow;
+  uint64_t mLastWindowUpdate;
+
 private:
   uint64_t mOffset;
   uint64_t mFinOffset;
@@ -105,18 +212,31 @@ public:
   }
 
   // todo it would be nice to have a zero copy interface
-  uint32_t Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool &fin) {
-    return mIn.Read(buffer, avail, amt, fin);
+  uint32_t Read(unsigned char *buffer, uint32_t avail, uint32_t &amt, bool &fin);
+  uint32_t ReadUnordered(unsigned char *buffer, uint32_t avail, uint64_t &offset,
+                         uint32_t &amt, bool &fin);
+
+  uint32_t SetUnordered() {
+    if (!mStreamID) {
+      return MOZQUIC_ERR_INVALID;
+    }
+    mIn.mUnordered = true;
+    return MOZQUIC_OK;
   }
 
   bool Empty() {
     return mIn.Empty();
   }
 
-  uint32_t Write(const unsigned char *data, uint32_t len, bool fin) {
-    return mOut.Write(data, len, fin);
+  uint32_t SetReadLowat(uint32_t bytes) {
+    mIn.mReadLowat = bytes ? bytes : 1;
+    return MOZQUIC_OK;
   }
 
+  // MOZQUIC_ERR_WOULD_BLOCK while the send buffer is full, see
+  // MozQuic::SendBufferOpen
+  uint32_t Write(const unsigned char *data, uint32_t len, bool fin);
+
   int EndStream() {
     return mOut.EndStream();
   }
@@ -129,6 +249,7 @@ public:
   MozQuicStreamOut mOut;
   MozQuicStreamIn  mIn;
   MozQuic *mMozQuic;
+  bool     mDeletePending; // app is done but the fin has not been framed yet
 };
 
 } //namespace
@@ -6,6 +6,7 @@
 #include "MozQuic.h"
 #include "MozQuicInternal.h"
 #include "NSSHelper.h"
+#include "HandshakeWorkers.h"
 #include "nss.h"
 #include "ssl.h"
 #include "sslproto.h"
@@ -13,7 +14,11 @@
 #include "certdb.h"
 #include "pk11pub.h"
 #include "secmod.h"
+#include "sslexp.h"
 #include "assert.h"
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 
 #if NSS_VMAJOR < 3 || (NSS_VMINOR < 32 && NSS_VMAJOR == 3)
@@ -198,6 +203,44 @@ static bool mozQuicInit = false;
 static PRDescIdentity nssHelperIdentity;
 static PRIOMethods nssHelperMethods;
 
+// client session tickets by origin:port. connections may live on
+// different threads so the cache is locked
+static std::mutex ticketCacheLock;
+static std::unordered_map<std::string, std::vector<unsigned char>> ticketCache;
+
+// shared by every server connection in the process, so a replayed client
+// hello is caught whichever connection it lands on
+static SSLAntiReplayContext *antiReplayContext = nullptr;
+static std::once_flag antiReplayOnce;
+
+static std::string
+TicketCacheKey(const char *originName, int originPort)
+{
+  return std::string(originName) + ":" + std::to_string(originPort);
+}
+
+// a client resumption token carries the resumption secret wrapped with
+// the internal slot's wrapping key. nss makes that key up the first time
+// it caches a session and never writes it anywhere, so an exported ticket
+// carries it too: 4 bytes of key mechanism, 1 byte of key length, the key
+// and then the token
+static PK11SymKey *
+SlotWrapKey(PK11SlotInfo *slot)
+{
+  return PK11_GetWrapKey(slot, PK11_GetCurrentWrapIndex(slot), CKM_INVALID_MECHANISM,
+                         PK11_GetSlotSeries(slot), nullptr);
+}
+
+static SECItem *
+WrapKeyData(PK11SymKey *key)
+{
+  if (PK11_ExtractKeyValue(key) != SECSuccess) {
+    return nullptr;
+  }
+  SECItem *data = PK11_GetKeyData(key);
+  return (data && data->len && (data->len < 256)) ? data : nullptr;
+}
+
 int
 NSSHelper::Init(char *dir)
 {
@@ -210,25 +253,29 @@ NSSHelper::Init(char *dir)
 
   nssHelperMethods.getpeername = NSPRGetPeerName;
   nssHelperMethods.getsocketoption = NSPRGetSocketOption;
+  nssHelperMethods.setsocketoption = NSPRSetSocketOption;
   nssHelperMethods.connect = nssHelperConnect;
   nssHelperMethods.write = nssHelperWrite;
   nssHelperMethods.send = nssHelperSend;
   nssHelperMethods.recv = nssHelperRecv;
   nssHelperMethods.read = nssHelperRead;
+  nssHelperMethods.close = nssHelperClose;
+  nssHelperMethods.shutdown = nssHelperShutdown;
 
   return (NSS_Init(dir) == SECSuccess) ? MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
 }
 
 uint32_t
 NSSHelper::MakeKeyFromRaw(unsigned char *initialSecret,
-                          unsigned int secretSize, SSLHashType hashType,
+                          unsigned int secretSize, unsigned int keySize, SSLHashType hashType,
                           CK_MECHANISM_TYPE importMechanism1, CK_MECHANISM_TYPE importMechanism2,
                           unsigned char *outIV, PK11SymKey **outKey)
 {
   PK11SymKey *finalKey = nullptr;
   PK11SymKey *secretSKey = nullptr;
-  unsigned char ppKey[16]; // all currently defined aead algorithms have key length of 16
+  unsigned char ppKey[32];
   assert (secretSize <= 48);
+  assert (keySize <= sizeof(ppKey));
 
   PK11SlotInfo *slot = PK11_GetInternalSlot();
   {
@@ -244,7 +291,7 @@ NSSHelper::MakeKeyFromRaw(unsigned char *initialSecret,
 
   if (tls13_HkdfExpandLabelRaw(secretSKey, hashType,
                                (const unsigned char *)"", 0, "key", 3,
-                               ppKey, sizeof(ppKey)) != SECSuccess) {
+                               ppKey, keySize) != SECSuccess) {
     goto failure;
   }
 
@@ -259,7 +306,7 @@ NSSHelper::MakeKeyFromRaw(unsigned char *initialSecret,
   }
 
   {
-    SECItem ppKey_item = {siBuffer, ppKey, sizeof(ppKey)};
+    SECItem ppKey_item = {siBuffer, ppKey, keySize};
     finalKey = PK11_ImportSymKey(slot, importMechanism2, PK11_OriginUnwrap,
                                  CKA_DERIVE, &ppKey_item, NULL);
   }
@@ -284,20 +331,24 @@ failure:
 }
 
 uint32_t
-NSSHelper::MakeKeyFromNSS(PRFileDesc *fd, const char *label,
-                          unsigned int secretSize, SSLHashType hashType,
+NSSHelper::MakeKeyFromNSS(PRFileDesc *fd, const char *label, bool early,
+                          unsigned int secretSize, unsigned int keySize, SSLHashType hashType,
                           CK_MECHANISM_TYPE importMechanism1, CK_MECHANISM_TYPE importMechanism2,
                           unsigned char *outIV, PK11SymKey **outKey)
 {
   unsigned char initialSecret[48];
   assert (secretSize <= 48);
 
-  if (SSL_ExportKeyingMaterial(fd, label, strlen (label),
-                               false, (const unsigned char *)"", 0, initialSecret, secretSize) != SECSuccess) {
+  SECStatus rv = early ?
+    SSL_ExportEarlyKeyingMaterial(fd, label, strlen (label),
+                                  (const unsigned char *)"", 0, initialSecret, secretSize) :
+    SSL_ExportKeyingMaterial(fd, label, strlen (label),
+                             false, (const unsigned char *)"", 0, initialSecret, secretSize);
+  if (rv != SECSuccess) {
     return MOZQUIC_ERR_CRYPTO;
   }
   
-  return MakeKeyFromRaw(initialSecret, secretSize, hashType, importMechanism1,
+  return MakeKeyFromRaw(initialSecret, secretSize, keySize, hashType, importMechanism1,
                         importMechanism2, outIV, outKey);
 }
 
@@ -321,34 +372,139 @@ NSSHelper::HandshakeSecret(unsigned int ciphersuite,
     return MOZQUIC_ERR_CRYPTO;
   }
 
-  unsigned int secretSize;
+  unsigned int secretSize, keySize;
   SSLHashType hashType;
   CK_MECHANISM_TYPE importMechanism1, importMechanism2;
 
-  GetKeyParamsFromCipherSuite(nssSuite, secretSize, hashType, mPacketProtectionMech,
+  GetKeyParamsFromCipherSuite(nssSuite, secretSize, keySize, hashType, mPacketProtectionMech,
                               importMechanism1, importMechanism2);
       
   bool didHandshakeFail = 
-    MakeKeyFromRaw(mExternalSendSecret, secretSize, hashType, importMechanism1,
+    MakeKeyFromRaw(mExternalSendSecret, secretSize, keySize, hashType, importMechanism1,
                    importMechanism2, mPacketProtectionSenderIV0, &mPacketProtectionSenderKey0) != MOZQUIC_OK;
   memset(mExternalSendSecret, 0, sizeof(mExternalSendSecret));
 
 
   didHandshakeFail = didHandshakeFail ||
-    MakeKeyFromRaw(mExternalRecvSecret, secretSize, hashType, importMechanism1,
+    MakeKeyFromRaw(mExternalRecvSecret, secretSize, keySize, hashType, importMechanism1,
                    importMechanism2, mPacketProtectionReceiverIV0, &mPacketProtectionReceiverKey0) != MOZQUIC_OK;
   memset(mExternalSendSecret, 0, sizeof(mExternalRecvSecret));
   
   mHandshakeComplete = true;
+  if (!didHandshakeFail) {
+    InstallPacketProtection(nssSuite);
+    didHandshakeFail = !mPacketProtectionSender0 || !mPacketProtectionReceiver0;
+  }
   if (didHandshakeFail) {
     mHandshakeFailed = true;
   }
   return didHandshakeFail ? MOZQUIC_ERR_CRYPTO : MOZQUIC_OK;
 }
 
+// hand a derived key to a packet protection backend, which takes ownership
+// of it. The builtin one is opt in and needs the raw key bytes, nss keeps
+// using the PK11SymKey.
+PacketProtection *
+NSSHelper::MakePacketProtection(uint16_t cipherSuite, PK11SymKey *key, const unsigned char *iv,
+                                bool encrypt)
+{
+  if (key && mQuicSession->BuiltinPacketProtection() &&
+      PacketProtection::BuiltinAvailable(cipherSuite) &&
+      (PK11_ExtractKeyValue(key) == SECSuccess)) {
+    SECItem *raw = PK11_GetKeyData(key);
+    PacketProtection *rv = raw ?
+      PacketProtection::CreateBuiltin(cipherSuite, raw->data, raw->len, iv) : nullptr;
+    if (rv) {
+      PK11_FreeSymKey(key);
+      return rv;
+    }
+  }
+  return PacketProtection::CreateNSS(cipherSuite, key, iv, encrypt);
+}
+
+void
+NSSHelper::InstallPacketProtection(uint16_t cipherSuite)
+{
+  mPacketProtectionSender0.reset(
+    MakePacketProtection(cipherSuite, mPacketProtectionSenderKey0, mPacketProtectionSenderIV0,
+                         true));
+  mPacketProtectionSenderKey0 = nullptr;
+  mPacketProtectionReceiver0.reset(
+    MakePacketProtection(cipherSuite, mPacketProtectionReceiverKey0, mPacketProtectionReceiverIV0,
+                         false));
+  mPacketProtectionReceiverKey0 = nullptr;
+  if (mPacketProtectionSender0) {
+    fprintf(stderr,"packet protection using %s\n", mPacketProtectionSender0->Name());
+  }
+}
+
+// the client's early key exists as soon as it has written a hello that
+// offers early data, the server's once it has accepted that offer
+void
+NSSHelper::InstallEarlyPacketProtection()
+{
+  if (mPacketProtectionEarly || mHandshakeComplete) {
+    return;
+  }
+  SSLPreliminaryChannelInfo info;
+  if ((SSL_GetPreliminaryChannelInfo(mFD, &info, sizeof(info)) != SECSuccess) ||
+      !(info.valuesSet & ssl_preinfo_0rtt_cipher_suite)) {
+    return;
+  }
+
+  unsigned int secretSize, keySize;
+  SSLHashType hashType;
+  CK_MECHANISM_TYPE packetMechanism, importMechanism1, importMechanism2;
+  GetKeyParamsFromCipherSuite(info.zeroRttCipherSuite, secretSize, keySize, hashType,
+                              packetMechanism, importMechanism1, importMechanism2);
+  PK11SymKey *key = nullptr;
+  unsigned char iv[12];
+  if (MakeKeyFromNSS(mFD, "EXPORTER-QUIC 0-RTT Secret", true,
+                     secretSize, keySize, hashType, importMechanism1, importMechanism2,
+                     iv, &key) != MOZQUIC_OK) {
+    return;
+  }
+  // the client seals early data, the server opens it
+  mPacketProtectionEarly.reset(MakePacketProtection(info.zeroRttCipherSuite, key, iv, mIsClient));
+  fprintf(stderr,"0-rtt packet protection ready\n");
+}
+
+// the server's application secrets are known as soon as its flight is
+// written, so it can answer early data without waiting for the client's
+// finished (0.5-rtt). what it receives stays 0-rtt until the handshake
+// is done.
+void
+NSSHelper::InstallHalfRTTSender()
+{
+  if (mIsClient || mHandshakeComplete || mPacketProtectionSender0) {
+    return;
+  }
+  SSLPreliminaryChannelInfo info;
+  if ((SSL_GetPreliminaryChannelInfo(mFD, &info, sizeof(info)) != SECSuccess) ||
+      !(info.valuesSet & ssl_preinfo_cipher_suite)) {
+    return;
+  }
+
+  unsigned int secretSize, keySize;
+  SSLHashType hashType;
+  CK_MECHANISM_TYPE packetMechanism, importMechanism1, importMechanism2;
+  GetKeyParamsFromCipherSuite(info.cipherSuite, secretSize, keySize, hashType,
+                              packetMechanism, importMechanism1, importMechanism2);
+  PK11SymKey *key = nullptr;
+  unsigned char iv[12];
+  if (MakeKeyFromNSS(mFD, "EXPORTER-QUIC server 1-RTT Secret", false,
+                     secretSize, keySize, hashType, importMechanism1, importMechanism2,
+                     iv, &key) != MOZQUIC_OK) {
+    return;
+  }
+  mPacketProtectionSender0.reset(MakePacketProtection(info.cipherSuite, key, iv, true));
+  fprintf(stderr,"0.5-rtt packet protection ready\n");
+}
+
 void
 NSSHelper::GetKeyParamsFromCipherSuite(uint16_t cipherSuite,
                                        unsigned int &secretSize,
+                                       unsigned int &keySize,
                                        SSLHashType &hashType,
                                        CK_MECHANISM_TYPE &packetProtectionMech,
                                        CK_MECHANISM_TYPE &importMechanism1,
@@ -357,16 +513,19 @@ NSSHelper::GetKeyParamsFromCipherSuite(uint16_t cipherSuite,
   hashType = (cipherSuite == TLS_AES_256_GCM_SHA384) ? ssl_hash_sha384 : ssl_hash_sha256;
   if (cipherSuite == TLS_AES_128_GCM_SHA256) {
     secretSize = 32;
+    keySize = 16;
     packetProtectionMech = CKM_AES_GCM;
     importMechanism1 = CKM_NSS_HKDF_SHA256;
     importMechanism2 = CKM_AES_KEY_GEN;
   } else if (cipherSuite == TLS_AES_256_GCM_SHA384) {
     secretSize = 48;
+    keySize = 32;
     packetProtectionMech = CKM_AES_GCM;
     importMechanism1 = CKM_NSS_HKDF_SHA384;
     importMechanism2 = CKM_AES_KEY_GEN;
   } else if (cipherSuite == TLS_CHACHA20_POLY1305_SHA256) {
     secretSize = 32;
+    keySize = 32;
     packetProtectionMech = CKM_NSS_CHACHA20_POLY1305;
     importMechanism1 = CKM_NSS_HKDF_SHA256;
     importMechanism2 = CKK_NSS_CHACHA20;
@@ -391,8 +550,9 @@ NSSHelper::HandshakeCallback(PRFileDesc *fd, void *client_data)
   assert(tmpFD);
   NSSHelper *self = reinterpret_cast<NSSHelper *>(tmpFD->secret);
   SSLHashType hashType;
-  unsigned int secretSize;
+  unsigned int secretSize, keySize;
   CK_MECHANISM_TYPE importMechanism1, importMechanism2;
+  SSLChannelInfo info;
 
   if (!self->mTolerateBadALPN &&
       (SSL_GetNextProto(fd, &state, buf, &bufLen, 256) != SECSuccess ||
@@ -401,41 +561,48 @@ NSSHelper::HandshakeCallback(PRFileDesc *fd, void *client_data)
     fprintf(stderr,"alpn fail\n");
     goto failure;
   } else {
-    SSLChannelInfo info;
-
     if (SSL_GetChannelInfo(fd, &info, sizeof(info)) != SECSuccess) {
       goto failure;
     } else {
+      self->mResumed = info.resumed;
+      self->mEarlyDataAccepted = info.earlyDataAccepted;
+      if (info.resumed) {
+        fprintf(stderr,"tls session resumed\n");
+      }
       GetKeyParamsFromCipherSuite(info.cipherSuite,
-                                  secretSize, hashType, self->mPacketProtectionMech,
+                                  secretSize, keySize, hashType, self->mPacketProtectionMech,
                                   importMechanism1, importMechanism2);
     }
   }
 
   if (self->mIsClient) {
-    if (self->MakeKeyFromNSS(fd, "EXPORTER-QUIC client 1-RTT Secret",
-                             secretSize, hashType, importMechanism1, importMechanism2,
+    if (self->MakeKeyFromNSS(fd, "EXPORTER-QUIC client 1-RTT Secret", false,
+                             secretSize, keySize, hashType, importMechanism1, importMechanism2,
                              self->mPacketProtectionSenderIV0, &self->mPacketProtectionSenderKey0) != MOZQUIC_OK) {
       didHandshakeFail = true;
     }
-    if (self->MakeKeyFromNSS(fd, "EXPORTER-QUIC server 1-RTT Secret",
-                             secretSize, hashType, importMechanism1, importMechanism2,
+    if (self->MakeKeyFromNSS(fd, "EXPORTER-QUIC server 1-RTT Secret", false,
+                             secretSize, keySize, hashType, importMechanism1, importMechanism2,
                              self->mPacketProtectionReceiverIV0, &self->mPacketProtectionReceiverKey0) != MOZQUIC_OK) {
       didHandshakeFail = true;
     }
   } else {
-    if (self->MakeKeyFromNSS(fd, "EXPORTER-QUIC server 1-RTT Secret",
-                             secretSize, hashType, importMechanism1, importMechanism2,
+    if (self->MakeKeyFromNSS(fd, "EXPORTER-QUIC server 1-RTT Secret", false,
+                             secretSize, keySize, hashType, importMechanism1, importMechanism2,
                              self->mPacketProtectionSenderIV0, &self->mPacketProtectionSenderKey0) != MOZQUIC_OK) {
       didHandshakeFail = true;
     }
-    if (self->MakeKeyFromNSS(fd, "EXPORTER-QUIC client 1-RTT Secret",
-                             secretSize, hashType, importMechanism1, importMechanism2,
+    if (self->MakeKeyFromNSS(fd, "EXPORTER-QUIC client 1-RTT Secret", false,
+                             secretSize, keySize, hashType, importMechanism1, importMechanism2,
                              self->mPacketProtectionReceiverIV0, &self->mPacketProtectionReceiverKey0) != MOZQUIC_OK) {
       didHandshakeFail = true;
     }
   }
   
+  if (!didHandshakeFail) {
+    self->InstallPacketProtection(info.cipherSuite);
+    didHandshakeFail = !self->mPacketProtectionSender0 || !self->mPacketProtectionReceiver0;
+  }
   self->mHandshakeComplete = true;
   if (didHandshakeFail) {
     self->mHandshakeFailed = true;
@@ -456,60 +623,21 @@ NSSHelper::BlockOperation(bool encrypt,
                           uint64_t packetNumber,
                           unsigned char *out, uint32_t outAvail, uint32_t &written)
   // for encrypt outAvail should be at least dataLen + 16 (for tag), for decrypt out should be at
-  // least dataLen - 16 (for tag removal)
+  // least dataLen - 16 (for tag removal). out may be the same as data to work in place
 {
-  assert(outAvail >= (dataLen + 16));
-  if (!mNSSReady || !mHandshakeComplete || mHandshakeFailed ||
-      !mPacketProtectionSenderKey0 || !mPacketProtectionReceiverKey0) {
+  assert(!encrypt || (outAvail >= (dataLen + 16)));
+  // a server can send (0.5-rtt) before its handshake is complete
+  if (!mNSSReady || !Settled() || mHandshakeFailed ||
+      (encrypt ? !mPacketProtectionSender0 :
+       (!mHandshakeComplete || !mPacketProtectionReceiver0))) {
     return MOZQUIC_ERR_GENERAL;
   }
 
-  CK_GCM_PARAMS gcmParams;
-  CK_NSS_AEAD_PARAMS polyParams;
-  unsigned char *params;
-  unsigned int paramsLength;
-  unsigned char nonce[12];
-  memcpy(nonce, encrypt ? mPacketProtectionSenderIV0 : mPacketProtectionReceiverIV0, 12);
-  packetNumber = PR_htonll(packetNumber);
-  unsigned char *tmp = (unsigned char *)&packetNumber;
-  for(int i = 0; i < 8; ++i) {
-    nonce[i + 4] ^= tmp[i];
-  }
-
-  if (mPacketProtectionMech == CKM_AES_GCM) {
-    params = (unsigned char *) &gcmParams;
-    paramsLength = sizeof(gcmParams);
-    memset(&gcmParams, 0, sizeof(gcmParams));
-    gcmParams.pIv = nonce;
-    gcmParams.ulIvLen = sizeof(nonce);
-    gcmParams.pAAD = aeadData;
-    gcmParams.ulAADLen = aeadLen;
-    gcmParams.ulTagBits = 128;
-  } else {
-    assert (mPacketProtectionMech == CKM_NSS_CHACHA20_POLY1305);
-    params = (unsigned char *) &polyParams;
-    paramsLength = sizeof(polyParams);
-    memset(&polyParams, 0, sizeof(polyParams));
-    polyParams.pNonce = nonce;
-    polyParams.ulNonceLen = sizeof(nonce);
-    polyParams.pAAD = aeadData;
-    polyParams.ulAADLen = aeadLen;
-    polyParams.ulTagLen = 16;
-  }
-
-  unsigned int enlen = 0;
-  SECItem param = {siBuffer, params, paramsLength};
-  uint32_t rv = MOZQUIC_OK;
-  if (encrypt) {
-    rv = PK11_Encrypt(mPacketProtectionSenderKey0, mPacketProtectionMech,
-                      &param, out, &enlen, outAvail,
-                      data, dataLen) == SECSuccess ? MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
-  } else {
-    rv = PK11_Decrypt(mPacketProtectionReceiverKey0, mPacketProtectionMech,
-                      &param, out, &enlen, outAvail,
-                      data, dataLen) == SECSuccess ? MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
-  }
-  written = enlen;
+  AEADBlock block = { aeadData, aeadLen, data, dataLen, packetNumber,
+                      out, outAvail, 0, MOZQUIC_OK };
+  uint32_t rv = encrypt ? mPacketProtectionSender0->Seal(&block, 1) :
+    mPacketProtectionReceiver0->Open(&block, 1);
+  written = block.written;
   return rv;
 }
 
@@ -537,6 +665,78 @@ NSSHelper::DecryptBlock(unsigned char *aeadData, uint32_t aeadLen,
                         packetNumber, out, outAvail, written);
 }
 
+uint32_t
+NSSHelper::EncryptBatch(AEADBlock *blocks, uint32_t count)
+{
+  if (!mNSSReady || !Settled() || mHandshakeFailed || !mPacketProtectionSender0) {
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].written = 0;
+      blocks[i].rv = MOZQUIC_ERR_GENERAL;
+    }
+    return MOZQUIC_ERR_GENERAL;
+  }
+  return mPacketProtectionSender0->Seal(blocks, count);
+}
+
+uint32_t
+NSSHelper::DecryptBatch(AEADBlock *blocks, uint32_t count)
+{
+  if (!mNSSReady || !Settled() || !mHandshakeComplete || mHandshakeFailed ||
+      !mPacketProtectionReceiver0) {
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].written = 0;
+      blocks[i].rv = MOZQUIC_ERR_GENERAL;
+    }
+    return MOZQUIC_ERR_GENERAL;
+  }
+  return mPacketProtectionReceiver0->Open(blocks, count);
+}
+
+uint32_t
+NSSHelper::EarlyEncryptBatch(AEADBlock *blocks, uint32_t count)
+{
+  if (!mIsClient || !mPacketProtectionEarly) {
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].written = 0;
+      blocks[i].rv = MOZQUIC_ERR_GENERAL;
+    }
+    return MOZQUIC_ERR_GENERAL;
+  }
+  return mPacketProtectionEarly->Seal(blocks, count);
+}
+
+uint32_t
+NSSHelper::EarlyDecryptBlock(unsigned char *aeadData, uint32_t aeadLen,
+                             unsigned char *ciphertext, uint32_t ciphertextLen,
+                             uint64_t packetNumber, unsigned char *out, uint32_t outAvail,
+                             uint32_t &written)
+{
+  written = 0;
+  if (mIsClient || !Settled() || !mPacketProtectionEarly) {
+    return MOZQUIC_ERR_GENERAL;
+  }
+  AEADBlock block = { aeadData, aeadLen, ciphertext, ciphertextLen, packetNumber,
+                      out, outAvail, 0, MOZQUIC_OK };
+  uint32_t rv = mPacketProtectionEarly->Open(&block, 1);
+  written = block.written;
+  return rv;
+}
+
+bool
+NSSHelper::EnableAntiReplay(uint32_t windowMS)
+{
+  std::call_once(antiReplayOnce, [windowMS]() {
+      // k and bits per sslexp.h for a 1% false positive rate at about
+      // 100k hellos per window. Two 128KB filters.
+      if (SSL_CreateAntiReplayContext(PR_Now(), (PRTime)windowMS * PR_USEC_PER_MSEC,
+                                      7, 20, &antiReplayContext) != SECSuccess) {
+        fprintf(stderr,"could not create 0-rtt anti-replay context\n");
+        antiReplayContext = nullptr;
+      }
+    });
+  return antiReplayContext != nullptr;
+}
+
 SECStatus
 NSSHelper::BadCertificate(void *client_data, PRFileDesc *fd)
 {
@@ -551,13 +751,95 @@ NSSHelper::BadCertificate(void *client_data, PRFileDesc *fd)
 }
 
 // server version
-NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *originKey)
+// the server side tls configuration, done once in StartServer. Options,
+// callbacks, alpn, the replay filter and the certificate all carry over
+// to each connection's socket in SSL_ImportFD(model, ..), so accepting a
+// connection does not go back to the cert db.
+PRFileDesc *
+NSSHelper::CreateServerModel(const char *originKey, bool enable0RTT)
+{
+  CERTCertificate *cert =
+    CERT_FindCertByNickname(CERT_GetDefaultCertDB(), originKey);
+  if (!cert) {
+    fprintf(stderr,"no certificate for %s\n", originKey);
+    return nullptr;
+  }
+  SECKEYPrivateKey *key = PK11_FindKeyByAnyCert(cert, nullptr);
+  if (!key) {
+    fprintf(stderr,"no key for %s\n", originKey);
+    CERT_DestroyCertificate(cert);
+    return nullptr;
+  }
+
+  PRFileDesc *model = PR_CreateIOLayerStub(nssHelperIdentity, &nssHelperMethods);
+  model->secret = nullptr;
+  PRFileDesc *sslModel = SSL_ImportFD(nullptr, model);
+  if (!sslModel) {
+    PR_Close(model);
+    SECKEY_DestroyPrivateKey(key);
+    CERT_DestroyCertificate(cert);
+    return nullptr;
+  }
+  model = sslModel;
+
+  SSL_OptionSet(model, SSL_SECURITY, true);
+  SSL_OptionSet(model, SSL_HANDSHAKE_AS_CLIENT, false);
+  SSL_OptionSet(model, SSL_HANDSHAKE_AS_SERVER, true);
+  SSL_OptionSet(model, SSL_ENABLE_RENEGOTIATION, SSL_RENEGOTIATE_NEVER);
+  // tls 1.3 tickets are sealed with nss's self encryption keys, which are
+  // made once per process and never rotated. They need no server side
+  // cache, any connection in the process can resume any other's, but no
+  // other process can. SSL_SetSessionTicketKeyPair doesn't replace them
+  // and reconfiguring the session id cache breaks later handshakes, so
+  // there is nothing here to rotate them with
+  SSL_OptionSet(model, SSL_NO_CACHE, true);
+  SSL_OptionSet(model, SSL_ENABLE_SESSION_TICKETS, true);
+  SSL_OptionSet(model, SSL_REQUEST_CERTIFICATE, false);
+  SSL_OptionSet(model, SSL_REQUIRE_CERTIFICATE, SSL_REQUIRE_NEVER);
+  // without a replay filter nss would reject all early data anyway
+  if (enable0RTT && antiReplayContext &&
+      (SSL_SetAntiReplayContext(model, antiReplayContext) == SECSuccess)) {
+    SSL_OptionSet(model, SSL_ENABLE_0RTT_DATA, true);
+  }
+
+  SSL_OptionSet(model, SSL_ENABLE_NPN, false);
+  SSL_OptionSet(model, SSL_ENABLE_ALPN, true);
+
+  SSLVersionRange range = {SSL_LIBRARY_VERSION_TLS_1_3,
+                           SSL_LIBRARY_VERSION_TLS_1_3};
+  SSL_VersionRangeSet(model, &range);
+  SSL_HandshakeCallback(model, HandshakeCallback, nullptr);
+
+  unsigned char buffer[256];
+  assert(strlen(mozquic_alpn) < 256);
+  buffer[0] = strlen(mozquic_alpn);
+  memcpy(buffer + 1, mozquic_alpn, strlen(mozquic_alpn));
+  SECStatus rv = SSL_SetNextProtoNego(model, buffer, strlen(mozquic_alpn) + 1);
+  if (rv == SECSuccess) {
+    rv = SSL_ConfigServerCert(model, cert, key, nullptr, 0);
+  }
+  // the model holds its own references
+  SECKEY_DestroyPrivateKey(key);
+  CERT_DestroyCertificate(cert);
+  if (rv != SECSuccess) {
+    PR_Close(model);
+    return nullptr;
+  }
+  return model;
+}
+
+NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, PRFileDesc *model)
   : mQuicSession(quicSession)
   , mNSSReady(false)
   , mHandshakeComplete(false)
   , mHandshakeFailed(false)
   , mIsClient(false)
   , mTolerateBadALPN(tolerateBadALPN)
+  , mResumed(false)
+  , mEarlyDataAccepted(false)
+  , mBusy(false)
+  , mWorkerInputOffset(0)
+  , mWorkerResult(MOZQUIC_OK)
   , mExternalCipherSuite(0)
   , mPacketProtectionSenderKey0(nullptr)
   , mPacketProtectionReceiverKey0(nullptr)
@@ -570,46 +852,13 @@ NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *ori
 
   mFD = PR_CreateIOLayerStub(nssHelperIdentity, &nssHelperMethods);
   mFD->secret = (struct PRFilePrivate *)this;
-  mFD = SSL_ImportFD(nullptr, mFD);
-  SSL_OptionSet(mFD, SSL_SECURITY, true);
-  SSL_OptionSet(mFD, SSL_HANDSHAKE_AS_CLIENT, false);
-  SSL_OptionSet(mFD, SSL_HANDSHAKE_AS_SERVER, true);
-  SSL_OptionSet(mFD, SSL_ENABLE_RENEGOTIATION, SSL_RENEGOTIATE_NEVER);
-  SSL_OptionSet(mFD, SSL_NO_CACHE, true);
-  SSL_OptionSet(mFD, SSL_ENABLE_SESSION_TICKETS, false);
-  SSL_OptionSet(mFD, SSL_REQUEST_CERTIFICATE, false);
-  SSL_OptionSet(mFD, SSL_REQUIRE_CERTIFICATE, SSL_REQUIRE_NEVER);
-
-  SSL_OptionSet(mFD, SSL_ENABLE_NPN, false);
-  SSL_OptionSet(mFD, SSL_ENABLE_ALPN, true);
-
-  SSLVersionRange range = {SSL_LIBRARY_VERSION_TLS_1_3,
-                           SSL_LIBRARY_VERSION_TLS_1_3};
-  SSL_VersionRangeSet(mFD, &range);
-  SSL_HandshakeCallback(mFD, HandshakeCallback, nullptr);
-
-  mNSSReady = true;
-
-  unsigned char buffer[256];
-  assert(strlen(mozquic_alpn) < 256);
-  buffer[0] = strlen(mozquic_alpn);
-  memcpy(buffer + 1, mozquic_alpn, strlen(mozquic_alpn));
-  if (SSL_SetNextProtoNego(mFD,
-                           buffer, strlen(mozquic_alpn) + 1) != SECSuccess) {
-    mNSSReady = false;
-  }
-
-  CERTCertificate *cert =
-    CERT_FindCertByNickname(CERT_GetDefaultCertDB(), originKey);
-  if (cert) {
-    SECKEYPrivateKey *key = PK11_FindKeyByAnyCert(cert, nullptr);
-    if (key) {
-      SECStatus rv = SSL_ConfigServerCert(mFD, cert, key, nullptr, 0);
-      if (mNSSReady && rv == SECSuccess) {
-        mNSSReady = true;
-      }
-    }
+  PRFileDesc *sslFD = SSL_ImportFD(model, mFD);
+  if (!sslFD) {
+    // mNSSReady stays false and the handshake fails
+    return;
   }
+  mFD = sslFD;
+  mNSSReady = true;
 
   PR_Connect(mFD, &addr, 0);
   // if you Read() from the helper, it pulls through the tls layer from the mozquic::stream0 buffer where
@@ -619,13 +868,19 @@ NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *ori
 }
 
 // client version
-NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *originKey, bool unused)
+NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *originKey, int originPort)
   : mQuicSession(quicSession)
   , mNSSReady(false)
   , mHandshakeComplete(false)
   , mHandshakeFailed(false)
   , mIsClient(true)
   , mTolerateBadALPN(tolerateBadALPN)
+  , mResumed(false)
+  , mEarlyDataAccepted(false)
+  , mTicketKey(TicketCacheKey(originKey, originPort))
+  , mBusy(false)
+  , mWorkerInputOffset(0)
+  , mWorkerResult(MOZQUIC_OK)
   , mPacketProtectionSenderKey0(nullptr)
   , mPacketProtectionReceiverKey0(nullptr)
 {
@@ -638,10 +893,15 @@ NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *ori
   SSL_OptionSet(mFD, SSL_HANDSHAKE_AS_CLIENT, true);
   SSL_OptionSet(mFD, SSL_HANDSHAKE_AS_SERVER, false);
   SSL_OptionSet(mFD, SSL_ENABLE_RENEGOTIATION, SSL_RENEGOTIATE_NEVER);
-  SSL_OptionSet(mFD, SSL_NO_CACHE, true); // todo why does this cause fails?
-  SSL_OptionSet(mFD, SSL_ENABLE_SESSION_TICKETS, false);
+  // the cache has to be on for nss to hand out tickets, but with a
+  // resumption token callback they go to ResumptionTokenCallback (and
+  // ticketCache) instead of nss's cache keyed on the stub's fake address
+  SSL_OptionSet(mFD, SSL_NO_CACHE, false);
+  SSL_OptionSet(mFD, SSL_ENABLE_SESSION_TICKETS, true);
   SSL_OptionSet(mFD, SSL_REQUEST_CERTIFICATE, false);
   SSL_OptionSet(mFD, SSL_REQUIRE_CERTIFICATE, SSL_REQUIRE_NEVER);
+  // only offered when resuming with a ticket that allows it
+  SSL_OptionSet(mFD, SSL_ENABLE_0RTT_DATA, mQuicSession->Enabled0RTT());
 
   SSL_OptionSet(mFD, SSL_ENABLE_NPN, false);
   SSL_OptionSet(mFD, SSL_ENABLE_ALPN, true);
@@ -674,6 +934,26 @@ NSSHelper::NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *ori
 
   SSL_SetURL(mFD, originKey);
 
+  if (SSL_SetResumptionTokenCallback(mFD, ResumptionTokenCallback, this) == SECSuccess) {
+    std::vector<unsigned char> ticket;
+    {
+      std::lock_guard<std::mutex> lock(ticketCacheLock);
+      auto i = ticketCache.find(mTicketKey);
+      if (i != ticketCache.end()) {
+        // tickets are single use, the server sends a new one
+        ticket.swap(i->second);
+        ticketCache.erase(i);
+      }
+    }
+    if (!ticket.empty()) {
+      if (SSL_SetResumptionToken(mFD, ticket.data(), ticket.size()) == SECSuccess) {
+        fprintf(stderr,"attempting resumption with ticket for %s\n", mTicketKey.c_str());
+      } else {
+        fprintf(stderr,"discarding unusable ticket for %s\n", mTicketKey.c_str());
+      }
+    }
+  }
+
   PRNetAddr addr;
   memset(&addr,0,sizeof(addr));
   addr.raw.family = PR_AF_INET;
@@ -686,6 +966,16 @@ NSSHelper::nssHelperWrite(PRFileDesc *fd, const void *aBuf, int32_t aAmount)
   // data (e.g. server hello) has come from nss and needs to be written into MozQuic
   // to be written out to the network in stream 0
   NSSHelper *self = reinterpret_cast<NSSHelper *>(fd->secret);
+  if (!self) {
+    // closing, see CloseFD
+    return aAmount;
+  }
+  if (self->mWorkers) {
+    // on a worker, DriveHandshake passes it on
+    const unsigned char *data = (const unsigned char *)aBuf;
+    self->mWorkerOutput.insert(self->mWorkerOutput.end(), data, data + aAmount);
+    return aAmount;
+  }
   self->mQuicSession->NSSOutput(aBuf, aAmount);
   return aAmount;
 }
@@ -703,9 +993,77 @@ NSSHelper::nssHelperRead(PRFileDesc *fd, void *buf, int32_t amount)
   // nss is asking for input, i.e. a client hello from stream 0 after
   // stream reassembly
   NSSHelper *self = reinterpret_cast<NSSHelper *>(fd->secret);
+  if (!self) {
+    PR_SetError(PR_WOULD_BLOCK_ERROR, 0);
+    return -1;
+  }
+  if (self->mWorkers) {
+    uint32_t avail = self->mWorkerInput.size() - self->mWorkerInputOffset;
+    if (!avail) {
+      PR_SetError(PR_WOULD_BLOCK_ERROR, 0);
+      return -1;
+    }
+    if ((uint32_t)amount > avail) {
+      amount = avail;
+    }
+    memcpy(buf, self->mWorkerInput.data() + self->mWorkerInputOffset, amount);
+    self->mWorkerInputOffset += amount;
+    return amount;
+  }
   return self->mQuicSession->NSSInput(buf, amount);
 }
 
+// nss sends a close_notify alert when it closes a socket that finished its
+// handshake. That is not wanted on stream 0 (which may not even be there
+// anymore), so the socket is cut off from the session first.
+void
+NSSHelper::CloseFD()
+{
+  if (!mFD) {
+    return;
+  }
+  PRFileDesc *bottom = PR_GetIdentitiesLayer(mFD, nssHelperIdentity);
+  if (bottom) {
+    bottom->secret = nullptr;
+  }
+  PR_Close(mFD);
+  mFD = nullptr;
+}
+
+void
+NSSHelper::ReleaseHandshakeState()
+{
+  assert(!mIsClient);
+  if (!mHandshakeComplete || Busy()) {
+    return;
+  }
+  CloseFD();
+  // nothing is sent with these again
+  mPacketProtectionEarly.reset();
+  mWorkers.reset();
+  std::vector<unsigned char>().swap(mWorkerInput);
+  std::vector<unsigned char>().swap(mWorkerOutput);
+  mWorkerInputOffset = 0;
+  memset(mExternalSendSecret, 0, sizeof(mExternalSendSecret));
+  memset(mExternalRecvSecret, 0, sizeof(mExternalRecvSecret));
+  fprintf(stderr,"tls handshake state released\n");
+}
+
+PRStatus
+NSSHelper::nssHelperShutdown(PRFileDesc *fd, PRIntn how)
+{
+  return PR_SUCCESS;
+}
+
+PRStatus
+NSSHelper::nssHelperClose(PRFileDesc *fd)
+{
+  // the bottom of the stack, the default close wants a layer below it
+  fd->secret = nullptr;
+  fd->dtor(fd);
+  return PR_SUCCESS;
+}
+
 int32_t
 NSSHelper::nssHelperRecv(PRFileDesc *fd, void *buf, int32_t amount, int flags,
                            PRIntervalTime timeout)
@@ -731,6 +1089,13 @@ NSSHelper::NSPRGetSocketOption(PRFileDesc *aFD, PRSocketOptionData *aOpt)
   return PR_FAILURE;
 }
 
+PRStatus
+NSSHelper::NSPRSetSocketOption(PRFileDesc *aFD, const PRSocketOptionData *aOpt)
+{
+  // nss sets options (e.g. nodelay) on the way out, there is no socket
+  return PR_SUCCESS;
+}
+
 PRStatus
 NSSHelper::nssHelperConnect(PRFileDesc *fd, const PRNetAddr *addr, PRIntervalTime to)
 {
@@ -739,6 +1104,48 @@ NSSHelper::nssHelperConnect(PRFileDesc *fd, const PRNetAddr *addr, PRIntervalTim
 
 uint32_t
 NSSHelper::DriveHandshake()
+{
+  if (!mWorkers) {
+    return DriveHandshakeNow();
+  }
+  if (Busy()) {
+    return MOZQUIC_OK;
+  }
+
+  // the last turn is done, its output goes out on stream 0
+  if (!mWorkerOutput.empty()) {
+    mQuicSession->NSSOutput(mWorkerOutput.data(), mWorkerOutput.size());
+    mWorkerOutput.clear();
+  }
+  if ((mWorkerResult != MOZQUIC_OK) || mHandshakeComplete) {
+    return mWorkerResult;
+  }
+
+  // and whatever has arrived on stream 0 since goes to the next one
+  mWorkerInput.erase(mWorkerInput.begin(), mWorkerInput.begin() + mWorkerInputOffset);
+  mWorkerInputOffset = 0;
+  bool newInput = false;
+  unsigned char buf[2048];
+  int32_t amt;
+  while ((amt = mQuicSession->NSSInput(buf, sizeof(buf))) > 0) {
+    mWorkerInput.insert(mWorkerInput.end(), buf, buf + amt);
+    newInput = true;
+  }
+  if (newInput) {
+    mBusy.store(true, std::memory_order_relaxed);
+    mWorkers->Submit(this);
+  }
+  return MOZQUIC_OK;
+}
+
+void
+NSSHelper::WorkerTurn()
+{
+  mWorkerResult = DriveHandshakeNow();
+}
+
+uint32_t
+NSSHelper::DriveHandshakeNow()
 {
   if (mHandshakeFailed) {
     return MOZQUIC_ERR_CRYPTO;
@@ -752,7 +1159,14 @@ NSSHelper::DriveHandshake()
   }
 
 
-  if (SSL_ForceHandshake(mFD) == SECSuccess) {
+  SECStatus srv = SSL_ForceHandshake(mFD);
+  // the exporters below can reset the error of a blocked handshake
+  PRErrorCode err = PR_GetError();
+  if (!mHandshakeFailed) {
+    InstallEarlyPacketProtection();
+    InstallHalfRTTSender();
+  }
+  if (srv == SECSuccess) {
     char data[256];
     int32_t rd = PR_Read(mFD, data, 256);
     if (mHandshakeComplete || (rd > 0)) {
@@ -762,16 +1176,149 @@ NSSHelper::DriveHandshake()
       fprintf(stderr,"eof on pipe?\n");
       return MOZQUIC_ERR_IO;
     }
+    err = PR_GetError();
   }
-  if (PR_GetError() == PR_WOULD_BLOCK_ERROR) {
+  if (err == PR_WOULD_BLOCK_ERROR) {
     return MOZQUIC_OK;
   }
 
   return MOZQUIC_ERR_GENERAL;
 }
 
+uint32_t
+NSSHelper::ProcessPostHandshake()
+{
+  if (!mHandshakeComplete || mHandshakeFailed) {
+    return MOZQUIC_OK;
+  }
+  // stream 0 never carries application data, this just lets nss consume
+  // what arrives after the handshake
+  char data[256];
+  while (PR_Read(mFD, data, sizeof(data)) > 0);
+  return MOZQUIC_OK;
+}
+
+SECStatus
+NSSHelper::ResumptionTokenCallback(PRFileDesc *fd, const PRUint8 *token,
+                                   unsigned int len, void *ctx)
+{
+  NSSHelper *self = reinterpret_cast<NSSHelper *>(ctx);
+  fprintf(stderr,"session ticket received for %s len=%d\n", self->mTicketKey.c_str(), len);
+  std::lock_guard<std::mutex> lock(ticketCacheLock);
+  ticketCache[self->mTicketKey].assign(token, token + len);
+  return SECSuccess;
+}
+
+uint32_t
+NSSHelper::ExportTicket(const char *originName, int originPort,
+                        unsigned char *data, uint32_t avail, uint32_t *written)
+{
+  std::lock_guard<std::mutex> lock(ticketCacheLock);
+  auto i = ticketCache.find(TicketCacheKey(originName, originPort));
+  if (i == ticketCache.end()) {
+    *written = 0;
+    return MOZQUIC_ERR_GENERAL;
+  }
+
+  PK11SlotInfo *slot = PK11_GetInternalSlot();
+  PK11SymKey *wrapKey = slot ? SlotWrapKey(slot) : nullptr;
+  if (slot) {
+    PK11_FreeSlot(slot);
+  }
+  SECItem *keyData = wrapKey ? WrapKeyData(wrapKey) : nullptr;
+  if (!keyData) {
+    fprintf(stderr,"session ticket wrapping key not exportable\n");
+    *written = 0;
+    if (wrapKey) {
+      PK11_FreeSymKey(wrapKey);
+    }
+    return MOZQUIC_ERR_CRYPTO;
+  }
+
+  // written is the size needed when avail is too small
+  *written = 5 + keyData->len + i->second.size();
+  if (!data || (avail < *written)) {
+    PK11_FreeSymKey(wrapKey);
+    return MOZQUIC_ERR_MEMORY;
+  }
+  CK_MECHANISM_TYPE mech = PK11_GetMechanism(wrapKey);
+  data[0] = mech >> 24;
+  data[1] = mech >> 16;
+  data[2] = mech >> 8;
+  data[3] = mech;
+  data[4] = keyData->len;
+  memcpy(data + 5, keyData->data, keyData->len);
+  memcpy(data + 5 + keyData->len, i->second.data(), i->second.size());
+  PK11_FreeSymKey(wrapKey);
+  return MOZQUIC_OK;
+}
+
+uint32_t
+NSSHelper::ImportTicket(const char *originName, int originPort,
+                        const unsigned char *data, uint32_t len)
+{
+  if ((len < 5) || (len < 5u + data[4]) || !data[4]) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  CK_MECHANISM_TYPE mech = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+  SECItem keyItem = {siBuffer, const_cast<unsigned char *>(data) + 5, data[4]};
+  const unsigned char *token = data + 5 + data[4];
+  uint32_t tokenLen = len - 5 - data[4];
+
+  // make sure it parses as a resumption token and hasn't expired before
+  // it can get in the way of a handshake
+  SSLResumptionTokenInfo info;
+  if (SSL_GetResumptionTokenInfo(token, tokenLen, &info, sizeof(info)) != SECSuccess) {
+    return MOZQUIC_ERR_INVALID;
+  }
+  bool expired = info.expirationTime < PR_Now();
+  SSL_DestroyResumptionTokenInfo(&info);
+  if (expired) {
+    return MOZQUIC_ERR_INVALID;
+  }
+
+  std::lock_guard<std::mutex> lock(ticketCacheLock);
+
+  // the slot only has one wrapping key. a process that hasn't cached a
+  // session yet takes the ticket's, one that has can only use tickets
+  // wrapped with its own
+  PK11SlotInfo *slot = PK11_GetInternalSlot();
+  if (!slot) {
+    return MOZQUIC_ERR_CRYPTO;
+  }
+  PK11SymKey *wrapKey = SlotWrapKey(slot);
+  if (!wrapKey) {
+    PK11SymKey *imported = PK11_ImportSymKeyWithFlags(slot, mech, PK11_OriginUnwrap, CKA_UNWRAP,
+                                                      &keyItem, CKF_WRAP | CKF_UNWRAP,
+                                                      PR_FALSE, nullptr);
+    if (imported) {
+      PK11_SetWrapKey(slot, PK11_GetCurrentWrapIndex(slot), imported);
+      PK11_FreeSymKey(imported);
+      wrapKey = SlotWrapKey(slot);
+    }
+  }
+  PK11_FreeSlot(slot);
+  SECItem *keyData = wrapKey ? WrapKeyData(wrapKey) : nullptr;
+  bool match = keyData && (SECITEM_CompareItem(keyData, &keyItem) == SECEqual);
+  if (wrapKey) {
+    PK11_FreeSymKey(wrapKey);
+  }
+  if (!match) {
+    fprintf(stderr,"session ticket for %s:%d was wrapped by another process\n",
+            originName, originPort);
+    return MOZQUIC_ERR_CRYPTO;
+  }
+
+  ticketCache[TicketCacheKey(originName, originPort)].assign(token, token + tokenLen);
+  return MOZQUIC_OK;
+}
+
 NSSHelper::~NSSHelper()
 {
+  if (mWorkers) {
+    mWorkers->Cancel(this);
+  }
+  CloseFD();
   if (mPacketProtectionSenderKey0) {
     PK11_FreeSymKey(mPacketProtectionSenderKey0);
   }
@@ -780,4 +1327,37 @@ NSSHelper::~NSSHelper()
   }
 }
 
+PK11SymKey *
+NSSHelper::GenerateHMACKey()
+{
+  PK11SlotInfo *slot = PK11_GetInternalSlot();
+  if (!slot) {
+    return nullptr;
+  }
+  PK11SymKey *key = PK11_KeyGen(slot, CKM_GENERIC_SECRET_KEY_GEN, nullptr, 32, nullptr);
+  PK11_FreeSlot(slot);
+  return key;
+}
+
+uint32_t
+NSSHelper::HMACSHA256(PK11SymKey *key, const unsigned char *data, uint32_t dataLen,
+                      unsigned char *out)
+{
+  SECItem param = {siBuffer, nullptr, 0};
+  PK11Context *context = PK11_CreateContextBySymKey(CKM_SHA256_HMAC, CKA_SIGN, key, &param);
+  if (!context) {
+    return MOZQUIC_ERR_CRYPTO;
+  }
+  unsigned int written = 0;
+  SECStatus rv = PK11_DigestBegin(context);
+  if (rv == SECSuccess) {
+    rv = PK11_DigestOp(context, data, dataLen);
+  }
+  if (rv == SECSuccess) {
+    rv = PK11_DigestFinal(context, out, &written, 32);
+  }
+  PK11_DestroyContext(context, PR_TRUE);
+  return ((rv == SECSuccess) && (written == 32)) ? MOZQUIC_OK : MOZQUIC_ERR_CRYPTO;
+}
+
 }
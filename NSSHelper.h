@@ -8,20 +8,65 @@
 #include "prio.h"
 #include "ssl.h"
 #include "pk11pub.h"
+#include "PacketProtection.h"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace mozquic {
 
 class MozQuic;
+class HandshakeWorkers;
 
 class NSSHelper final 
 {
 public:
   static int Init(char *dir);
-  NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *originKey);
-  NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *originKey, bool clientindicator); // todo, subclass
+  // server, see CreateServerModel
+  NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, PRFileDesc *model);
+  NSSHelper(MozQuic *quicSession, bool tolerateBadALPN, const char *originKey, int originPort); // client todo, subclass
   ~NSSHelper();
   uint32_t DriveHandshake();
-  bool IsHandshakeComplete() { return mHandshakeComplete; }
+  // server, DriveHandshake hands each turn of the handshake to a worker
+  // thread instead of running it. The io thread must not use the helper
+  // while it is Busy(), and nothing the turn produced (keys, completion)
+  // counts until its output has reached stream 0, so the public calls
+  // below treat it as not ready until it is Settled().
+  void UseWorkers(const std::shared_ptr<HandshakeWorkers> &workers) { mWorkers = workers; }
+  bool HandshakePending() { return mWorkers && (Busy() || !mWorkerOutput.empty()); }
+  MozQuic *Session() { return mQuicSession; }
+  bool IsHandshakeComplete() { return Settled() && mHandshakeComplete; }
+  bool IsResumed() { return mResumed; }
+
+  // 0-rtt. The client can send early data once its hello is written if it
+  // resumed with a ticket that allows it, the server can read it once nss
+  // accepts it (see EnableAntiReplay). EarlyDataAccepted is the server's
+  // answer as seen by the client when the handshake is complete.
+  bool EarlyDataReady() { return Settled() && !!mPacketProtectionEarly; }
+  bool EarlyDataAccepted() { return mEarlyDataAccepted; }
+  // the server can send 1-rtt data once its handshake flight is written
+  bool SendKeysReady() { return Settled() && !mHandshakeFailed && !!mPacketProtectionSender0; }
+  void DiscardEarlyKeys() { mPacketProtectionEarly.reset(); }
+  uint32_t EarlyEncryptBatch(AEADBlock *blocks, uint32_t count);
+  uint32_t EarlyDecryptBlock(unsigned char *aeadData, uint32_t aeadLen,
+                             unsigned char *ciphertext, uint32_t ciphertextLen,
+                             uint64_t packetNumber, unsigned char *out, uint32_t outAvail,
+                             uint32_t &written);
+  // a server only accepts 0-rtt with the process wide replay filter, which
+  // remembers client hellos for windowMS and rejects all early data for the
+  // first windowMS after it is created
+  static bool EnableAntiReplay(uint32_t windowMS);
+  // the tls socket every server connection is cloned from, with the
+  // certificate and key for originKey loaded. nullptr if they can't be
+  // found. The caller owns it (PR_Close)
+  static PRFileDesc *CreateServerModel(const char *originKey, bool enable0RTT);
+  // reads tls messages that follow the handshake on stream 0 (session tickets)
+  uint32_t ProcessPostHandshake();
+  // server, once the handshake is complete only the packet protection is
+  // needed. This frees the nss socket and everything else kept for the
+  // handshake, DriveHandshake just reports it complete afterwards.
+  void ReleaseHandshakeState();
   uint32_t HandshakeSecret(unsigned int ciphersuite, unsigned char *sendSecret, unsigned char *recvSecret);
 
   uint32_t EncryptBlock(unsigned char *aeadData, uint32_t aeadLen,
@@ -34,9 +79,37 @@ public:
                         uint64_t packetNumber, unsigned char *out, uint32_t outAvail,
                         uint32_t &written);
 
+  // independent packets processed together so the key schedule stays warm
+  // for the whole burst. Every block gets its own rv, the return is
+  // MOZQUIC_OK only if all of them succeeded.
+  uint32_t EncryptBatch(AEADBlock *blocks, uint32_t count);
+  uint32_t DecryptBatch(AEADBlock *blocks, uint32_t count);
+
+  // for things the server has to recognize later without keeping state,
+  // like stateless retry tokens. out is 32 bytes
+  static PK11SymKey *GenerateHMACKey();
+  static uint32_t HMACSHA256(PK11SymKey *key, const unsigned char *data, uint32_t dataLen,
+                             unsigned char *out);
+
+  // the client session ticket cache. It is process wide and holds the
+  // newest ticket (an nss resumption token) for each origin name and port,
+  // each ticket is used once.
+  static uint32_t ExportTicket(const char *originName, int originPort,
+                               unsigned char *data, uint32_t avail, uint32_t *written);
+  static uint32_t ImportTicket(const char *originName, int originPort,
+                               const unsigned char *data, uint32_t len);
+
 private:
+  friend class HandshakeWorkers;
+  bool Busy() { return mBusy.load(std::memory_order_acquire); }
+  bool Settled() { return !Busy() && mWorkerOutput.empty(); }
+  void CloseFD();
+  uint32_t DriveHandshakeNow();
+  void WorkerTurn();
+
   static PRStatus NSPRGetPeerName(PRFileDesc *aFD, PRNetAddr*addr);
   static PRStatus NSPRGetSocketOption(PRFileDesc *aFD, PRSocketOptionData *aOpt);
+  static PRStatus NSPRSetSocketOption(PRFileDesc *aFD, const PRSocketOptionData *aOpt);
   static PRStatus nssHelperConnect(PRFileDesc *fd, const PRNetAddr *addr, PRIntervalTime to);
   static int nssHelperWrite(PRFileDesc *aFD, const void *aBuf, int32_t aAmount);
   static int nssHelperSend(PRFileDesc *aFD, const void *aBuf, int32_t aAmount,
@@ -44,24 +117,34 @@ private:
   static int32_t nssHelperRead(PRFileDesc *fd, void *buf, int32_t amount);
   static int32_t nssHelperRecv(PRFileDesc *fd, void *buf, int32_t amount, int flags,
                                PRIntervalTime timeout);
+  static PRStatus nssHelperShutdown(PRFileDesc *fd, PRIntn how);
+  static PRStatus nssHelperClose(PRFileDesc *fd);
 
   static void HandshakeCallback(PRFileDesc *fd, void *client_data);
+  static SECStatus ResumptionTokenCallback(PRFileDesc *fd, const PRUint8 *token,
+                                           unsigned int len, void *ctx);
   static SECStatus BadCertificate(void *client_data, PRFileDesc *fd);
 
+  void InstallPacketProtection(uint16_t cipherSuite);
+  PacketProtection *MakePacketProtection(uint16_t cipherSuite, PK11SymKey *key,
+                                         const unsigned char *iv, bool encrypt);
+  void InstallEarlyPacketProtection();
+  void InstallHalfRTTSender();
   uint32_t BlockOperation(bool encrypt, unsigned char *aeadData, uint32_t aeadLen,
                           unsigned char *plaintext, uint32_t plaintextLen,
                           uint64_t packetNumber, unsigned char *out, uint32_t outAvail,
                           uint32_t &written);
-  uint32_t MakeKeyFromNSS(PRFileDesc *fd, const char *label,
-                          unsigned int secretSize, SSLHashType hashType,
+  uint32_t MakeKeyFromNSS(PRFileDesc *fd, const char *label, bool early,
+                          unsigned int secretSize, unsigned int keySize, SSLHashType hashType,
                           CK_MECHANISM_TYPE importMechanism1, CK_MECHANISM_TYPE importMechanism2,
                           unsigned char *outIV, PK11SymKey **outKey);
   uint32_t MakeKeyFromRaw(unsigned char *initialSecret,
-                          unsigned int secretSize, SSLHashType hashType,
+                          unsigned int secretSize, unsigned int keySize, SSLHashType hashType,
                           CK_MECHANISM_TYPE importMechanism1, CK_MECHANISM_TYPE importMechanism2,
                           unsigned char *outIV, PK11SymKey **outKey);
   static void GetKeyParamsFromCipherSuite(uint16_t cipherSuite,
                                           unsigned int &secretSize,
+                                          unsigned int &keySize,
                                           SSLHashType &hashType,
                                           CK_MECHANISM_TYPE &packetMechanism,
                                           CK_MECHANISM_TYPE &importMechanism1,
@@ -74,6 +157,20 @@ private:
   bool                 mHandshakeFailed; // complete but bad above nss
   bool                 mIsClient;
   bool                 mTolerateBadALPN;
+  bool                 mResumed;
+  bool                 mEarlyDataAccepted;
+  std::string          mTicketKey; // client, origin:port in the ticket cache
+
+  // handshake turns on a worker. Set while a worker owns the helper,
+  // which is the only thing ordering the buffers below between threads:
+  // the io thread fills mWorkerInput and drains mWorkerOutput only when
+  // it is clear.
+  std::shared_ptr<HandshakeWorkers> mWorkers;
+  std::atomic<bool>           mBusy;
+  std::vector<unsigned char>  mWorkerInput;  // stream 0 bytes for nss
+  uint32_t                    mWorkerInputOffset; // read by nss so far
+  std::vector<unsigned char>  mWorkerOutput; // nss bytes for stream 0
+  uint32_t                    mWorkerResult; // DriveHandshakeNow of the last turn
 
   unsigned char       mExternalSendSecret[48];
   unsigned char       mExternalRecvSecret[48];
@@ -84,6 +181,13 @@ private:
   unsigned char       mPacketProtectionSenderIV0[12];
   PK11SymKey         *mPacketProtectionReceiverKey0;
   unsigned char       mPacketProtectionReceiverIV0[12];
+
+  // the keys above are handed to these once they are derived. nss or the
+  // builtin simd code, see PacketProtection.h
+  std::unique_ptr<PacketProtection> mPacketProtectionSender0;
+  std::unique_ptr<PacketProtection> mPacketProtectionReceiver0;
+  // 0-rtt, the client seals with it and the server opens with it
+  std::unique_ptr<PacketProtection> mPacketProtectionEarly;
 };
 
 } //namespace
@@ -0,0 +1,221 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#include "MozQuic.h"
+#include "PacketProtection.h"
+#include "nss.h"
+#include "sslproto.h"
+#include "pk11pub.h"
+#include "prnetdb.h"
+#include "assert.h"
+#include <stdio.h>
+#include <string.h>
+
+// nss 3.52 added message based (CKA_NSS_MESSAGE) aead contexts, which let
+// the key schedule live in one context per direction instead of being set
+// up by every PK11_Encrypt/PK11_Decrypt call
+#if NSS_VMAJOR > 3 || (NSS_VMAJOR == 3 && NSS_VMINOR >= 52)
+#define MOZQUIC_AEAD_CONTEXTS 1
+#endif
+
+namespace mozquic {
+
+void
+PacketProtection::MakeNonce(const unsigned char *iv, uint64_t packetNumber, unsigned char *nonce)
+{
+  memcpy(nonce, iv, kNonceLen);
+  packetNumber = PR_htonll(packetNumber);
+  unsigned char *tmp = (unsigned char *)&packetNumber;
+  for(int i = 0; i < 8; ++i) {
+    nonce[i + 4] ^= tmp[i];
+  }
+}
+
+class NSSPacketProtection final : public PacketProtection
+{
+public:
+  NSSPacketProtection(CK_MECHANISM_TYPE mech, PK11SymKey *key, const unsigned char *iv,
+                      bool encrypt)
+    : mMech(mech)
+    , mKey(key)
+    , mEncryptContext(nullptr)
+    , mDecryptContext(nullptr)
+  {
+    memcpy(mIV, iv, sizeof(mIV));
+#ifdef MOZQUIC_AEAD_CONTEXTS
+    CK_MECHANISM_TYPE contextMech = mMech;
+    if (contextMech == CKM_NSS_CHACHA20_POLY1305) {
+      // the message interface only knows the pkcs11 v3 mechanism
+      contextMech = CKM_CHACHA20_POLY1305;
+    }
+    // a key is only ever used in one direction
+    SECItem param = {siBuffer, nullptr, 0};
+    PK11Context *context =
+      PK11_CreateContextBySymKey(contextMech,
+                                 CKA_NSS_MESSAGE | (encrypt ? CKA_ENCRYPT : CKA_DECRYPT),
+                                 mKey, &param);
+    if (!context) {
+      fprintf(stderr,"aead context not available, using per packet operations\n");
+    } else if (encrypt) {
+      mEncryptContext = context;
+    } else {
+      mDecryptContext = context;
+    }
+#endif
+  }
+
+  ~NSSPacketProtection()
+  {
+    if (mEncryptContext) {
+      PK11_DestroyContext(mEncryptContext, PR_TRUE);
+    }
+    if (mDecryptContext) {
+      PK11_DestroyContext(mDecryptContext, PR_TRUE);
+    }
+    if (mKey) {
+      PK11_FreeSymKey(mKey);
+    }
+  }
+
+  const char *Name() override { return "nss"; }
+
+  uint32_t Seal(AEADBlock *blocks, uint32_t count) override
+  {
+    return Batch(true, blocks, count);
+  }
+
+  uint32_t Open(AEADBlock *blocks, uint32_t count) override
+  {
+    return Batch(false, blocks, count);
+  }
+
+private:
+  // nss has no multi buffer aead entry point, so the batch runs the packets
+  // back to back through the same context. That still saves the per call
+  // setup and keeps the expanded key hot across the burst.
+  uint32_t Batch(bool encrypt, AEADBlock *blocks, uint32_t count)
+  {
+    uint32_t rv = MOZQUIC_OK;
+    for (uint32_t i = 0; i < count; i++) {
+      blocks[i].written = 0;
+      blocks[i].rv = BlockOperation(encrypt, blocks[i]);
+      if (blocks[i].rv != MOZQUIC_OK) {
+        rv = blocks[i].rv;
+      }
+    }
+    return rv;
+  }
+
+  // for encrypt outAvail should be at least inLen + 16 (for tag), for decrypt out should be at
+  // least inLen - 16 (for tag removal)
+  uint32_t BlockOperation(bool encrypt, AEADBlock &b)
+  {
+    if (encrypt ? (b.outAvail < b.inLen + kTagLen) : (b.inLen < kTagLen)) {
+      return MOZQUIC_ERR_GENERAL;
+    }
+
+    unsigned char nonce[kNonceLen];
+    MakeNonce(mIV, b.packetNumber, nonce);
+
+#ifdef MOZQUIC_AEAD_CONTEXTS
+    PK11Context *context = encrypt ? mEncryptContext : mDecryptContext;
+    if (context) {
+      // the tag follows the ciphertext on the wire
+      int outLen = 0;
+      SECStatus srv;
+      if (encrypt) {
+        srv = PK11_AEADOp(context, CKG_NO_GENERATE, 0, nonce, sizeof(nonce),
+                          b.aeadData, b.aeadLen, b.out, &outLen, b.outAvail - kTagLen,
+                          b.out + b.inLen, kTagLen, b.in, b.inLen);
+        b.written = outLen + kTagLen;
+      } else {
+        srv = PK11_AEADOp(context, CKG_NO_GENERATE, 0, nonce, sizeof(nonce),
+                          b.aeadData, b.aeadLen, b.out, &outLen, b.outAvail,
+                          b.in + b.inLen - kTagLen, kTagLen, b.in, b.inLen - kTagLen);
+        b.written = outLen;
+      }
+      if (srv != SECSuccess) {
+        b.written = 0;
+        return MOZQUIC_ERR_GENERAL;
+      }
+      return MOZQUIC_OK;
+    }
+#endif
+
+    CK_GCM_PARAMS gcmParams;
+    CK_NSS_AEAD_PARAMS polyParams;
+    unsigned char *params;
+    unsigned int paramsLength;
+    if (mMech == CKM_AES_GCM) {
+      params = (unsigned char *) &gcmParams;
+      paramsLength = sizeof(gcmParams);
+      memset(&gcmParams, 0, sizeof(gcmParams));
+      gcmParams.pIv = nonce;
+      gcmParams.ulIvLen = sizeof(nonce);
+#ifdef MOZQUIC_AEAD_CONTEXTS
+      gcmParams.ulIvBits = sizeof(nonce) * 8;
+#endif
+      gcmParams.pAAD = b.aeadData;
+      gcmParams.ulAADLen = b.aeadLen;
+      gcmParams.ulTagBits = 128;
+    } else {
+      assert (mMech == CKM_NSS_CHACHA20_POLY1305);
+      params = (unsigned char *) &polyParams;
+      paramsLength = sizeof(polyParams);
+      memset(&polyParams, 0, sizeof(polyParams));
+      polyParams.pNonce = nonce;
+      polyParams.ulNonceLen = sizeof(nonce);
+      polyParams.pAAD = b.aeadData;
+      polyParams.ulAADLen = b.aeadLen;
+      polyParams.ulTagLen = kTagLen;
+    }
+
+    unsigned int enlen = 0;
+    SECItem param = {siBuffer, params, paramsLength};
+    uint32_t rv = MOZQUIC_OK;
+    if (encrypt) {
+      rv = PK11_Encrypt(mKey, mMech, &param, b.out, &enlen, b.outAvail,
+                        b.in, b.inLen) == SECSuccess ? MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
+    } else {
+      rv = PK11_Decrypt(mKey, mMech, &param, b.out, &enlen, b.outAvail,
+                        b.in, b.inLen) == SECSuccess ? MOZQUIC_OK : MOZQUIC_ERR_GENERAL;
+    }
+    b.written = enlen;
+    return rv;
+  }
+
+  CK_MECHANISM_TYPE  mMech;
+  PK11SymKey        *mKey;
+  unsigned char      mIV[kNonceLen];
+
+  // contexts holding the expanded key, nullptr means fall back to per
+  // packet PK11_Encrypt/Decrypt. Only the one for the direction given
+  // to the constructor is created
+  PK11Context       *mEncryptContext;
+  PK11Context       *mDecryptContext;
+};
+
+PacketProtection *
+PacketProtection::CreateNSS(uint16_t cipherSuite, PK11SymKey *key, const unsigned char *iv,
+                            bool encrypt)
+{
+  CK_MECHANISM_TYPE mech;
+  if (cipherSuite == TLS_AES_128_GCM_SHA256 || cipherSuite == TLS_AES_256_GCM_SHA384) {
+    mech = CKM_AES_GCM;
+  } else if (cipherSuite == TLS_CHACHA20_POLY1305_SHA256) {
+    mech = CKM_NSS_CHACHA20_POLY1305;
+  } else {
+    if (key) {
+      PK11_FreeSymKey(key);
+    }
+    return nullptr;
+  }
+  if (!key) {
+    return nullptr;
+  }
+  return new NSSPacketProtection(mech, key, iv, encrypt);
+}
+
+} // namespace
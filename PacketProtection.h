@@ -0,0 +1,65 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include "pk11pub.h"
+
+namespace mozquic {
+
+// one packet of a batched aead operation. written and rv are filled in.
+// out may be the same as in (but not otherwise overlap it) to work in place
+struct AEADBlock
+{
+  unsigned char *aeadData;
+  uint32_t       aeadLen;
+  unsigned char *in;
+  uint32_t       inLen;
+  uint64_t       packetNumber;
+  unsigned char *out;
+  uint32_t       outAvail;
+  uint32_t       written;
+  uint32_t       rv;
+};
+
+// 1-rtt packet protection for one direction of a connection. NSS still
+// drives the handshake and derives the key and iv, the backend only does
+// the per packet aead. The 16 byte tag follows the ciphertext.
+class PacketProtection
+{
+public:
+  virtual ~PacketProtection() {}
+  virtual const char *Name() = 0;
+
+  // every block gets its own rv, the return is MOZQUIC_OK only if all of
+  // them succeeded
+  virtual uint32_t Seal(AEADBlock *blocks, uint32_t count) = 0;
+  virtual uint32_t Open(AEADBlock *blocks, uint32_t count) = 0;
+
+  // cipherSuite is the tls ciphersuite (TLS_AES_128_GCM_SHA256, etc..)
+
+  // takes ownership of key. nullptr on failure. encrypt is the direction
+  // the key is for (Seal or Open), the other one still works but without
+  // a cached context
+  static PacketProtection *CreateNSS(uint16_t cipherSuite, PK11SymKey *key,
+                                     const unsigned char *iv, bool encrypt);
+
+  // the in tree simd implementation. nullptr if the cpu does not support
+  // it or it failed its self test against nss
+  static PacketProtection *CreateBuiltin(uint16_t cipherSuite,
+                                         const unsigned char *key, unsigned int keyLen,
+                                         const unsigned char *iv);
+  static bool BuiltinAvailable(uint16_t cipherSuite);
+
+  static const uint32_t kTagLen = 16;
+  static const uint32_t kNonceLen = 12;
+  static const uint32_t kMaxKeyLen = 32;
+
+protected:
+  static void MakeNonce(const unsigned char *iv, uint64_t packetNumber, unsigned char *nonce);
+};
+
+} //namespace
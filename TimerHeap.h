@@ -0,0 +1,119 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+namespace mozquic {
+
+// Binary min heap of objects ordered by a deadline, used by the server to
+// find the connections whose next timer is due. It is intrusive: T keeps
+// its own mTimerDeadline and mTimerIndex (kNotQueued when it is not in
+// the heap), so a queued deadline can be moved or dropped in O(log n)
+// without searching for it.
+template <typename T>
+class TimerHeap
+{
+public:
+  static const uint32_t kNotQueued = 0xffffffff;
+
+  // inserts t, or moves it if it is already queued
+  void Set(T *t, uint64_t deadline)
+  {
+    if (t->mTimerIndex == kNotQueued) {
+      t->mTimerDeadline = deadline;
+      t->mTimerIndex = mHeap.size();
+      mHeap.push_back(t);
+      Up(t->mTimerIndex);
+      return;
+    }
+    bool earlier = deadline < t->mTimerDeadline;
+    t->mTimerDeadline = deadline;
+    if (earlier) {
+      Up(t->mTimerIndex);
+    } else {
+      Down(t->mTimerIndex);
+    }
+  }
+
+  void Remove(T *t)
+  {
+    uint32_t idx = t->mTimerIndex;
+    if (idx == kNotQueued) {
+      return;
+    }
+    t->mTimerIndex = kNotQueued;
+    T *last = mHeap.back();
+    mHeap.pop_back();
+    if (last == t) {
+      return;
+    }
+    Place(idx, last);
+    Up(idx);
+    Down(last->mTimerIndex);
+  }
+
+  // removes and returns the earliest object due at now, nullptr if none is
+  T *PopDue(uint64_t now)
+  {
+    if (mHeap.empty() || (mHeap[0]->mTimerDeadline > now)) {
+      return nullptr;
+    }
+    T *t = mHeap[0];
+    Remove(t);
+    return t;
+  }
+
+  uint32_t Size() const { return mHeap.size(); }
+
+private:
+  void Place(uint32_t idx, T *t)
+  {
+    mHeap[idx] = t;
+    t->mTimerIndex = idx;
+  }
+
+  void Up(uint32_t idx)
+  {
+    T *t = mHeap[idx];
+    while (idx) {
+      uint32_t parent = (idx - 1) / 2;
+      if (mHeap[parent]->mTimerDeadline <= t->mTimerDeadline) {
+        break;
+      }
+      Place(idx, mHeap[parent]);
+      idx = parent;
+    }
+    Place(idx, t);
+  }
+
+  void Down(uint32_t idx)
+  {
+    T *t = mHeap[idx];
+    uint32_t size = mHeap.size();
+    while (true) {
+      uint32_t child = idx * 2 + 1;
+      if (child >= size) {
+        break;
+      }
+      if ((child + 1 < size) &&
+          (mHeap[child + 1]->mTimerDeadline < mHeap[child]->mTimerDeadline)) {
+        child++;
+      }
+      if (t->mTimerDeadline <= mHeap[child]->mTimerDeadline) {
+        break;
+      }
+      Place(idx, mHeap[child]);
+      idx = child;
+    }
+    Place(idx, t);
+  }
+
+  std::vector<T *> mHeap;
+};
+
+} // namespace
@@ -24,6 +24,9 @@
          'MozQuic.cpp',
          'MozQuicStream.cpp',
          'NSSHelper.cpp',
+         'PacketProtection.cpp',
+         'BuiltinAEAD.cpp',
+         'HandshakeWorkers.cpp',
         ],
      },
    ],
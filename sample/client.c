@@ -18,8 +18,15 @@ Basic client connects to server, does a handshake and and waits 2 seconds.. then
 
   -send-close option will send a close before exiting
 
+  -0rtt option reconnects after the first handshake, resuming it and sending
+        any -streamtest1 data as 0-rtt
+
   -ignorePKI option will allow handshake with untrusted cert. (localhost always implies ignorePKI)
 
+  -ticket-file FILE resumes with the session ticket saved in FILE, if there is one, and
+        saves the newest ticket there after the handshake
+
+
 About Certificate Verifcation::
 The sample/nss-config directory is a sample that can be passed
 to mozquic_nss_config(). It contains a NSS database with a cert
@@ -126,6 +133,41 @@ void streamtest1(mozquic_connection_t *c)
   fprintf(stderr,"streamtest1 complete\n");
 }
 
+static void
+load_ticket(const char *fileName, const char *originName, int originPort)
+{
+  unsigned char ticket[8192];
+  FILE *f = fopen(fileName, "rb");
+  if (!f) {
+    return;
+  }
+  size_t len = fread(ticket, 1, sizeof(ticket), f);
+  fclose(f);
+  if (mozquic_import_session_ticket(originName, originPort, ticket, len) != MOZQUIC_OK) {
+    fprintf(stderr,"ticket in %s not usable\n", fileName);
+  } else {
+    fprintf(stderr,"loaded ticket from %s\n", fileName);
+  }
+}
+
+static void
+save_ticket(const char *fileName, const char *originName, int originPort)
+{
+  unsigned char ticket[8192];
+  uint32_t len;
+  if (mozquic_export_session_ticket(originName, originPort, ticket, sizeof(ticket), &len) !=
+      MOZQUIC_OK) {
+    fprintf(stderr,"no ticket to save\n");
+    return;
+  }
+  FILE *f = fopen(fileName, "wb");
+  if (f) {
+    fwrite(ticket, 1, len, f);
+    fclose(f);
+    fprintf(stderr,"saved ticket to %s\n", fileName);
+  }
+}
+
 int main(int argc, char **argv)
 {
   char *argVal;
@@ -157,6 +199,13 @@ int main(int argc, char **argv)
   config.greaseVersionNegotiation = 0;
   config.preferMilestoneVersion = 1;
   config.tolerateBadALPN = 1;
+  config.enable0RTT = has_arg(argc, argv, "-0rtt", &argVal);
+
+  char *ticketFile = NULL;
+  if (has_arg(argc, argv, "-ticket-file", &argVal)) {
+    ticketFile = argVal;
+    load_ticket(ticketFile, config.originName, config.originPort);
+  }
 
   mozquic_new_connection(&c, &config);
   mozquic_start_client(c);
@@ -175,6 +224,19 @@ int main(int argc, char **argv)
     }
   } while (i < 2000);
 
+  if (ticketFile) {
+    // the server sent its ticket after the handshake
+    save_ticket(ticketFile, config.originName, config.originPort);
+  }
+
+  if (config.enable0RTT) {
+    // reconnect with the ticket from the first connection, streamtest1
+    // then goes out as early data
+    mozquic_destroy_connection(c);
+    mozquic_new_connection(&c, &config);
+    mozquic_start_client(c);
+  }
+
   if (has_arg(argc, argv, "-streamtest1", &argVal)) {
     streamtest1(c);
   }
@@ -7,6 +7,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include "../MozQuic.h"
 #include "assert.h"
 
@@ -23,6 +24,15 @@ Basic server, does a handshake and waits forever.. it can only handle 1
   with a single message and close the stream
 
   -send-close option will send a close before exiting at 1.5sec
+  -retry option validates every client address with a stateless retry
+  -0rtt option accepts early data on resumed sessions (after a 10 second
+        anti-replay startup window)
+  -workers N option runs tls handshakes on N threads instead of the io thread
+  -release-tls option frees the tls state of each session once it is connected
+  -idle-timeout MS option closes connections that have been silent that long
+  -intake-budget N, -flush-budget N and -io-budget US options bound the work
+        done by each mozquic_IO() call
+  -memory-budget BYTES option bounds the stream data buffered by all sessions
 
   all connected sessions will be be ping at 30 sec interval.. no response after
   2 seconds closes connection
@@ -44,10 +54,18 @@ static int accept_new_connection(mozquic_connection_t *nc);
 
 struct closure_t
 {
-  int i;
+  uint64_t start;
+  uint64_t nextPing;
   int state;
 };
 
+static uint64_t now_ms()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+}
+
 int close_connection(mozquic_connection_t *c)
 {
   connected--;
@@ -130,8 +148,10 @@ static int connEventCB(void *closure, uint32_t event, void *param)
     {
       struct closure_t *data = (struct closure_t *)closure;
       mozquic_connection_t *conn = param;
-      data->i += 1;
-      if (send_close && (data->i == SEND_CLOSE_TIMEOUT_MS)) {
+      uint64_t now = now_ms();
+      // connections only get io events when something happens, the
+      // timeouts here are asked for with mozquic_schedule_io
+      if (send_close && (now - data->start >= SEND_CLOSE_TIMEOUT_MS)) {
         fprintf(stderr,"server terminating connection\n");
         close_connection(param);
         free(data);
@@ -139,9 +159,11 @@ static int connEventCB(void *closure, uint32_t event, void *param)
         fprintf(stderr,"server closing based on fin\n");
         close_connection(param);
         free(data);
-      } else if (!(data->i % TIMEOUT_CLIENT_MS)) {
+      } else if (now >= data->nextPing) {
         fprintf(stderr,"server testing conn\n");
         mozquic_check_peer(param, 2000);
+        data->nextPing = now + TIMEOUT_CLIENT_MS;
+        mozquic_schedule_io(conn, TIMEOUT_CLIENT_MS);
       }
       return MOZQUIC_OK;
     }
@@ -156,9 +178,12 @@ static int accept_new_connection(mozquic_connection_t *nc)
 {
   struct closure_t *closure = malloc(sizeof(struct closure_t));
   memset(closure, 0, sizeof (*closure));
+  closure->start = now_ms();
+  closure->nextPing = closure->start + TIMEOUT_CLIENT_MS;
   mozquic_set_event_callback(nc, connEventCB);
   mozquic_set_event_callback_closure(nc, closure);
   connected++;
+  mozquic_schedule_io(nc, send_close ? SEND_CLOSE_TIMEOUT_MS : TIMEOUT_CLIENT_MS);
   return MOZQUIC_OK;
 }
 
@@ -203,6 +228,27 @@ int main(int argc, char **argv)
 
   config.tolerateBadALPN = 1;
   config.handleIO = 0; // todo mvp
+  config.statelessRetry = has_arg(argc, argv, "-retry", &argVal);
+  config.enable0RTT = has_arg(argc, argv, "-0rtt", &argVal);
+  if (has_arg(argc, argv, "-workers", &argVal)) {
+    config.handshakeWorkers = atoi(argVal);
+  }
+  config.releaseHandshakeState = has_arg(argc, argv, "-release-tls", &argVal);
+  if (has_arg(argc, argv, "-idle-timeout", &argVal)) {
+    config.idleTimeout = atoi(argVal);
+  }
+  if (has_arg(argc, argv, "-intake-budget", &argVal)) {
+    config.intakeBudget = atoi(argVal);
+  }
+  if (has_arg(argc, argv, "-flush-budget", &argVal)) {
+    config.flushBudget = atoi(argVal);
+  }
+  if (has_arg(argc, argv, "-io-budget", &argVal)) {
+    config.ioTimeBudget = atoi(argVal);
+  }
+  if (has_arg(argc, argv, "-memory-budget", &argVal)) {
+    config.memoryBudget = strtoull(argVal, NULL, 10);
+  }
 
   mozquic_new_connection(&c, &config);
   mozquic_set_event_callback(c, connEventCB);
@@ -0,0 +1,102 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// frame parser benchmark. Walks the frames of a padded client initial the
+// way ProcessGeneralDecoded does, over and over, and reports the cost per
+// packet. make bench builds and runs it
+
+#include "../MozQuic.h"
+#include "../MozQuicInternal.h"
+#include "nss.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace mozquic {
+
+class FrameParserBench
+{
+public:
+  // returns the number of frames, 0 if the parser gave up
+  static uint32_t Walk(unsigned char *pkt, uint32_t pktSize, MozQuic *session)
+  {
+    uint32_t frames = 0;
+    uint32_t ptr = 0;
+    while (ptr < pktSize) {
+      MozQuic::FrameHeaderData result(pkt + ptr, pktSize - ptr, session);
+      if (result.mValid != MOZQUIC_OK) {
+        return 0;
+      }
+      ptr += result.mFrameLen;
+      if (result.mType == MozQuic::FRAME_TYPE_STREAM) {
+        ptr += result.u.mStream.mDataLen;
+      }
+      frames++;
+    }
+    return frames;
+  }
+};
+
+}
+
+using namespace mozquic;
+
+// the long header and the aead tag are not frames
+static const uint32_t kPayloadLen = MozQuic::kMinClientInitial - 17 - 16;
+static const uint32_t kHelloLen = 300; // about what nss sends
+static const uint32_t kDefaultIterations = 1000000;
+
+static uint64_t
+NowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int
+main(int argc, char **argv)
+{
+  uint32_t iterations = (argc > 1) ? atoi(argv[1]) : kDefaultIterations;
+  if (NSS_NoDB_Init(nullptr) != SECSuccess) {
+    fprintf(stderr, "nss init failed\n");
+    return 1;
+  }
+
+  // a stream 0 frame (1 byte id, no offset, explicit length) carrying the
+  // client hello, then padding out to the minimum initial size
+  unsigned char pkt[kPayloadLen];
+  memset(pkt, MozQuic::FRAME_TYPE_PADDING, sizeof(pkt));
+  pkt[0] = MozQuic::FRAME_TYPE_STREAM | 0x01;
+  pkt[1] = 0;
+  pkt[2] = kHelloLen >> 8;
+  pkt[3] = kHelloLen & 0xff;
+  memset(pkt + 4, 0x16, kHelloLen);
+
+  // only there for the parser to raise errors on. it owns itself, like
+  // the ones the api hands out
+  MozQuic *session = new MozQuic(false);
+  int rv = 0;
+  uint32_t frames = FrameParserBench::Walk(pkt, sizeof(pkt), session);
+  if (!frames) {
+    fprintf(stderr, "parse failed\n");
+    rv = 1;
+  } else {
+    uint64_t start = NowNs();
+    for (uint32_t i = 0; i < iterations; i++) {
+      if (FrameParserBench::Walk(pkt, sizeof(pkt), session) != frames) {
+        rv = 1;
+      }
+    }
+    uint64_t elapsed = NowNs() - start;
+    fprintf(stderr, "%d byte client initial, %d frames: %.1f ns per packet over %d\n",
+            kPayloadLen, frames, (double) elapsed / iterations, iterations);
+  }
+  session->Destroy(0, "");
+
+  NSS_Shutdown();
+  return rv;
+}
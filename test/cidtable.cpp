@@ -0,0 +1,165 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// ConnectionIDTable against a std::map. The live sizes are kept to a few
+// groups' worth so nearly every probe chain crosses full groups and runs
+// over tombstones. make check builds and runs it
+
+#include "../ConnectionIDTable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+using namespace mozquic;
+
+typedef std::map<uint64_t, uint32_t> Model;
+
+static uint64_t
+RandomCID()
+{
+  return ((uint64_t) random() << 33) ^ ((uint64_t) random() << 2) ^ random();
+}
+
+// every model entry is found with its value, and the ids that were
+// erased are not
+static bool
+Agree(ConnectionIDTable<uint32_t> &table, Model &model, std::vector<uint64_t> &gone,
+      const char *when)
+{
+  if (table.Size() != model.size()) {
+    fprintf(stderr, "%s: table has %d, model %ld\n", when, table.Size(), model.size());
+    return false;
+  }
+  for (auto i = model.begin(); i != model.end(); ++i) {
+    uint32_t *value = table.Find(i->first);
+    if (!value || (*value != i->second)) {
+      fprintf(stderr, "%s: lost %lx\n", when, i->first);
+      return false;
+    }
+  }
+  for (auto i = gone.begin(); i != gone.end(); ++i) {
+    if (!model.count(*i) && table.Contains(*i)) {
+      fprintf(stderr, "%s: erased %lx still found\n", when, *i);
+      return false;
+    }
+  }
+  return true;
+}
+
+// random inserts and erases around a target size, with the odd re-insert
+// of an erased id and duplicate insert of a live one
+static bool
+Churn(uint32_t target, uint32_t steps, bool sequential)
+{
+  ConnectionIDTable<uint32_t> table;
+  Model model;
+  std::vector<uint64_t> live, gone;
+  unsigned char key[16];
+  for (uint32_t i = 0; i < sizeof(key); i++) {
+    key[i] = random();
+  }
+  table.SetKey(key);
+  uint64_t next = RandomCID();
+
+  for (uint32_t step = 0; step < steps; step++) {
+    bool grow = live.size() < target ? (random() % 4) : !(random() % 4);
+    if (grow) {
+      uint64_t cid;
+      if (!gone.empty() && !(random() % 8)) {
+        cid = gone[random() % gone.size()];
+      } else {
+        cid = sequential ? next++ : RandomCID();
+      }
+      bool fresh = !model.count(cid);
+      if (table.Insert(cid, step) != fresh) {
+        fprintf(stderr, "insert of %lx returned %d\n", cid, !fresh);
+        return false;
+      }
+      if (fresh) {
+        model[cid] = step;
+        live.push_back(cid);
+      }
+      if (!live.empty() && !(random() % 16)) {
+        // a duplicate changes nothing
+        uint64_t dup = live[random() % live.size()];
+        if (table.Insert(dup, ~0U)) {
+          fprintf(stderr, "duplicate insert of %lx taken\n", dup);
+          return false;
+        }
+      }
+    } else if (!live.empty()) {
+      uint32_t idx = random() % live.size();
+      uint64_t cid = live[idx];
+      live[idx] = live.back();
+      live.pop_back();
+      if (!table.Erase(cid) || table.Erase(cid)) {
+        fprintf(stderr, "erase of %lx\n", cid);
+        return false;
+      }
+      model.erase(cid);
+      gone.push_back(cid);
+      if (gone.size() > 4 * target) {
+        gone.erase(gone.begin());
+      }
+    }
+    if (!(step % std::max(target, 64U)) && !Agree(table, model, gone, "churn")) {
+      return false;
+    }
+  }
+
+  // a new key moves everything
+  for (uint32_t i = 0; i < sizeof(key); i++) {
+    key[i] = random();
+  }
+  table.SetKey(key);
+  if (!Agree(table, model, gone, "rekey")) {
+    return false;
+  }
+
+  // drop every other entry through EraseIf
+  table.EraseIf([&](uint64_t cid, uint32_t &value) {
+      if (value & 1) {
+        model.erase(cid);
+        gone.push_back(cid);
+        return true;
+      }
+      return false;
+    });
+  if (!Agree(table, model, gone, "eraseif")) {
+    return false;
+  }
+
+  fprintf(stderr, "connection id table: %d steps around %d %s ids ok\n", steps, target,
+          sequential ? "sequential" : "random");
+  return true;
+}
+
+int
+main()
+{
+  srandom(1);
+  // small targets keep the table at one or two groups, packed to the
+  // load limit, so chains wrap and tombstones pile up between rehashes
+  uint32_t targets[] = { 1, 13, 14, 27, 28, 100, 5000 };
+  for (uint32_t t = 0; t < sizeof(targets) / sizeof(targets[0]); t++) {
+    if (!Churn(targets[t], 100000, false) || !Churn(targets[t], 100000, true)) {
+      return 1;
+    }
+  }
+
+  // lookups in an empty and an emptied table
+  ConnectionIDTable<uint32_t> table;
+  if (table.Find(1) || table.Erase(1)) {
+    return 1;
+  }
+  table.Insert(1, 1);
+  table.Erase(1);
+  if (table.Find(1) || table.Size()) {
+    return 1;
+  }
+  return 0;
+}
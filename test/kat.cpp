@@ -0,0 +1,186 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// known answer tests for the packet protection backends. Every vector is
+// sealed and opened by nss and, where the cpu supports it, by the builtin
+// code. make check builds and runs it
+
+#include "../MozQuic.h"
+#include "../PacketProtection.h"
+#include "nss.h"
+#include "pk11pub.h"
+#include "sslproto.h"
+#include <stdio.h>
+#include <string.h>
+#include <memory>
+
+using namespace mozquic;
+
+// the packet number is 0 so the nonce is the iv. cipher has the tag
+// appended, as on the wire
+struct Vector
+{
+  const char *name;
+  uint16_t    cipherSuite;
+  const char *key;
+  const char *iv;
+  const char *aad;
+  const char *plain;
+  const char *cipher;
+};
+
+static const Vector kVectors[] = {
+  // the gcm spec, test cases 2, 4 and 16
+  { "aes-128-gcm 2", TLS_AES_128_GCM_SHA256,
+    "00000000000000000000000000000000",
+    "000000000000000000000000",
+    "",
+    "00000000000000000000000000000000",
+    "0388dace60b6a392f328c2b971b2fe78"
+    "ab6e47d42cec13bdf53a67b21257bddf" },
+  { "aes-128-gcm 4", TLS_AES_128_GCM_SHA256,
+    "feffe9928665731c6d6a8f9467308308",
+    "cafebabefacedbaddecaf888",
+    "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+    "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+    "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+    "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+    "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091"
+    "5bc94fbc3221a5db94fae95ae7121a47" },
+  { "aes-256-gcm 16", TLS_AES_256_GCM_SHA384,
+    "feffe9928665731c6d6a8f9467308308feffe9928665731c6d6a8f9467308308",
+    "cafebabefacedbaddecaf888",
+    "feedfacedeadbeeffeedfacedeadbeefabaddad2",
+    "d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72"
+    "1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39",
+    "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+    "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662"
+    "76fc6ece0f4e1768cddf8853bb2d551b" },
+  // rfc 8439 section 2.8.2
+  { "chacha20-poly1305", TLS_CHACHA20_POLY1305_SHA256,
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f",
+    "070000004041424344454647",
+    "50515253c0c1c2c3c4c5c6c7",
+    "4c616469657320616e642047656e746c656d656e206f662074686520636c6173"
+    "73206f66202739393a204966204920636f756c64206f6666657220796f75206f"
+    "6e6c79206f6e652074697020666f7220746865206675747572652c2073756e73"
+    "637265656e20776f756c642062652069742e",
+    "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+    "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+    "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+    "3ff4def08e4b7a9de576d26586cec64b6116"
+    "1ae10b594f09e26a7e902ecbd0600691" },
+};
+
+static uint32_t
+FromHex(const char *hex, unsigned char *out)
+{
+  uint32_t len = strlen(hex) / 2;
+  for (uint32_t i = 0; i < len; i++) {
+    unsigned int byte;
+    sscanf(hex + (i * 2), "%2x", &byte);
+    out[i] = byte;
+  }
+  return len;
+}
+
+static PacketProtection *
+MakeNSS(const Vector &v, const unsigned char *key, uint32_t keyLen, const unsigned char *iv,
+        bool encrypt)
+{
+  CK_MECHANISM_TYPE mech = (v.cipherSuite == TLS_CHACHA20_POLY1305_SHA256) ?
+    CKM_NSS_CHACHA20_POLY1305 : CKM_AES_GCM;
+  PK11SlotInfo *slot = PK11_GetInternalSlot();
+  if (!slot) {
+    return nullptr;
+  }
+  SECItem keyItem = {siBuffer, const_cast<unsigned char *>(key), keyLen};
+  PK11SymKey *nssKey = PK11_ImportSymKey(slot, mech, PK11_OriginUnwrap,
+                                         CKA_ENCRYPT, &keyItem, nullptr);
+  PK11_FreeSlot(slot);
+  return PacketProtection::CreateNSS(v.cipherSuite, nssKey, iv, encrypt);
+}
+
+// seal must give the vector's cipher, open must give back the plain text
+// and refuse the cipher with a flipped bit
+static bool
+Check(const Vector &v, const char *backend, PacketProtection *sealer, PacketProtection *opener)
+{
+  unsigned char aad[64], plain[256], cipher[256 + PacketProtection::kTagLen];
+  unsigned char out[256 + PacketProtection::kTagLen];
+  uint32_t aadLen = FromHex(v.aad, aad);
+  uint32_t plainLen = FromHex(v.plain, plain);
+  uint32_t cipherLen = FromHex(v.cipher, cipher);
+
+  if (!sealer || !opener) {
+    fprintf(stderr, "%s %s: could not create\n", v.name, backend);
+    return false;
+  }
+
+  AEADBlock seal = { aad, aadLen, plain, plainLen, 0, out, sizeof(out), 0, 0 };
+  if ((sealer->Seal(&seal, 1) != MOZQUIC_OK) || (seal.written != cipherLen) ||
+      memcmp(out, cipher, cipherLen)) {
+    fprintf(stderr, "%s %s: seal mismatch\n", v.name, backend);
+    return false;
+  }
+
+  AEADBlock open = { aad, aadLen, cipher, cipherLen, 0, out, sizeof(out), 0, 0 };
+  if ((opener->Open(&open, 1) != MOZQUIC_OK) || (open.written != plainLen) ||
+      memcmp(out, plain, plainLen)) {
+    fprintf(stderr, "%s %s: open mismatch\n", v.name, backend);
+    return false;
+  }
+
+  cipher[cipherLen - 1] ^= 0x01;
+  open.written = 0;
+  if (opener->Open(&open, 1) == MOZQUIC_OK) {
+    fprintf(stderr, "%s %s: accepted a bad tag\n", v.name, backend);
+    return false;
+  }
+
+  fprintf(stderr, "%s %s: ok\n", v.name, backend);
+  return true;
+}
+
+int
+main()
+{
+  if (NSS_NoDB_Init(nullptr) != SECSuccess) {
+    fprintf(stderr, "nss init failed\n");
+    return 1;
+  }
+
+  int failures = 0;
+  for (const Vector &v : kVectors) {
+    unsigned char key[PacketProtection::kMaxKeyLen];
+    unsigned char iv[PacketProtection::kNonceLen];
+    uint32_t keyLen = FromHex(v.key, key);
+    FromHex(v.iv, iv);
+
+    std::unique_ptr<PacketProtection> sealer(MakeNSS(v, key, keyLen, iv, true));
+    std::unique_ptr<PacketProtection> opener(MakeNSS(v, key, keyLen, iv, false));
+    if (!Check(v, "nss", sealer.get(), opener.get())) {
+      failures++;
+    }
+    // each direction also has to work without its context
+    if (!Check(v, "nss reversed", opener.get(), sealer.get())) {
+      failures++;
+    }
+
+    if (!PacketProtection::BuiltinAvailable(v.cipherSuite)) {
+      fprintf(stderr, "%s builtin: not available\n", v.name);
+      continue;
+    }
+    std::unique_ptr<PacketProtection>
+      builtin(PacketProtection::CreateBuiltin(v.cipherSuite, key, keyLen, iv));
+    if (!Check(v, "builtin", builtin.get(), builtin.get())) {
+      failures++;
+    }
+  }
+
+  NSS_Shutdown();
+  fprintf(stderr, "%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,219 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// unordered reads on MozQuicStreamIn: gaps, retransmits over what has
+// already been read, reads that split a chunk, and fin only once
+// everything before it is read. make check builds and runs it
+
+#include "../MozQuic.h"
+#include "../MozQuicStream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+using namespace mozquic;
+
+static const uint32_t kStreamLen = 1024;
+
+static unsigned char
+ByteAt(uint64_t offset)
+{
+  return (offset * 7 + (offset >> 8)) & 0xff;
+}
+
+class Receiver
+{
+public:
+  Receiver(uint64_t finOffset)
+    : mIn(1)
+    , mDelivered(finOffset, false)
+    , mSupplied(finOffset, false)
+    , mFinOffset(finOffset)
+    , mFinSeen(false)
+    , mFinRecvd(false)
+  {
+    mIn.mUnordered = true;
+  }
+
+  void Supply(uint64_t offset, uint32_t len, bool fin)
+  {
+    unsigned char data[kStreamLen];
+    for (uint32_t i = 0; i < len; i++) {
+      data[i] = ByteAt(offset + i);
+      mSupplied[offset + i] = true;
+    }
+    std::unique_ptr<MozQuicStreamChunk> chunk(new MozQuicStreamChunk(1, offset, data, len, fin));
+    chunk->Charge(&mMemory);
+    mIn.Supply(chunk);
+  }
+
+  // one read of at most avail bytes, checked against what was supplied
+  // and what has been read before
+  bool Read(uint32_t avail)
+  {
+    unsigned char buffer[kStreamLen];
+    uint64_t offset;
+    uint32_t amt;
+    bool fin;
+    if (mIn.ReadUnordered(buffer, avail, offset, amt, fin) != MOZQUIC_OK) {
+      fprintf(stderr, "read failed\n");
+      return false;
+    }
+    if (amt > avail) {
+      fprintf(stderr, "read %d into %d\n", amt, avail);
+      return false;
+    }
+    for (uint32_t i = 0; i < amt; i++) {
+      if (!mSupplied[offset + i] || mDelivered[offset + i] ||
+          (buffer[i] != ByteAt(offset + i))) {
+        fprintf(stderr, "byte %ld: supplied %d delivered %d value %d\n", offset + i,
+                (int) mSupplied[offset + i], (int) mDelivered[offset + i], buffer[i]);
+        return false;
+      }
+      mDelivered[offset + i] = true;
+    }
+    if (fin) {
+      if (!AllDelivered()) {
+        fprintf(stderr, "fin before everything was read\n");
+        return false;
+      }
+      mFinSeen = true;
+    }
+    return Consistent();
+  }
+
+  // Readable counts what has arrived and not been read, and Empty agrees
+  bool Consistent()
+  {
+    uint64_t pending = 0;
+    for (uint64_t i = 0; i < mFinOffset; i++) {
+      pending += mSupplied[i] && !mDelivered[i];
+    }
+    if (mIn.Readable() != pending) {
+      fprintf(stderr, "readable %ld, %ld pending\n", mIn.Readable(), pending);
+      return false;
+    }
+    bool finPending = !mFinSeen && AllDelivered() && mFinRecvd;
+    if (mIn.Empty() != (!pending && !finPending && !mFinSeen)) {
+      fprintf(stderr, "empty %d with %ld pending\n", (int) mIn.Empty(), pending);
+      return false;
+    }
+    return true;
+  }
+
+  bool AllDelivered()
+  {
+    for (uint64_t i = 0; i < mFinOffset; i++) {
+      if (!mDelivered[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  MozQuicStreamIn   mIn;
+  MemoryAccount     mMemory;
+  std::vector<bool> mDelivered;
+  std::vector<bool> mSupplied;
+  uint64_t          mFinOffset;
+  bool              mFinSeen;
+  bool              mFinRecvd; // set by the caller with the fin
+};
+
+#define CHECK(x) if (!(x)) { fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #x); return false; }
+
+static bool
+Scripted()
+{
+  // a gap is read around, and the fin waits for it
+  {
+    Receiver r(300);
+    r.Supply(100, 200, true);
+    r.mFinRecvd = true;
+    CHECK(r.Read(50));   // splits the chunk
+    CHECK(r.Read(1000));
+    CHECK(!r.mFinSeen);
+    r.Supply(0, 100, false);
+    CHECK(r.Read(1000));
+    CHECK(r.mFinSeen);
+    CHECK(r.mIn.Done());
+  }
+  // a retransmit over read data gives only the new part
+  {
+    Receiver r(200);
+    r.Supply(0, 50, false);
+    CHECK(r.Read(1000));
+    r.Supply(0, 120, false);
+    CHECK(r.Read(1000));
+    r.Supply(20, 180, true);
+    r.mFinRecvd = true;
+    CHECK(r.Read(1000));
+    CHECK(r.mFinSeen);
+  }
+  // a retransmit of a range read out of order, before the gap fills
+  {
+    Receiver r(100);
+    r.Supply(60, 40, true);
+    r.mFinRecvd = true;
+    CHECK(r.Read(1000));
+    r.Supply(40, 60, true);
+    CHECK(r.Read(1000));
+    r.Supply(0, 40, false);
+    CHECK(r.Read(10));
+    CHECK(r.Read(1000));
+    CHECK(r.mFinSeen);
+  }
+  return true;
+}
+
+// random ranges, retransmits and read sizes until everything is read
+static bool
+Random(uint32_t seed)
+{
+  srandom(seed);
+  Receiver r(kStreamLen);
+  uint32_t rounds = 0;
+  while (!r.mFinSeen) {
+    if (++rounds > 100000) {
+      fprintf(stderr, "seed %d never finished\n", seed);
+      return false;
+    }
+    if (random() % 3) {
+      uint64_t offset = random() % kStreamLen;
+      uint32_t len = 1 + random() % std::min<uint64_t>(200, kStreamLen - offset);
+      bool fin = (offset + len) == kStreamLen;
+      r.Supply(offset, len, fin);
+      r.mFinRecvd = r.mFinRecvd || fin;
+      if (!r.Consistent()) {
+        return false;
+      }
+    } else if (!r.Read(1 + random() % 300)) {
+      fprintf(stderr, "seed %d\n", seed);
+      return false;
+    }
+  }
+  if (!r.mIn.Done() || r.mMemory.mBytes) {
+    fprintf(stderr, "seed %d: done %d, %ld bytes still charged\n", seed,
+            (int) r.mIn.Done(), r.mMemory.mBytes);
+    return false;
+  }
+  return true;
+}
+
+int
+main()
+{
+  if (!Scripted()) {
+    return 1;
+  }
+  for (uint32_t seed = 1; seed <= 40; seed++) {
+    if (!Random(seed)) {
+      return 1;
+    }
+  }
+  fprintf(stderr, "unordered stream reads ok\n");
+  return 0;
+}
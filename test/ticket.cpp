@@ -0,0 +1,180 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// a session ticket exported by one client process resumes from the next
+// one against the same server process, and a client that has already
+// made a connection of its own refuses it. make check builds and runs
+// it, from the top directory for sample/nss-config
+
+#include "../MozQuic.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+static const char *kServerName = "foo.example.com";
+static const char *kClientName = "localhost";
+static const int kPort = 4437;
+static const uint32_t kTimeoutMS = 5000;
+
+static int
+ServerEvent(void *closure, uint32_t event, void *param)
+{
+  if (event == MOZQUIC_EVENT_CLOSE_CONNECTION || event == MOZQUIC_EVENT_ERROR) {
+    mozquic_destroy_connection((mozquic_connection_t *) param);
+  }
+  return MOZQUIC_OK;
+}
+
+static int
+ClientEvent(void *closure, uint32_t event, void *param)
+{
+  return MOZQUIC_OK;
+}
+
+static void
+RunServer()
+{
+  if (mozquic_nss_config((char *) "sample/nss-config") != MOZQUIC_OK) {
+    fprintf(stderr, "server nss config failed\n");
+    exit(1);
+  }
+  struct mozquic_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.originName = kServerName;
+  config.originPort = kPort;
+  config.tolerateBadALPN = 1;
+  mozquic_connection_t *c;
+  mozquic_new_connection(&c, &config);
+  mozquic_set_event_callback(c, ServerEvent);
+  mozquic_start_server(c);
+  while (1) {
+    usleep(1000);
+    mozquic_IO(c);
+  }
+}
+
+// connects, with the ticket in fileName when importIt is set, and saves
+// the new ticket there. exits 0 when resumption came out as expected
+static void
+RunClient(const char *fileName, bool connectFirst, bool importIt, bool expectResumed)
+{
+  if (mozquic_nss_config((char *) "sample/nss-config") != MOZQUIC_OK) {
+    fprintf(stderr, "client nss config failed\n");
+    exit(1);
+  }
+  struct mozquic_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.originName = kClientName;
+  config.originPort = kPort;
+  config.tolerateBadALPN = 1;
+  config.preferMilestoneVersion = 1;
+  config.connection_event_callback = ClientEvent;
+
+  unsigned char ticket[8192];
+  uint32_t len = 0;
+  for (int conn = connectFirst ? 0 : 1; conn < 2; conn++) {
+    if (conn == 1 && importIt) {
+      FILE *f = fopen(fileName, "rb");
+      len = f ? fread(ticket, 1, sizeof(ticket), f) : 0;
+      if (f) {
+        fclose(f);
+      }
+      int rv = mozquic_import_session_ticket(kClientName, kPort, ticket, len);
+      // only a process without a connection of its own can take it
+      if ((rv == MOZQUIC_OK) != !connectFirst) {
+        fprintf(stderr, "import returned %d\n", rv);
+        exit(1);
+      }
+      if (rv != MOZQUIC_OK) {
+        exit(0);
+      }
+    }
+
+    mozquic_connection_t *c;
+    mozquic_new_connection(&c, &config);
+    mozquic_start_client(c);
+    // the ticket comes after the handshake
+    uint32_t ms = 0;
+    while (mozquic_export_session_ticket(kClientName, kPort, ticket, sizeof(ticket), &len) !=
+           MOZQUIC_OK) {
+      if (++ms > kTimeoutMS) {
+        fprintf(stderr, "no ticket after %dms\n", kTimeoutMS);
+        exit(1);
+      }
+      usleep(1000);
+      mozquic_IO(c);
+    }
+    struct mozquic_stats_t stats;
+    mozquic_get_stats(c, &stats);
+    if (conn == 1 && (stats.sessionResumed != (expectResumed ? 1 : 0))) {
+      fprintf(stderr, "resumed %d, expected %d\n", (int) stats.sessionResumed,
+              (int) expectResumed);
+      exit(1);
+    }
+    mozquic_destroy_connection(c);
+  }
+
+  FILE *f = fopen(fileName, "wb");
+  if (!f || fwrite(ticket, 1, len, f) != len) {
+    fprintf(stderr, "can not write %s\n", fileName);
+    exit(1);
+  }
+  fclose(f);
+  exit(0);
+}
+
+static pid_t
+Spawn(void (*fn)())
+{
+  pid_t pid = fork();
+  if (!pid) {
+    fn();
+    exit(1);
+  }
+  return pid;
+}
+
+static char sFileName[] = "/tmp/mozquic-ticket-XXXXXX";
+static void FirstClient() { RunClient(sFileName, false, false, false); }
+static void RestartedClient() { RunClient(sFileName, false, true, true); }
+static void BusyClient() { RunClient(sFileName, true, true, false); }
+
+static bool
+Check(const char *name, void (*fn)())
+{
+  int status;
+  if ((waitpid(Spawn(fn), &status, 0) < 0) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+    fprintf(stderr, "%s failed\n", name);
+    return false;
+  }
+  return true;
+}
+
+int
+main()
+{
+  int fd = mkstemp(sFileName);
+  if (fd < 0) {
+    return 1;
+  }
+  close(fd);
+
+  pid_t server = Spawn(RunServer);
+  usleep(200000);
+  bool ok = Check("first client", FirstClient) &&
+    Check("restarted client", RestartedClient) &&
+    Check("client with its own connection", BusyClient);
+  kill(server, SIGKILL);
+  waitpid(server, nullptr, 0);
+  unlink(sFileName);
+  if (!ok) {
+    return 1;
+  }
+  fprintf(stderr, "session tickets across client processes ok\n");
+  return 0;
+}
@@ -0,0 +1,121 @@
+/* -*- Mode: C++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*-
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// TimerHeap against a std::multimap doing the same random inserts, moves,
+// removes and pops. make check builds and runs it
+
+#include "../TimerHeap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+
+using namespace mozquic;
+
+struct Item
+{
+  uint64_t mTimerDeadline;
+  uint32_t mTimerIndex;
+};
+
+typedef std::multimap<uint64_t, Item *> Model;
+
+static const uint32_t kItems = 64;
+static const uint32_t kSteps = 200000;
+static const uint64_t kDeadlineRange = 100; // small, so there are ties
+
+static Item sItems[kItems];
+static Model::iterator sQueued[kItems];
+static bool sInModel[kItems];
+
+static void
+ModelRemove(Model &model, uint32_t i)
+{
+  if (sInModel[i]) {
+    model.erase(sQueued[i]);
+    sInModel[i] = false;
+  }
+}
+
+static void
+ModelSet(Model &model, uint32_t i, uint64_t deadline)
+{
+  ModelRemove(model, i);
+  sQueued[i] = model.insert(std::make_pair(deadline, &sItems[i]));
+  sInModel[i] = true;
+}
+
+// pops everything due at now from both and checks they agree
+static bool
+PopDue(TimerHeap<Item> &heap, Model &model, uint64_t now)
+{
+  Item *t;
+  while ((t = heap.PopDue(now))) {
+    uint32_t i = t - sItems;
+    if (model.empty() || !sInModel[i] || (model.begin()->first != t->mTimerDeadline) ||
+        (t->mTimerDeadline > now) || (t->mTimerIndex != TimerHeap<Item>::kNotQueued)) {
+      fprintf(stderr, "popped %d at %ld, not the earliest due\n", i, t->mTimerDeadline);
+      return false;
+    }
+    ModelRemove(model, i);
+  }
+  if (!model.empty() && (model.begin()->first <= now)) {
+    fprintf(stderr, "%ld is due at %ld but was not popped\n", model.begin()->first, now);
+    return false;
+  }
+  return true;
+}
+
+int
+main()
+{
+  TimerHeap<Item> heap;
+  Model model;
+  srandom(1);
+  for (uint32_t i = 0; i < kItems; i++) {
+    sItems[i].mTimerIndex = TimerHeap<Item>::kNotQueued;
+  }
+
+  uint64_t now = 0;
+  for (uint32_t step = 0; step < kSteps; step++) {
+    uint32_t i = random() % kItems;
+    switch (random() % 4) {
+    case 0:
+    case 1:
+      // inserts, or moves earlier or later when already queued
+      {
+        uint64_t deadline = now + (random() % kDeadlineRange);
+        heap.Set(&sItems[i], deadline);
+        ModelSet(model, i, deadline);
+      }
+      break;
+    case 2:
+      // also removes what is not queued, which has to be a no-op
+      heap.Remove(&sItems[i]);
+      ModelRemove(model, i);
+      if (sItems[i].mTimerIndex != TimerHeap<Item>::kNotQueued) {
+        fprintf(stderr, "%d still indexed after remove\n", i);
+        return 1;
+      }
+      break;
+    case 3:
+      now += random() % (kDeadlineRange / 4);
+      if (!PopDue(heap, model, now)) {
+        return 1;
+      }
+      break;
+    }
+    if (heap.Size() != model.size()) {
+      fprintf(stderr, "step %d: heap has %d, model %ld\n", step, heap.Size(), model.size());
+      return 1;
+    }
+  }
+
+  // whatever is left drains in deadline order
+  if (!PopDue(heap, model, ~0ULL) || heap.Size()) {
+    return 1;
+  }
+  fprintf(stderr, "timer heap: %d random steps ok\n", kSteps);
+  return 0;
+}